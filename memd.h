@@ -4,308 +4,5722 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
+#ifdef __cplusplus
+#include <cstddef>
+#include <memory>
+#include <new>
+#if __cplusplus >= 202002L && defined(__has_include)
+#if __has_include(<source_location>)
+#include <source_location>
+#define MEMD_HAS_SOURCE_LOCATION 1
+#endif
+#endif
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define MEMD_HAS_PMR 1
+#endif
+#endif
+
+namespace memd {
+
+#ifdef MEMD_HAS_SOURCE_LOCATION
+typedef std::source_location source_location;
+#define MEMD_CURRENT_LOCATION() std::source_location::current()
+#else
 /** 
- * Define USE_MEMD before including this file to enable MEMD functionality.
- * This allows MEMD to be easily enabled or disabled for different builds.
+ * Minimal stand-in for std::source_location on pre-C++20 compilers.
  */
-#ifdef USE_MEMD
+struct source_location {
+    const char *file; /**< The source file. */
+    uint32_t ln;      /**< The source line. */
+    source_location(const char *f, uint32_t l) : file(f), ln(l) {}
+    const char *file_name() const { return file; }
+    uint32_t line() const { return ln; }
+};
+#if defined(__GNUC__) || defined(__clang__)
+#define MEMD_CURRENT_LOCATION() memd::source_location(__builtin_FILE(), (uint32_t)__builtin_LINE())
+#else
+#define MEMD_CURRENT_LOCATION() memd::source_location(__FILE__, __LINE__)
+#endif
+#endif
+
+} // namespace memd
 
 /** 
- * Maximum number of memory allocations MEMD will track.
+ * Declares a container tag type for memd::tracking_allocator.
+ * The tag carries its name and the source location of its declaration, so the
+ * allocator itself stays stateless.
  */
-#define MEMD_MAX_ALLOCATIONS 1000
+#define MEMD_CONTAINER_TAG(id) \
+    struct id { \
+        static const char *name() { return #id; } \
+        static memd::source_location where() { return MEMD_CURRENT_LOCATION(); } \
+    }
+#endif // __cplusplus
 
 /** 
- * Maximum number of warnings MEMD will store.
+ * Handle to a user pool or arena allocator registered with memd_pool_create.
  */
-#define MEMD_MAX_WARNINGS 1000 
+typedef struct MEMD_Pool MEMD_Pool;
 
 /** 
- * Macro to record a warning with contextual information.
- * Stores warnings up to MEMD_MAX_WARNINGS in MEMD_Data.warnings.
+ * Struct to represent a user pool allocator.
+ * The records of a pool are chained through MEMD_Mem.pool_next, so a reset
+ * only visits the records of that pool.
  */
-#define WARN(msg, line, file) \
-    if (MEMD_Data.warning_count < MEMD_MAX_WARNINGS) { \
-        MEMD_Warning *warning = &MEMD_Data.warnings[MEMD_Data.warning_count++]; \
-        snprintf(warning->message, sizeof(warning->message), "%s", msg); \
-        warning->line = line; \
-        warning->file = file; \
-    }
+struct MEMD_Pool {
+    const char *name;  /**< Name of the pool. */
+    int32_t first;     /**< Index of the first record of the pool, or -1. */
+    size_t live_count; /**< Number of sub-allocations currently live. */
+    size_t live_size;  /**< Bytes currently handed out by the pool. */
+    size_t peak_size;  /**< Highest value live_size has reached. */
+};
 
 /** 
- * Struct to represent a memory allocation event.
+ * Alignment of every block handed out by a MEMD arena.
  */
-typedef struct {
-    size_t address; /**< The memory address allocated. */
-    size_t size;    /**< The size of the allocation. */
-    uint32_t line;  /**< The source line where the allocation occurred. */
-    const char *file; /**< The source file where the allocation occurred. */
-} MEMD_Mem;
+#ifndef MEMD_ARENA_ALIGNMENT
+#define MEMD_ARENA_ALIGNMENT 16
+#endif
 
 /** 
- * Struct to represent a warning generated by MEMD.
+ * Arenas poison their memory on reset to catch use-after-reset. This is on by
+ * default when MEMD is enabled; define MEMD_ARENA_POISON to a byte value, e.g.
+ * -DMEMD_ARENA_POISON=0xDD, to force it on.
  */
-typedef struct {
-    char message[128]; /**< Warning message. */
-    uint32_t line;     /**< The source line where the warning was generated. */
-    const char *file;  /**< The source file where the warning was generated. */
-} MEMD_Warning;
+#if defined(USE_MEMD) && !defined(MEMD_ARENA_POISON)
+#define MEMD_ARENA_POISON 0xDD
+#endif
 
 /** 
- * Global structure to store tracking and warning data.
+ * Struct to represent a chunk of a MEMD arena. The memory handed out follows
+ * the (aligned) header.
  */
-struct {
-    MEMD_Mem mem[MEMD_MAX_ALLOCATIONS]; /**< Array of tracked memory allocations. */
-    size_t total_allocated_size; /**< Total size of all allocated memory. */
-    size_t total_free_size; /**< Total size of all freed memory. */
-    MEMD_Warning warnings[MEMD_MAX_WARNINGS]; /**< Array of generated warnings. */
-    int warning_count; /**< Number of generated warnings. */
-} MEMD_Data;
+typedef struct MEMD_ArenaChunk {
+    struct MEMD_ArenaChunk *next; /**< Next chunk of the arena. */
+    size_t size; /**< Usable size of the chunk. */
+    size_t used; /**< Bytes handed out from the chunk since the last reset. */
+} MEMD_ArenaChunk;
 
 /** 
- * Returns a ptr to an allocated buffer wich contains the report of memory allocations and warnings.
- * Should be called before application exit to report potential memory leaks.
- * Don't forget to free it with 'memd_report_free' when not needed anymore, MEMD won't report it in this case ;)
+ * Live blocks an arena handed out to one call site since its last reset.
  */
-char* memd_report();
+typedef struct MEMD_ArenaSite {
+    struct MEMD_Site *site; /**< The call site. */
+    size_t live_count;      /**< Number of live blocks. */
+    size_t live_size;       /**< Bytes of the live blocks. */
+} MEMD_ArenaSite;
 
-/**
- * Free a report created from MEMD.
- * This is important, since MEMD won't report the leak in this case.
-*/
-void memd_report_free(char* ptr);
+/** 
+ * Struct to represent a bump-pointer arena allocator.
+ * When MEMD is enabled the blocks are counted per call site instead of being
+ * recorded one by one, so an arena never fills the allocation table and a
+ * bump stays O(1).
+ */
+typedef struct MEMD_Arena {
+    const char *name;          /**< Name of the arena. */
+    MEMD_ArenaChunk *first;    /**< First chunk of the arena. */
+    MEMD_ArenaChunk *current;  /**< Chunk blocks are currently bumped from. */
+    size_t chunk_size;         /**< Minimal size of new chunks. */
+    size_t chunk_count;        /**< Number of chunks owned by the arena. */
+    size_t reserved_size;      /**< Total usable size of all chunks. */
+    size_t used_size;          /**< Bytes handed out since the last reset. */
+    size_t peak_size;          /**< Highest value used_size has reached. */
+    size_t alloc_count;        /**< Number of blocks handed out since creation. */
+    size_t reset_count;        /**< Number of resets since creation. */
+    MEMD_ArenaSite *sites;     /**< Call sites of the live blocks when MEMD is enabled. */
+    size_t site_count;         /**< Number of entries in sites. */
+    size_t site_capacity;      /**< Number of entries sites has room for. */
+    struct MEMD_Arena *next;   /**< Next arena in MEMD's list of arenas. */
+} MEMD_Arena;
 
-#ifdef MEMD_IMPLEMENTATION
+/** 
+ * Creates an arena that grows in chunks of at least chunk_size bytes.
+ * @return Pointer to the arena, or NULL if out of memory.
+ */
+MEMD_Arena *memd_arena_create(const char *name, size_t chunk_size);
 
 /** 
- * Flag to ignore memory tracking for specific operations.
+ * Allocates size bytes from the arena by bumping a pointer, adding a chunk if needed.
+ * @return Pointer to the block aligned to MEMD_ARENA_ALIGNMENT, or NULL if out of memory.
  */
-int _memd_ignore = 0;
+void *memd_arena_alloc(MEMD_Arena *arena, size_t size);
 
 /** 
- * Finds a tracked memory allocation by its address.
- * @return Pointer to the tracked memory allocation, or NULL if not found.
+ * Releases all blocks of the arena at once, keeping its chunks for reuse.
  */
-MEMD_Mem *_find_by_address(size_t address) {
-    for (uint32_t i = 0; i < MEMD_MAX_ALLOCATIONS; i++) {
-        if (MEMD_Data.mem[i].address == address)
-            return &MEMD_Data.mem[i];
-    }
+void memd_arena_reset(MEMD_Arena *arena);
 
-    return NULL;
-}
+/** 
+ * Releases all blocks and chunks of the arena and the arena itself.
+ */
+void memd_arena_destroy(MEMD_Arena *arena);
 
 /** 
- * Records a memory allocation.
+ * Heap dump file format written by memd_heap_dump. The file starts with a
+ * MEMD_DumpHeader followed by chunks, each a MEMD_DumpChunk and length bytes
+ * of records. Every record is padded to a multiple of 8 bytes. Integers are in
+ * the byte order of the writing machine, given by the byte order mark.
+ *   MEMD_DUMP_SITES:  MEMD_DumpSite, then the file, func, type and tag strings
+ *   MEMD_DUMP_BLOCKS: MEMD_DumpBlock, then stored bytes of the block's contents
+ *   MEMD_DUMP_ROOTS:  MEMD_DumpBlock with site 0, then the range's contents
+ *   MEMD_DUMP_END:    empty, always the last chunk
  */
-void _insert(size_t address, size_t size, uint32_t line, const char *file) {
-    // check for null
-    if (address == 0) {
-        WARN("Memory allocation failed", line, file);
-        return;
-    }
+#define MEMD_DUMP_MAGIC "MEMDHEAP"
+#define MEMD_DUMP_VERSION 1
+#define MEMD_DUMP_BYTE_ORDER 0x01020304u
+#define MEMD_DUMP_SITES "SITE"
+#define MEMD_DUMP_BLOCKS "BLCK"
+#define MEMD_DUMP_ROOTS "ROOT"
+#define MEMD_DUMP_END "END "
 
-    MEMD_Mem *mem = _find_by_address(0);
-    // if the return value is null we need to increase the MEMD_MAX_ALLOCATIONS value
-    if (mem == NULL) {
-        WARN("Max allocations reached", line, file);
-        return;
-    }
+/** 
+ * Flag of blocks whose contents were not stored, since the chunk of the user
+ * pool they were carved from may be gone.
+ */
+#define MEMD_DUMP_POOL_BLOCK 1
 
-    // save all the allocation info
-    mem->address = address;
-    mem->size = size;
-    mem->line = line;
-    mem->file = file;
-    MEMD_Data.total_allocated_size += size;
+typedef struct {
+    char magic[8];       /**< MEMD_DUMP_MAGIC. */
+    uint32_t version;    /**< MEMD_DUMP_VERSION. */
+    uint32_t byte_order; /**< MEMD_DUMP_BYTE_ORDER as written by the dumping machine. */
+} MEMD_DumpHeader;
+
+typedef struct {
+    char type[4];    /**< One of the MEMD_DUMP_* chunk types. */
+    uint32_t count;  /**< Number of records in the chunk. */
+    uint64_t length; /**< Bytes of records following the chunk header. */
+} MEMD_DumpChunk;
+
+typedef struct {
+    uint32_t id;          /**< Site id, referenced by blocks. */
+    uint32_t line;        /**< Source line of the site. */
+    uint32_t file_length; /**< Length of the file name. */
+    uint32_t func_length; /**< Length of the function name, 0 if unknown. */
+    uint32_t type_length; /**< Length of the type name of MEMD_NEW sites. */
+    uint32_t tag_length;  /**< Length of the container tag. */
+} MEMD_DumpSite;
+
+typedef struct {
+    uint64_t address; /**< Address of the block or root range. */
+    uint64_t size;    /**< Size of the block or root range. */
+    uint64_t stored;  /**< Bytes of contents following the record. */
+    uint32_t site;    /**< Id of the allocating site, 0 for root ranges. */
+    uint32_t flags;   /**< MEMD_DUMP_POOL_BLOCK or 0. */
+} MEMD_DumpBlock;
+
+/** 
+ * Event log file format written between memd_event_log_open and
+ * memd_event_log_close. It has the layout of heap dumps with its own magic:
+ *   MEMD_EVENT_EVENTS: MEMD_EventBase, then count encoded events of one thread
+ *   MEMD_DUMP_SITES:   the call sites, written when the log is closed
+ *   MEMD_DUMP_END:     empty, always the last chunk
+ * Each event starts with a byte holding the event type in bits 0-1, the
+ * MEMD_EVENT_SAME_SITE and MEMD_EVENT_SCALED flags, and the distance to the
+ * thread's previous sequence number minus 1 in bits 4-7, where 15 means a
+ * varint with the rest follows. Allocations then have the site id and size
+ * as varints, unless they repeat the thread's previous ones. Last comes the
+ * zigzag varint distance to the thread's previous address.
+ */
+#define MEMD_EVENT_MAGIC "MEMDEVNT"
+#define MEMD_EVENT_VERSION 1
+#define MEMD_EVENT_EVENTS "EVNT"
+#define MEMD_EVENT_ALLOC 0
+#define MEMD_EVENT_FREE 1
+#define MEMD_EVENT_SAME_SITE 0x04 /**< Allocation of the previous site and size. */
+#define MEMD_EVENT_SCALED 0x08    /**< Address distance is in units of 16 bytes. */
+
+/** 
+ * Values the first event of a chunk is encoded against.
+ */
+typedef struct {
+    uint64_t sequence; /**< Sequence number before the first event. */
+    uint64_t address;  /**< Address of the first event. */
+    uint32_t thread;   /**< Number of the thread, counted from 1. */
+    uint32_t reserved; /**< Always 0. */
+} MEMD_EventBase;
+
+/** 
+ * A decoded allocation or free.
+ */
+typedef struct {
+    uint32_t type;     /**< MEMD_EVENT_ALLOC or MEMD_EVENT_FREE. */
+    uint32_t thread;   /**< Thread that made the call. */
+    uint32_t site;     /**< Site id of the allocation, or 0 for frees. */
+    uint64_t sequence; /**< Position of the event among the events of all threads. */
+    uint64_t address;  /**< Address of the block. */
+    uint64_t size;     /**< Size of the allocation, or 0 for frees. */
+} MEMD_Event;
+
+/** 
+ * Streaming decoder of the events of a MEMD_EVENT_EVENTS chunk.
+ */
+typedef struct {
+    const unsigned char *cursor; /**< Next encoded event. */
+    const unsigned char *end;    /**< End of the encoded events. */
+    uint32_t remaining;          /**< Number of events left. */
+    uint32_t thread;             /**< Thread of the chunk. */
+    uint32_t site;               /**< Site id of the previous allocation. */
+    uint64_t sequence;           /**< Sequence number of the previous event. */
+    uint64_t address;            /**< Address of the previous event. */
+    uint64_t size;               /**< Size of the previous allocation. */
+} MEMD_EventReader;
+
+/** 
+ * Starts decoding a chunk of count events from its length bytes of payload.
+ */
+static inline void memd_event_reader_init(MEMD_EventReader *reader, const void *payload, uint64_t length, uint32_t count) {
+    MEMD_EventBase base;
+    memset(reader, 0, sizeof(*reader));
+    if (length < sizeof(base))
+        return;
+    memcpy(&base, payload, sizeof(base));
+    reader->cursor = (const unsigned char *)payload + sizeof(base);
+    reader->end = (const unsigned char *)payload + length;
+    reader->remaining = count;
+    reader->thread = base.thread;
+    reader->sequence = base.sequence;
+    reader->address = base.address;
 }
 
 /** 
- * Removes a tracked memory allocation, marking it as freed.
- * @return -1 on failure (e.g., double free detected), 0 on success.
+ * Reads a varint of the events of reader.
+ * @return 0 on success, or -1 if it runs past the chunk.
  */
-int _erase(size_t address, uint32_t line, const char *file) {
-    if (address == 0) {
-        WARN("Tried to free a null ptr", line, file);
-        return -1;
+static inline int _memd_event_varint(MEMD_EventReader *reader, uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; shift < 64 && reader->cursor < reader->end; shift += 7) {
+        unsigned char byte = *reader->cursor++;
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+            return 0;
     }
+    return -1;
+}
 
-    MEMD_Mem *mem = _find_by_address(address);
-    // if the address is not found we assume it is already deleted
-    if (mem == NULL) {
-        WARN("Double free detected", line, file);
+/** 
+ * Decodes the next event of a chunk.
+ * @return 1 if an event was decoded, 0 at the end of the chunk, or -1 if the
+ * chunk is malformed.
+ */
+static inline int memd_event_next(MEMD_EventReader *reader, MEMD_Event *event) {
+    if (reader->remaining == 0)
+        return 0;
+    if (reader->cursor >= reader->end)
         return -1;
+    unsigned header = *reader->cursor++;
+    uint64_t distance = header >> 4, extra, moved;
+    if (distance == 15) {
+        if (_memd_event_varint(reader, &extra) != 0)
+            return -1;
+        distance += extra;
     }
+    event->type = header & 3;
+    if (event->type == MEMD_EVENT_ALLOC && (header & MEMD_EVENT_SAME_SITE) == 0) {
+        uint64_t site;
+        if (_memd_event_varint(reader, &site) != 0 || _memd_event_varint(reader, &reader->size) != 0)
+            return -1;
+        reader->site = (uint32_t)site;
+    }
+    if (_memd_event_varint(reader, &moved) != 0)
+        return -1;
+    moved = (moved & 1) ? ~(moved >> 1) : moved >> 1;
+    if (header & MEMD_EVENT_SCALED)
+        moved *= 16;
 
-    // set address to null and update info
-    mem->address = 0;
-    MEMD_Data.total_free_size += mem->size;
-    return 0;
+    reader->sequence += distance + 1;
+    reader->address += moved;
+    reader->remaining--;
+    event->thread = reader->thread;
+    event->sequence = reader->sequence;
+    event->address = reader->address;
+    event->site = event->type == MEMD_EVENT_ALLOC ? reader->site : 0;
+    event->size = event->type == MEMD_EVENT_ALLOC ? reader->size : 0;
+    return 1;
 }
 
 /** 
- * Custom implementation of malloc for tracking purposes.
+ * Define USE_MEMD before including this file to enable MEMD functionality.
+ * This allows MEMD to be easily enabled or disabled for different builds.
  */
-void *_memd_malloc(size_t size, uint32_t line, const char *file) {
-    void *ptr = malloc(size);
+#ifdef USE_MEMD
 
-    if (_memd_ignore != 1) {
-        // insert to memory data
-        _insert((size_t)ptr, size, line, file);
-    }
+/** 
+ * Maximum number of memory allocations MEMD will track.
+ */
+#define MEMD_MAX_ALLOCATIONS 1000
 
-    return ptr;
-}
+/** 
+ * Maximum number of warnings MEMD will store.
+ */
+#define MEMD_MAX_WARNINGS 1000 
 
 /** 
- * Custom implementation of calloc for tracking purposes.
- * Allocates memory for an array of num elements of size bytes each and initializes all bytes to zero.
+ * Maximum number of memory resources MEMD will keep statistics for.
  */
-void *_memd_calloc(size_t num, size_t size, uint32_t line, const char *file) {
-    size_t totalSize = num * size;
-    void *ptr = calloc(num, size);
+#define MEMD_MAX_RESOURCES 64
 
-    if (_memd_ignore != 1 && ptr != NULL) {
-        _insert((size_t)ptr, totalSize, line, file);
-    }
+/** 
+ * Maximum number of user pool allocators MEMD will track.
+ */
+#define MEMD_MAX_POOLS 64
 
-    return ptr;
-}
+/** 
+ * Maximum number of call sites MEMD can look up on compilers without
+ * statement expressions (see MEMD_SITE).
+ */
+#define MEMD_MAX_SITES 1024
 
 /** 
- * Custom implementation of free for tracking purposes.
+ * Maximum number of root ranges that can be registered with memd_heap_root.
  */
-void _memd_free(void *ptr, uint32_t line, const char *file) {
-    if (_memd_ignore != 1) {
-        // erase memory data
-        if (_erase((size_t)ptr, line, file) == 0)
-            free(ptr);
-    }
-}
+#define MEMD_MAX_ROOTS 64
 
 /** 
- * Custom implementation of realloc for tracking purposes.
- * Changes the size of the memory block pointed to by ptr to size bytes.
+ * Maximum number of suppression rules, at most 64 so a site can keep the
+ * rules matching it in a bit mask.
  */
-void *_memd_realloc(void *ptr, size_t size, uint32_t line, const char *file) {
-    if (ptr == NULL) {
-        // Equivalent to malloc
-        return _memd_malloc(size, line, file);
-    } else if (size == 0) {
-        // Equivalent to free
-        _memd_free(ptr, line, file);
-        return NULL;
-    } else {
-        // Reallocate and update MEMD tracking if not ignored
-        void *newPtr = realloc(ptr, size);
-        if (newPtr != NULL && _memd_ignore != 1) {
-            // Erase old entry
-            _erase((size_t)ptr, line, file);
-            // Insert new entry
-            _insert((size_t)newPtr, size, line, file);
-        }
-        return newPtr;
-    }
-}
+#define MEMD_MAX_SUPPRESSIONS 64
 
 /** 
- * Pause memd memory tracking.
+ * Maximum number of open resource handles MEMD will track (MEMD_HANDLES).
  */
-static inline void memd_pause() {
-    _memd_ignore = 1;
-}
+#define MEMD_MAX_HANDLES 256
 
 /** 
- * Resume paused memd memory tracking.
+ * Define MEMD_SITE_POOLING to serve sites that keep allocating the same small
+ * size from per-site, per-thread freelists instead of malloc. The blocks are
+ * still tracked; the report shows how many allocations the freelists served.
  */
-static inline void memd_resume() {
-    _memd_ignore = 0;
-}
+#ifdef MEMD_SITE_POOLING
 
-void memd_report_free(char* ptr) {
-    free(ptr); // Free the memory allocated for the report.
-}
+/** 
+ * Largest allocation size that is pooled.
+ */
+#ifndef MEMD_SITE_POOLING_MAX_SIZE
+#define MEMD_SITE_POOLING_MAX_SIZE 256
+#endif
 
-char* memd_report() {
-    size_t buffer_size = 1024 * 10; // Start with a 10KB buffer, adjust based on needs.
-    char* report = (char*)malloc(buffer_size);
-    if (!report) return NULL; // Failed to allocate memory for the report.
+/** 
+ * Number of consecutive same-size allocations after which a site is pooled.
+ */
+#ifndef MEMD_SITE_POOLING_THRESHOLD
+#define MEMD_SITE_POOLING_THRESHOLD 64
+#endif
 
-    size_t offset = 0; // Tracks the current offset in the buffer.
+/** 
+ * Maximum number of sites that get freelists.
+ */
+#ifndef MEMD_MAX_POOLED_SITES
+#define MEMD_MAX_POOLED_SITES 64
+#endif
 
-    // Helper macro to append formatted output to the buffer
-    #define APPEND_TO_REPORT(fmt, ...) do { \
-        int needed = snprintf(NULL, 0, fmt, ##__VA_ARGS__); \
-        if (needed < 0) break; \
-        if (offset + needed >= buffer_size) { \
-            while (offset + needed >= buffer_size) buffer_size *= 2; \
-            char* temp = (char*)realloc(report, buffer_size); \
-            if (!temp) { \
-                free(report); \
-                return NULL; /* Handle reallocation failure */ \
-            } \
-            report = temp; \
-        } \
-        int written = snprintf(report + offset, buffer_size - offset, fmt, ##__VA_ARGS__); \
-        if (written > 0) offset += (size_t)written; \
-    } while (0)
+/** 
+ * Maximum number of blocks a thread keeps in the freelist of one pooled site.
+ * Further frees go back to free.
+ */
+#ifndef MEMD_SITE_POOLING_MAX_FREE
+#define MEMD_SITE_POOLING_MAX_FREE 64
+#endif
 
-    APPEND_TO_REPORT("\n----------------------------------\n");
-    APPEND_TO_REPORT("MEMD Leak Summary:\n");
-    APPEND_TO_REPORT("----------------------------------\n\n");
-    APPEND_TO_REPORT("   Total Memory allocated %lu bytes\n", MEMD_Data.total_allocated_size);
-    APPEND_TO_REPORT("   Total Memory freed     %lu bytes\n", MEMD_Data.total_free_size);
-    APPEND_TO_REPORT("   Memory Leaked          %lu bytes\n", MEMD_Data.total_allocated_size - MEMD_Data.total_free_size);
-
-    if (MEMD_Data.total_free_size != MEMD_Data.total_allocated_size) {
-        APPEND_TO_REPORT("\n   Detailed Report:\n");
-        for (int i = 0; i < MEMD_MAX_ALLOCATIONS; i++) {
-            if (MEMD_Data.mem[i].address != 0) {
-                APPEND_TO_REPORT("     Memory leak at %s:%d: (%lu bytes)\n", 
-                    MEMD_Data.mem[i].file,
-                    MEMD_Data.mem[i].line,
-                    MEMD_Data.mem[i].size);
-            }
-        }
-    }
+#endif // MEMD_SITE_POOLING
 
-    if (MEMD_Data.warning_count > 0) {
-        APPEND_TO_REPORT("\n   Warnings:\n");
-        for (int i = 0; i < MEMD_Data.warning_count; i++) {
-            APPEND_TO_REPORT("     %s:%d: %s\n", 
-                MEMD_Data.warnings[i].file,
-                MEMD_Data.warnings[i].line,
-                MEMD_Data.warnings[i].message);
-        }
-    }
+/** 
+ * Define MEMD_SLAB_BACKEND to serve small tracked allocations from size-class
+ * slabs. The tracking info of a slab block lives in its slab's metadata, so a
+ * free finds it by address arithmetic instead of searching the table.
+ * Slab blocks point into one region MEMD got from malloc, so every free and
+ * realloc of them must go through MEMD's macros: passing one to the C
+ * library's free or realloc, e.g. from a translation unit compiled without
+ * USE_MEMD or from a library taking ownership of the block, corrupts the heap
+ * instead of showing up as a leak. Only enable it when tracked blocks never
+ * leave code compiled with MEMD.
+ */
+#ifdef MEMD_SLAB_BACKEND
 
-    APPEND_TO_REPORT("\n----------------------------------\n\n");
+/** 
+ * Size of the address range the slabs are carved from, reserved on first use.
+ */
+#ifndef MEMD_SLAB_REGION_SIZE
+#define MEMD_SLAB_REGION_SIZE (32 * 1024 * 1024)
+#endif
 
-    #undef APPEND_TO_REPORT
+/** 
+ * Log2 of the size of a single slab (64 KB).
+ */
+#define MEMD_SLAB_SHIFT 16
+#define MEMD_SLAB_SIZE ((size_t)1 << MEMD_SLAB_SHIFT)
 
-    return report; // Return the dynamically allocated report buffer.
-}
+/** 
+ * Largest allocation size served from slabs, and the number of size classes.
+ */
+#define MEMD_SLAB_MAX_SIZE 256
+#define MEMD_SLAB_CLASSES 8
+
+/** 
+ * Maximum number of blocks in a slab (one per 16 bytes).
+ */
+#define MEMD_SLAB_BLOCKS (MEMD_SLAB_SIZE / 16)
 
+#endif // MEMD_SLAB_BACKEND
 
-// Redefine standard allocation functions to use MEMD tracking versions.
-#define malloc(size) _memd_malloc(size, __LINE__, __FILE__)
-#define free(ptr) _memd_free(ptr, __LINE__, __FILE__)
-#define calloc(num, size) _memd_calloc(num, size, __LINE__, __FILE__)
-#define realloc(ptr, size) _memd_realloc(ptr, size, __LINE__, __FILE__)
+/** 
+ * Define MEMD_LEAK_PREVIEW as a number of bytes to show a hex/ASCII preview of
+ * the start of leaked blocks in the report. To keep the report cheap on huge
+ * leak sets, only the blocks of the MEMD_LEAK_PREVIEW_GROUPS sites leaking the
+ * most bytes are previewed.
+ */
+#ifdef MEMD_LEAK_PREVIEW
+#ifndef MEMD_LEAK_PREVIEW_GROUPS
+#define MEMD_LEAK_PREVIEW_GROUPS 8
+#endif
 
-#endif // MEMD_IMPLEMENTATION
+/** 
+ * Longest text shown for a leaked block that looks like a string.
+ */
+#ifndef MEMD_LEAK_PREVIEW_STRING
+#define MEMD_LEAK_PREVIEW_STRING 64
+#endif
+#endif // MEMD_LEAK_PREVIEW
 
-#else // USE_MEMD not defined
+/** 
+ * Most bytes of a block's contents memd_heap_dump writes, or 0 to write
+ * whole blocks.
+ */
+#ifndef MEMD_HEAP_DUMP_MAX_BLOCK
+#define MEMD_HEAP_DUMP_MAX_BLOCK 0
+#endif
 
 /** 
- * Defines no-operation versions of MEMD functions when MEMD is disabled.
+ * Size of the buffer memd_heap_dump fills before each write.
  */
-#define memd_report() ((void*)0)
-#define memd_report_free(char) ((void)0)
-#define memd_pause() ((void)0)
-#define memd_resume() ((void)0)
+#ifndef MEMD_HEAP_DUMP_BUFFER
+#define MEMD_HEAP_DUMP_BUFFER (1 << 20)
+#endif
 
-#endif // USE_MEMD
+/** 
+ * Number of top sites and of tags memd_metrics_write exports.
+ */
+#ifndef MEMD_METRICS_SITES
+#define MEMD_METRICS_SITES 10
+#endif
+#ifndef MEMD_METRICS_TAGS
+#define MEMD_METRICS_TAGS 32
+#endif
+
+/** 
+ * Number of temp file names memd_metrics_write tries before it gives up.
+ */
+#ifndef MEMD_METRICS_TEMP_ATTEMPTS
+#define MEMD_METRICS_TEMP_ATTEMPTS 100
+#endif
+
+/** 
+ * Number of sites and of blocks the block age sections of the report list.
+ */
+#ifndef MEMD_AGE_SITES
+#define MEMD_AGE_SITES 10
+#endif
+#ifndef MEMD_OLDEST_BLOCKS
+#define MEMD_OLDEST_BLOCKS 10
+#endif
+
+/** 
+ * Size of the per-thread buffers the event log collects events in before
+ * writing them as one chunk.
+ */
+#ifndef MEMD_EVENT_BUFFER
+#define MEMD_EVENT_BUFFER 4096
+#endif
+
+/** 
+ * Number of per-thread event buffers. Threads beyond it share buffers.
+ */
+#ifndef MEMD_EVENT_THREADS
+#define MEMD_EVENT_THREADS 64
+#endif
+
+/** 
+ * Define MEMD_THREADSAFE to guard all tracking data with a global lock, so
+ * MEMD can be used from several threads.
+ */
+#if defined(MEMD_THREADSAFE) || defined(MEMD_REPORT_THREADS)
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+#endif
+
+/** 
+ * Define MEMD_REPORT_THREADS to the number of threads memd_report scans the
+ * leaked blocks for pointers with. Each thread scans a slice of the blocks
+ * with about the same number of bytes, and small heaps use fewer threads.
+ */
+#ifdef MEMD_REPORT_THREADS
+#if MEMD_REPORT_THREADS < 1 || MEMD_REPORT_THREADS > 64
+#error "MEMD_REPORT_THREADS must be between 1 and 64"
+#endif
+#endif
+
+/** 
+ * Define MEMD_CONTROL to let memd_control_open serve commands on a Unix
+ * domain socket from a background thread. It needs MEMD_THREADSAFE, since
+ * the commands run concurrently with the program. The socket is only
+ * accessible to the user running the process.
+ */
+#ifdef MEMD_CONTROL
+#if !defined(MEMD_THREADSAFE) || defined(_WIN32)
+#error "MEMD_CONTROL requires MEMD_THREADSAFE and POSIX sockets"
+#endif
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+/** 
+ * Define MEMD_REPORTER to let memd_reporter_start write periodic reports
+ * from a background thread. It needs MEMD_THREADSAFE.
+ */
+#ifdef MEMD_REPORTER
+#ifndef MEMD_THREADSAFE
+#error "MEMD_REPORTER requires MEMD_THREADSAFE"
+#endif
+#ifndef _WIN32
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/resource.h>
+#endif
+#endif
+#include <time.h>
+
+/** 
+ * Most growing sites listed in a periodic report.
+ */
+#ifndef MEMD_REPORTER_SITES
+#define MEMD_REPORTER_SITES 20
+#endif
+#endif
+
+/** 
+ * Define MEMD_HANDLES to track resource handles along with memory: FILE*
+ * of fopen, and on POSIX systems DIR* of opendir and mutexes of
+ * pthread_mutex_init. The report lists the handles of each kind that are
+ * still open with the site that opened them. Descriptors of open and socket
+ * are only tracked in C with MEMD_HANDLES_FD as well, since function-like
+ * open and close macros also rewrite struct members like ops->close(x).
+ */
+#ifdef MEMD_HANDLES
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+#endif
+
+/** 
+ * Loads and stores of values that are read without holding the MEMD lock,
+ * like the id that marks a call site as registered.
+ */
+#if defined(MEMD_THREADSAFE) && (defined(__GNUC__) || defined(__clang__))
+#define MEMD_LOAD_ACQUIRE(var) __atomic_load_n(&(var), __ATOMIC_ACQUIRE)
+#define MEMD_STORE_RELEASE(var, value) __atomic_store_n(&(var), value, __ATOMIC_RELEASE)
+#else
+#define MEMD_LOAD_ACQUIRE(var) (var)
+#define MEMD_STORE_RELEASE(var, value) ((var) = (value))
+#endif
+
+/** 
+ * Storage class for per-thread data.
+ */
+#if defined(__cplusplus) && __cplusplus >= 201103L
+#define MEMD_THREAD_LOCAL thread_local
+#elif defined(_MSC_VER)
+#define MEMD_THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__) || defined(__clang__)
+#define MEMD_THREAD_LOCAL __thread
+#else
+#define MEMD_THREAD_LOCAL _Thread_local
+#endif
+
+/** 
+ * Macro to record a warning with contextual information.
+ * Stores warnings up to MEMD_MAX_WARNINGS in MEMD_Data.warnings and counts
+ * all of them in MEMD_Data.warning_total.
+ */
+#define WARN(msg, site) \
+    if (MEMD_Data.warning_total++ < MEMD_MAX_WARNINGS) { \
+        MEMD_Warning *warning = &MEMD_Data.warnings[MEMD_Data.warning_count++]; \
+        snprintf(warning->message, sizeof(warning->message), "%s", msg); \
+        warning->line = (site)->line; \
+        warning->file = (site)->file; \
+    }
+
+/** 
+ * Struct to represent a call site of the allocation functions.
+ * The allocation macros emit one static descriptor per call site and pass its
+ * address, so per-site statistics are updated without any lookup.
+ */
+typedef struct MEMD_Site {
+    const char *file; /**< The source file of the call site. */
+    const char *func; /**< The function containing the call site, or NULL. */
+    uint32_t line;    /**< The source line of the call site. */
+    uint32_t id;      /**< Site id assigned on first use, 0 while unregistered. */
+    const char *tag;  /**< Tag of the owning container, or NULL if untagged. */
+    const char *type; /**< Type name of MEMD_NEW sites, or NULL if untyped. */
+    size_t type_size; /**< Size of one element of type, so counts follow from block sizes. */
+    size_t alloc_count;    /**< Number of allocations made at this site. */
+    size_t free_count;     /**< Number of those allocations freed again. */
+    size_t allocated_size; /**< Total size allocated at this site. */
+    size_t free_size;      /**< Total size of the freed allocations. */
+    struct MEMD_Site *next; /**< Next registered site. */
+#ifdef MEMD_SITE_POOLING
+    uint32_t last_size;    /**< Size of the last allocation. */
+    uint32_t repeat_count; /**< Consecutive allocations of last_size. */
+    uint32_t pooled_slot;  /**< Freelist slot + 1 once the site is pooled, 0 otherwise. */
+    size_t pooled_hits;    /**< Allocations served from the site's freelists. */
+#endif
+#ifdef MEMD_FILL_PATTERN
+    size_t measured_count;  /**< Filled blocks measured when they were freed. */
+    size_t untouched_count; /**< Measured blocks that were never written. */
+    size_t measured_size;   /**< Total size of the measured blocks. */
+    size_t used_size;       /**< Bytes up to the last written byte of the measured blocks. */
+#endif
+} MEMD_Site;
+
+/** 
+ * Struct to represent a memory allocation event.
+ */
+typedef struct {
+    size_t address; /**< The memory address allocated. */
+    size_t size;    /**< The size of the allocation. */
+    MEMD_Site *site; /**< The call site where the allocation occurred. */
+    MEMD_Pool *pool; /**< The pool the allocation was carved from, or NULL. */
+    size_t tick;     /**< Allocation count when the block was allocated. */
+    uint32_t alignment; /**< Requested alignment, or 0 for the malloc default. */
+    int32_t pool_prev;  /**< Index of the previous record of the same pool, or -1. */
+    int32_t pool_next;  /**< Index of the next record of the same pool, or -1. */
+    int32_t freelist;   /**< Site freelist slot the block returns to, or -1. */
+#ifdef MEMD_FILL_PATTERN
+    int32_t filled;     /**< 1 if the block was filled with MEMD_FILL_PATTERN. */
+#endif
+} MEMD_Mem;
+
+/** 
+ * Struct to represent a warning generated by MEMD.
+ */
+typedef struct {
+    char message[128]; /**< Warning message. */
+    uint32_t line;     /**< The source line where the warning was generated. */
+    const char *file;  /**< The source file where the warning was generated. */
+} MEMD_Warning;
+
+/** 
+ * Struct to represent the usage statistics of a memory resource.
+ */
+typedef struct {
+    const char *name;  /**< Name of the resource. */
+    size_t live_size;  /**< Bytes currently allocated from the resource. */
+    size_t peak_size;  /**< Highest value live_size has reached. */
+    MEMD_Site site;    /**< Call site the allocations of the resource are recorded under. */
+} MEMD_Resource;
+
+/** 
+ * Struct to represent a memory range holding pointers into the heap.
+ */
+typedef struct {
+    const void *start; /**< Start of the range. */
+    size_t size;       /**< Size of the range. */
+} MEMD_Root;
+
+/** 
+ * Struct to represent a rule of a suppression file. Leaked blocks matching
+ * all patterns and the size range are left out of the report.
+ */
+typedef struct {
+    const char *file; /**< Glob pattern of the source file, or NULL. */
+    const char *func; /**< Glob pattern of the function, or NULL. */
+    const char *type; /**< Glob pattern of the MEMD_NEW type, or NULL. */
+    const char *tag;  /**< Glob pattern of the container tag, or NULL. */
+    size_t min_size;  /**< Smallest suppressed block size. */
+    size_t max_size;  /**< Largest suppressed block size. */
+    const char *source; /**< Path of the suppression file. */
+    uint32_t line;    /**< Line of the rule in the suppression file. */
+    size_t hit_count; /**< Leaked blocks suppressed in the last report. */
+    size_t hit_size;  /**< Bytes of those blocks. */
+} MEMD_Suppression;
+
+/** 
+ * Suppression rules matching a site, kept outside MEMD_Site so call sites
+ * don't pay for it when no rules are loaded.
+ */
+typedef struct {
+    uint64_t mask;       /**< Rules matching the site, regardless of size. */
+    uint32_t generation; /**< Rule generation mask was computed for, 0 if never. */
+} MEMD_SuppressCache;
+
+/** 
+ * Keys to rank the sites of memd_query by, largest first.
+ */
+typedef enum {
+    MEMD_SORT_BYTES,       /**< Live bytes. */
+    MEMD_SORT_BLOCKS,      /**< Live blocks. */
+    MEMD_SORT_ALLOCATIONS, /**< Allocations made. */
+    MEMD_SORT_ALLOCATED    /**< Bytes allocated. */
+} MEMD_SortKey;
+
+/** 
+ * Filter and order of memd_query. A zeroed query lists all sites with
+ * allocations by live bytes.
+ */
+typedef struct {
+    MEMD_SortKey sort; /**< Key the sites are ranked by. */
+    size_t limit;      /**< Maximum number of sites listed, 0 for all. */
+    size_t min_size;   /**< Skip sites with fewer live bytes. */
+    const char *file;  /**< Glob pattern of the source file, or NULL. */
+    const char *tag;   /**< Glob pattern of the tag, or NULL. */
+} MEMD_Query;
+
+/** 
+ * Configuration of the periodic reports of memd_reporter_start.
+ */
+typedef struct {
+    const char *path;         /**< File the reports are appended to, or NULL. */
+    uint32_t interval_ms;     /**< Time between two reports. */
+    uint32_t full_every;      /**< Also append the full report every this many reports, 0 never. */
+    size_t max_size;          /**< Size at which the file is rotated, 0 to never rotate. */
+    uint32_t file_count;      /**< Rotated files kept as path.1 to path.N. */
+    const char *metrics_path; /**< File memd_metrics_write updates with each report, or NULL. */
+} MEMD_Reporter;
+
+#ifdef MEMD_HANDLES
+/** 
+ * Kinds of resource handles tracked with MEMD_HANDLES.
+ */
+typedef enum {
+    MEMD_HANDLE_FILE,   /**< FILE* of fopen. */
+    MEMD_HANDLE_FD,     /**< Descriptor of open. */
+    MEMD_HANDLE_SOCKET, /**< Descriptor of socket. */
+    MEMD_HANDLE_DIR,    /**< DIR* of opendir. */
+    MEMD_HANDLE_MUTEX,  /**< Mutex of pthread_mutex_init. */
+    MEMD_HANDLE_CUSTOM, /**< Handles reported with memd_handle_open_notify. */
+    MEMD_HANDLE_KINDS
+} MEMD_HandleKind;
+
+/** 
+ * Struct to represent an open resource handle.
+ */
+typedef struct {
+    uint64_t value;       /**< Pointer or descriptor of the handle. */
+    MEMD_Site *site;      /**< Site that opened the handle, NULL for a free slot. */
+    MEMD_HandleKind kind; /**< Kind of the handle. */
+} MEMD_Handle;
+
+/** 
+ * Struct to represent the statistics of a kind of handles.
+ */
+typedef struct {
+    size_t open_count;  /**< Handles opened. */
+    size_t close_count; /**< Handles closed. */
+    size_t peak_count;  /**< Most handles open at once. */
+} MEMD_HandleStats;
+#endif // MEMD_HANDLES
+
+/** 
+ * Global structure to store tracking and warning data.
+ */
+struct {
+    MEMD_Mem mem[MEMD_MAX_ALLOCATIONS]; /**< Array of tracked memory allocations. */
+    size_t total_allocated_size; /**< Total size of all allocated memory. */
+    size_t total_free_size; /**< Total size of all freed memory. */
+    size_t peak_size; /**< Highest number of live bytes since start or memd_reset_peak. */
+    size_t alloc_count; /**< Number of tracked allocations. */
+    size_t free_count; /**< Number of those allocations freed again. */
+    MEMD_Warning warnings[MEMD_MAX_WARNINGS]; /**< Array of generated warnings. */
+    int warning_count; /**< Number of generated warnings. */
+    size_t warning_total; /**< Number of warnings, including those beyond MEMD_MAX_WARNINGS. */
+    MEMD_Resource resources[MEMD_MAX_RESOURCES]; /**< Array of registered memory resources. */
+    int resource_count; /**< Number of registered memory resources. */
+    MEMD_Pool pools[MEMD_MAX_POOLS]; /**< Array of registered pool allocators. */
+    int pool_count; /**< Number of registered pool allocators. */
+    MEMD_Arena *arenas; /**< First live arena. */
+    MEMD_Site *sites; /**< First registered call site. */
+    MEMD_Site *last_site; /**< Last registered call site. */
+    uint32_t site_count; /**< Number of registered call sites. */
+    uint32_t pooled_site_count; /**< Number of sites served from freelists. */
+    MEMD_Root roots[MEMD_MAX_ROOTS]; /**< Root ranges registered with memd_heap_root. */
+    int root_count; /**< Number of registered root ranges. */
+    MEMD_Suppression suppressions[MEMD_MAX_SUPPRESSIONS]; /**< Loaded suppression rules. */
+    int suppression_count; /**< Number of loaded suppression rules. */
+    uint32_t suppression_generation; /**< Incremented whenever rules are loaded. */
+    MEMD_SuppressCache *suppress_cache; /**< Rules matching each site id, allocated once rules are loaded. */
+    uint32_t suppress_cache_capacity;   /**< Number of site ids suppress_cache holds. */
+    MEMD_Site **typed_sites;            /**< Report scratch of the typed sites with leaks, sorted by type. */
+    uint32_t typed_sites_capacity;      /**< Number of sites typed_sites holds. */
+} MEMD_Data;
+
+/** 
+ * Returns a ptr to an allocated buffer wich contains the report of memory allocations and warnings.
+ * Should be called before application exit to report potential memory leaks.
+ * Don't forget to free it with 'memd_report_free' when not needed anymore, MEMD won't report it in this case ;)
+ */
+char* memd_report();
+
+/**
+ * Free a report created from MEMD.
+ * This is important, since MEMD won't report the leak in this case.
+*/
+void memd_report_free(char* ptr);
+
+/** 
+ * Lists the allocation sites matching a query, ranked by its sort key. Only
+ * the top sites are kept while scanning, so a small limit is fast regardless
+ * of the number of sites.
+ * Free the result with 'memd_report_free'.
+ */
+char* memd_query(const MEMD_Query *query);
+
+/** 
+ * Writes the totals, the live memory of each tag and of the
+ * MEMD_METRICS_SITES sites with the most live bytes in the OpenMetrics text
+ * format, e.g. for the textfile collector of the Prometheus node exporter.
+ * The metrics are written to a temp file of their own next to path, which is
+ * then renamed to path, so readers never see a partial file. Only counters are read, not the blocks.
+ * @return 0 on success, or -1 if the file could not be written.
+ */
+int memd_metrics_write(const char *path);
+
+/** 
+ * Registers a user pool or arena allocator.
+ * Sub-allocations reported with memd_pool_alloc_notify are tracked like
+ * malloc'd blocks and listed under the pool's name.
+ * @return Handle of the pool, or NULL if MEMD_MAX_POOLS is reached.
+ */
+MEMD_Pool *memd_pool_create(const char *name);
+
+/** 
+ * Drops the records of all live sub-allocations of a pool, counting them as
+ * freed. Runs in time proportional to the number of records in the pool.
+ */
+void memd_pool_reset(MEMD_Pool *pool);
+
+/** 
+ * Loads suppression rules from a file, usually once at startup. Each line is
+ * a rule of space separated terms that must all match a leaked block:
+ * file=GLOB, func=GLOB, type=GLOB, tag=GLOB and size=MIN-MAX, where either
+ * bound may be left out. Lines starting with # are comments.
+ * @return The number of rules loaded, or -1 if the file could not be read.
+ */
+int memd_suppressions_load(const char *path);
+
+/** 
+ * Writes the per-site statistics to a tab-separated file at path, one line
+ * per site, for tools like memd_diff to compare runs.
+ * @return 0 on success, or -1 if the file could not be written.
+ */
+int memd_report_save(const char *path);
+
+/** 
+ * Starts logging every tracked allocation and free to a file at path, in
+ * the compact format of MEMD_EVENT_MAGIC.
+ * @return 0 on success, or -1 if the file could not be created or a log is
+ * already open.
+ */
+int memd_event_log_open(const char *path);
+
+/** 
+ * Writes the buffered events and the call sites, and closes the event log.
+ * @return 0 on success, or -1 if no log is open or a write failed.
+ */
+int memd_event_log_close();
+
+/** 
+ * Lowers the peaks of MEMD, of all memory resources, pools and arenas to
+ * their current sizes, so the next report shows the peaks from now on.
+ */
+void memd_reset_peak();
+
+/** 
+ * Starts a MEMD_CONTROL background thread serving commands on a Unix domain
+ * socket at path. Clients send one command per line and get its output
+ * followed by a line "ok" or "error":
+ *   report            the full report
+ *   top [n]           the n sites with the most live bytes, 10 by default
+ *   stats             live, peak and total bytes and the warning count
+ *   snapshot <path>   a heap dump written to path
+ *   events <path>     starts an event log at path
+ *   events off        closes the event log
+ *   reset-peak        memd_reset_peak
+ *   pause, resume     memd_pause and memd_resume
+ * @return 0 on success, or -1 if the socket could not be created, a channel
+ * is already open or MEMD_CONTROL is not defined.
+ */
+int memd_control_open(const char *path);
+
+/** 
+ * Stops the control thread and removes the socket.
+ * @return 0 on success, or -1 if no channel is open.
+ */
+int memd_control_close();
+
+/** 
+ * Starts a MEMD_REPORTER background thread that appends a report to
+ * config->path every config->interval_ms milliseconds, and a last one when
+ * it is stopped. Each report has the totals and the sites whose live memory
+ * grew since the previous one, and every config->full_every reports also the
+ * full report. With config->metrics_path, memd_metrics_write updates it at
+ * the same interval. The thread runs at the lowest priority.
+ * @return 0 on success, or -1 if the configuration is invalid, the reporter
+ * is already running or MEMD_REPORTER is not defined.
+ */
+int memd_reporter_start(const MEMD_Reporter *config);
+
+/** 
+ * Writes the last report and stops the reporter thread.
+ * @return 0 on success, or -1 if the reporter is not running.
+ */
+int memd_reporter_stop();
+
+/** 
+ * Writes every tracked block with its site and contents (up to
+ * MEMD_HEAP_DUMP_MAX_BLOCK bytes), followed by the root ranges, to a heap dump
+ * file at path. See MEMD_DumpHeader for the format. Like memd_report, it only
+ * holds the MEMD lock to copy the records, other threads keep allocating
+ * while the contents are written.
+ * @return 0 on success, or -1 if the file could not be written.
+ */
+int memd_heap_dump(const char *path);
+
+/** 
+ * Registers a memory range holding pointers into the heap, like a thread's
+ * stack or a custom global area, as a root range of heap dumps. On glibc the
+ * data and bss segments of the executable are added automatically.
+ */
+void memd_heap_root(const void *start, size_t size);
+
+#ifdef MEMD_IMPLEMENTATION
+
+/** 
+ * Flag to ignore memory tracking for specific operations.
+ */
+int _memd_ignore = 0;
+
+#ifdef MEMD_THREADSAFE
+#ifdef _WIN32
+static SRWLOCK _memd_mutex = SRWLOCK_INIT;
+#define _memd_mutex_lock() AcquireSRWLockExclusive(&_memd_mutex)
+#define _memd_mutex_unlock() ReleaseSRWLockExclusive(&_memd_mutex)
+#else
+static pthread_mutex_t _memd_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define _memd_mutex_lock() pthread_mutex_lock(&_memd_mutex)
+#define _memd_mutex_unlock() pthread_mutex_unlock(&_memd_mutex)
+#endif
+
+/** 
+ * Lock serializing reports, which scan the blocks without the MEMD lock.
+ */
+#ifdef _WIN32
+static SRWLOCK _memd_report_mutex = SRWLOCK_INIT;
+#define MEMD_REPORT_LOCK() AcquireSRWLockExclusive(&_memd_report_mutex)
+#define MEMD_REPORT_UNLOCK() ReleaseSRWLockExclusive(&_memd_report_mutex)
+#else
+static pthread_mutex_t _memd_report_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define MEMD_REPORT_LOCK() pthread_mutex_lock(&_memd_report_mutex)
+#define MEMD_REPORT_UNLOCK() pthread_mutex_unlock(&_memd_report_mutex)
+#endif
+
+/** 
+ * Number of times the current thread holds the MEMD lock.
+ */
+static MEMD_THREAD_LOCAL int _memd_lock_depth = 0;
+
+/** 
+ * Takes the global MEMD lock. The lock is recursive, so tracking functions
+ * may call each other.
+ */
+static inline void _memd_lock() {
+    if (_memd_lock_depth++ == 0)
+        _memd_mutex_lock();
+}
+
+/** 
+ * Releases the global MEMD lock.
+ */
+static inline void _memd_unlock() {
+    if (--_memd_lock_depth == 0)
+        _memd_mutex_unlock();
+}
+
+#define MEMD_LOCK() _memd_lock()
+#define MEMD_UNLOCK() _memd_unlock()
+#else
+#define MEMD_LOCK() ((void)0)
+#define MEMD_UNLOCK() ((void)0)
+#define MEMD_REPORT_LOCK() ((void)0)
+#define MEMD_REPORT_UNLOCK() ((void)0)
+#endif // MEMD_THREADSAFE
+
+/** 
+ * Finds a tracked memory allocation of the given pool by its address.
+ * Sub-allocations of user pools share addresses with the chunks they are carved
+ * from, so lookups only match records of the same pool (NULL for malloc'd blocks).
+ * @return Pointer to the tracked memory allocation, or NULL if not found.
+ */
+MEMD_Mem *_find_in_pool(size_t address, const MEMD_Pool *pool) {
+    for (uint32_t i = 0; i < MEMD_MAX_ALLOCATIONS; i++) {
+        if (MEMD_Data.mem[i].address == address && MEMD_Data.mem[i].pool == pool)
+            return &MEMD_Data.mem[i];
+    }
+
+    return NULL;
+}
+
+/** 
+ * Finds a tracked memory allocation by its address.
+ * @return Pointer to the tracked memory allocation, or NULL if not found.
+ */
+MEMD_Mem *_find_by_address(size_t address) {
+    return _find_in_pool(address, NULL);
+}
+
+/** 
+ * Registers a call site so it is listed in the report.
+ */
+void _memd_site_register(MEMD_Site *site, const char *file, uint32_t line, const char *func) {
+    MEMD_LOCK();
+    // another thread may have registered the site in the meantime
+    if (site->id == 0) {
+        site->file = file;
+        site->line = line;
+        site->func = func;
+        site->next = NULL;
+        if (MEMD_Data.last_site != NULL)
+            MEMD_Data.last_site->next = site;
+        else
+            MEMD_Data.sites = site;
+        MEMD_Data.last_site = site;
+        MEMD_STORE_RELEASE(site->id, ++MEMD_Data.site_count);
+    }
+    MEMD_UNLOCK();
+}
+
+/** 
+ * Returns the given static call site, registering it on first use.
+ */
+static inline MEMD_Site *_memd_site_use(MEMD_Site *site, const char *file, uint32_t line, const char *func) {
+    if (MEMD_LOAD_ACQUIRE(site->id) == 0)
+        _memd_site_register(site, file, line, func);
+    return site;
+}
+
+/** 
+ * Finds or creates the call site for file and line.
+ * Used by MEMD_SITE on compilers without statement expressions.
+ */
+MEMD_Site *_memd_site_lookup(const char *file, uint32_t line, const char *func) {
+    static MEMD_Site pool[MEMD_MAX_SITES];
+    static MEMD_Site unknown;
+    size_t hash = ((size_t)file >> 3) * 31 + line;
+    MEMD_Site *found = NULL;
+
+    MEMD_LOCK();
+    for (uint32_t i = 0; i < MEMD_MAX_SITES && found == NULL; i++) {
+        MEMD_Site *site = &pool[(hash + i) % MEMD_MAX_SITES];
+        if (site->id == 0)
+            found = _memd_site_use(site, file, line, func);
+        else if (site->line == line && site->file == file)
+            found = site;
+    }
+
+    // all sites are in use, so we fall back to a single shared site
+    if (found == NULL)
+        found = _memd_site_use(&unknown, "unknown", 0, NULL);
+    MEMD_UNLOCK();
+    return found;
+}
+
+#if defined(__cplusplus) && __cplusplus >= 201103L && (defined(__GNUC__) || defined(__clang__))
+/** 
+ * Expands to the address of a static descriptor for the current call site,
+ * which is registered lazily on first use. In C++ the descriptor lives in a
+ * lambda, so the allocation macros also work in namespace-scope and member
+ * initializers, where statement expressions aren't allowed. Such sites have
+ * no function name.
+ */
+#define MEMD_SITE() ([](const char *_memd_func) { \
+        static MEMD_Site _memd_site; \
+        return _memd_site_use(&_memd_site, __FILE__, __LINE__, _memd_func[0] != '\0' ? _memd_func : NULL); \
+    }(__builtin_FUNCTION()))
+#elif defined(__GNUC__) || defined(__clang__)
+/** 
+ * Expands to the address of a function-local static descriptor for the
+ * current call site, which is registered lazily on first use. Statement
+ * expressions are only valid in function bodies, which is the only place C
+ * can call malloc anyway.
+ */
+#define MEMD_SITE() (__extension__({ \
+        static MEMD_Site _memd_site; \
+        _memd_site_use(&_memd_site, __FILE__, __LINE__, __func__); \
+    }))
+#else
+/** 
+ * Looks up the descriptor of the current call site. __func__ is only defined
+ * in function bodies, so without GNU extensions the allocation macros can't be
+ * used in C++ namespace-scope initializers.
+ */
+#define MEMD_SITE() _memd_site_lookup(__FILE__, __LINE__, __func__)
+#endif
+
+/** 
+ * Records the element type of a call site. Blocks only keep their site, so
+ * the type name and element count of a block cost nothing per allocation.
+ * @return The given call site.
+ */
+MEMD_Site *_memd_site_type(MEMD_Site *site, const char *type, size_t type_size) {
+    MEMD_LOCK();
+    if (site->type == NULL) {
+        site->type = type;
+        site->type_size = type_size;
+    }
+    MEMD_UNLOCK();
+    return site;
+}
+
+/** 
+ * Returns the given static call site of a typed allocation, registering it
+ * together with its type on first use.
+ */
+static inline MEMD_Site *_memd_typed_site_use(MEMD_Site *site, const char *file, uint32_t line, const char *func,
+                                              const char *type, size_t type_size) {
+    if (MEMD_LOAD_ACQUIRE(site->id) == 0) {
+        _memd_site_type(site, type, type_size);
+        _memd_site_register(site, file, line, func);
+    }
+    return site;
+}
+
+#if defined(__cplusplus) && __cplusplus >= 201103L && (defined(__GNUC__) || defined(__clang__))
+/** 
+ * Like MEMD_SITE, but also records T as the element type of the call site.
+ */
+#define MEMD_TYPED_SITE(T) ([](const char *_memd_func) { \
+        static MEMD_Site _memd_site; \
+        return _memd_typed_site_use(&_memd_site, __FILE__, __LINE__, _memd_func[0] != '\0' ? _memd_func : NULL, \
+                                    #T, sizeof(T)); \
+    }(__builtin_FUNCTION()))
+#elif defined(__GNUC__) || defined(__clang__)
+#define MEMD_TYPED_SITE(T) (__extension__({ \
+        static MEMD_Site _memd_site; \
+        _memd_typed_site_use(&_memd_site, __FILE__, __LINE__, __func__, #T, sizeof(T)); \
+    }))
+#else
+#define MEMD_TYPED_SITE(T) _memd_site_type(MEMD_SITE(), #T, sizeof(T))
+#endif
+
+/** 
+ * Largest encoded event: the header byte and four varints.
+ */
+#define MEMD_EVENT_MAX_SIZE 40
+
+/** 
+ * Events of one thread waiting to be written as a chunk.
+ */
+typedef struct {
+    uint32_t thread;      /**< Thread whose events are buffered, 0 if none. */
+    uint32_t count;       /**< Number of buffered events. */
+    size_t used;          /**< Bytes of buffered events. */
+    MEMD_EventBase base;  /**< Values the first event is encoded against. */
+    uint64_t sequence;    /**< Sequence number of the last event. */
+    uint64_t address;     /**< Address of the last event. */
+    uint64_t size;        /**< Size of the last allocation. */
+    uint32_t site;        /**< Site id of the last allocation. */
+    unsigned char data[MEMD_EVENT_BUFFER]; /**< Encoded events. */
+} MEMD_EventBuffer;
+
+/** 
+ * State of the event log.
+ */
+static struct {
+    FILE *file;                /**< The log file, NULL while no log is open. */
+    MEMD_EventBuffer *buffers; /**< MEMD_EVENT_THREADS buffers. */
+    uint64_t sequence;         /**< Sequence number of the last event. */
+    uint32_t thread_count;     /**< Number of threads that logged events. */
+    int failed;                /**< Whether a write failed. */
+} _memd_events;
+
+/** 
+ * Number of the current thread in the event log, 0 until its first event.
+ */
+static MEMD_THREAD_LOCAL uint32_t _memd_event_thread = 0;
+
+/** 
+ * Writes the events of a buffer as a chunk and empties it.
+ */
+static void _memd_event_flush(MEMD_EventBuffer *buffer) {
+    static const char padding[8] = { 0 };
+    if (buffer->count > 0) {
+        size_t pad = (8 - buffer->used % 8) % 8;
+        MEMD_DumpChunk chunk;
+        memcpy(chunk.type, MEMD_EVENT_EVENTS, sizeof(chunk.type));
+        chunk.count = buffer->count;
+        chunk.length = sizeof(MEMD_EventBase) + buffer->used + pad;
+        if (fwrite(&chunk, sizeof(chunk), 1, _memd_events.file) != 1 ||
+            fwrite(&buffer->base, sizeof(buffer->base), 1, _memd_events.file) != 1 ||
+            fwrite(buffer->data, 1, buffer->used, _memd_events.file) != buffer->used ||
+            (pad > 0 && fwrite(padding, 1, pad, _memd_events.file) != pad))
+            _memd_events.failed = 1;
+    }
+    buffer->thread = 0;
+    buffer->count = 0;
+    buffer->used = 0;
+}
+
+/** 
+ * Appends a varint to the events of a buffer.
+ */
+static unsigned char *_memd_event_put(unsigned char *out, uint64_t value) {
+    while (value >= 0x80) {
+        *out++ = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (unsigned char)value;
+    return out;
+}
+
+/** 
+ * Logs an allocation or free to the current thread's buffer, if an event log
+ * is open. Called with the MEMD lock held.
+ */
+static void _memd_event(uint32_t type, size_t address, size_t size, const MEMD_Site *site) {
+    if (_memd_events.file == NULL)
+        return;
+    if (_memd_event_thread == 0)
+        _memd_event_thread = ++_memd_events.thread_count;
+    MEMD_EventBuffer *buffer = &_memd_events.buffers[(_memd_event_thread - 1) % MEMD_EVENT_THREADS];
+    if (buffer->thread != _memd_event_thread || buffer->used + MEMD_EVENT_MAX_SIZE > MEMD_EVENT_BUFFER) {
+        _memd_event_flush(buffer);
+        buffer->thread = _memd_event_thread;
+        buffer->base.sequence = _memd_events.sequence;
+        buffer->base.address = address;
+        buffer->base.thread = _memd_event_thread;
+        buffer->base.reserved = 0;
+        buffer->sequence = _memd_events.sequence;
+        buffer->address = address;
+        buffer->size = 0;
+        buffer->site = 0;
+    }
+
+    uint64_t sequence = ++_memd_events.sequence;
+    uint64_t distance = sequence - buffer->sequence - 1;
+    int64_t moved = (int64_t)((uint64_t)address - buffer->address);
+    unsigned header = type | (unsigned)(distance < 15 ? distance : 15) << 4;
+    if (type == MEMD_EVENT_ALLOC && site->id == buffer->site && size == buffer->size)
+        header |= MEMD_EVENT_SAME_SITE;
+    if (moved % 16 == 0) {
+        header |= MEMD_EVENT_SCALED;
+        moved /= 16;
+    }
+
+    unsigned char *out = buffer->data + buffer->used;
+    *out++ = (unsigned char)header;
+    if (distance >= 15)
+        out = _memd_event_put(out, distance - 15);
+    if (type == MEMD_EVENT_ALLOC && (header & MEMD_EVENT_SAME_SITE) == 0) {
+        out = _memd_event_put(out, site->id);
+        out = _memd_event_put(out, size);
+    }
+    out = _memd_event_put(out, moved < 0 ? (~(uint64_t)moved << 1) | 1 : (uint64_t)moved << 1);
+
+    buffer->used = (size_t)(out - buffer->data);
+    buffer->count++;
+    buffer->sequence = sequence;
+    buffer->address = address;
+    if (type == MEMD_EVENT_ALLOC) {
+        buffer->site = site->id;
+        buffer->size = size;
+    }
+}
+
+#ifdef MEMD_FILL_PATTERN
+/** 
+ * Whether the block being allocated is filled with MEMD_FILL_PATTERN, copied
+ * to its record so only filled blocks are measured when they are freed.
+ * Changed with the MEMD lock held.
+ */
+static int32_t _memd_filling = 0;
+#endif
+
+/** 
+ * Raises the peak of live bytes after an allocation.
+ */
+static inline void _memd_update_peak() {
+    size_t live_size = MEMD_Data.total_allocated_size - MEMD_Data.total_free_size;
+    if (live_size > MEMD_Data.peak_size)
+        MEMD_Data.peak_size = live_size;
+}
+
+/** 
+ * Records a memory allocation in the first free slot at or after *cursor,
+ * leaving *cursor behind that slot so consecutive inserts don't rescan the table.
+ * @return Pointer to the new tracked memory allocation, or NULL if it was not recorded.
+ */
+static MEMD_Mem *_insert_from(uint32_t *cursor, size_t address, size_t size, MEMD_Site *site) {
+    // check for null
+    if (address == 0) {
+        WARN("Memory allocation failed", site);
+        return NULL;
+    }
+
+    while (*cursor < MEMD_MAX_ALLOCATIONS && MEMD_Data.mem[*cursor].address != 0)
+        (*cursor)++;
+    // if there is no free slot left we need to increase the MEMD_MAX_ALLOCATIONS value
+    if (*cursor == MEMD_MAX_ALLOCATIONS) {
+        WARN("Max allocations reached", site);
+        return NULL;
+    }
+    MEMD_Mem *mem = &MEMD_Data.mem[(*cursor)++];
+
+    // save all the allocation info
+    mem->address = address;
+    mem->size = size;
+    mem->site = site;
+    mem->alignment = 0;
+    mem->pool = NULL;
+    mem->freelist = -1;
+#ifdef MEMD_FILL_PATTERN
+    mem->filled = _memd_filling;
+#endif
+    MEMD_Data.total_allocated_size += size;
+    mem->tick = ++MEMD_Data.alloc_count;
+    _memd_update_peak();
+    site->alloc_count++;
+    site->allocated_size += size;
+    _memd_event(MEMD_EVENT_ALLOC, address, size, site);
+    return mem;
+}
+
+/** 
+ * Records a memory allocation.
+ * @return Pointer to the new tracked memory allocation, or NULL if it was not recorded.
+ */
+MEMD_Mem *_insert(size_t address, size_t size, MEMD_Site *site) {
+    uint32_t cursor = 0;
+    return _insert_from(&cursor, address, size, site);
+}
+
+/** 
+ * Unlinks a tracked memory allocation from the record list of its pool.
+ */
+static void _pool_unlink(MEMD_Mem *mem) {
+    MEMD_Pool *pool = mem->pool;
+    if (mem->pool_prev != -1)
+        MEMD_Data.mem[mem->pool_prev].pool_next = mem->pool_next;
+    else
+        pool->first = mem->pool_next;
+    if (mem->pool_next != -1)
+        MEMD_Data.mem[mem->pool_next].pool_prev = mem->pool_prev;
+    pool->live_count--;
+    pool->live_size -= mem->size;
+    mem->pool = NULL;
+}
+
+/** 
+ * Marks a tracked memory allocation as freed and updates the totals.
+ */
+static void _release(MEMD_Mem *mem) {
+    _memd_event(MEMD_EVENT_FREE, mem->address, 0, mem->site);
+    mem->address = 0;
+    MEMD_Data.total_free_size += mem->size;
+    MEMD_Data.free_count++;
+    mem->site->free_count++;
+    mem->site->free_size += mem->size;
+}
+
+/** 
+ * Removes a tracked memory allocation, marking it as freed.
+ * @return The released record, or NULL on failure (e.g., double free detected).
+ */
+static MEMD_Mem *_erase_block(size_t address, MEMD_Site *site) {
+    if (address == 0) {
+        WARN("Tried to free a null ptr", site);
+        return NULL;
+    }
+
+    MEMD_Mem *mem = _find_by_address(address);
+    // if the address is not found we assume it is already deleted
+    if (mem == NULL) {
+        WARN("Double free detected", site);
+        return NULL;
+    }
+
+    // set address to null and update info
+    _release(mem);
+    return mem;
+}
+
+/** 
+ * Removes a tracked memory allocation, marking it as freed.
+ * @return -1 on failure (e.g., double free detected), 0 on success.
+ */
+int _erase(size_t address, MEMD_Site *site) {
+    return _erase_block(address, site) != NULL ? 0 : -1;
+}
+
+#ifdef MEMD_FILL_PATTERN
+/** 
+ * Marks the records of the following allocations as filled, unless tracking
+ * is paused.
+ */
+static inline void _memd_fill_begin() {
+    _memd_filling = _memd_ignore != 1;
+}
+
+/** 
+ * Fills a new block with MEMD_FILL_PATTERN. memset uses the widest stores
+ * the C library has for the machine.
+ */
+static void _memd_fill(void *ptr, size_t size) {
+    if (ptr != NULL && _memd_filling)
+        memset(ptr, MEMD_FILL_PATTERN, size);
+    _memd_filling = 0;
+}
+
+/** 
+ * Whether the block of a table or slab record was filled.
+ */
+#define _memd_filled(record) ((record) != NULL && (record)->filled)
+
+/** 
+ * Measures how much of a filled block was written before it is freed, by
+ * scanning backwards for the last byte that differs from the pattern.
+ */
+static void _memd_fill_measure(MEMD_Site *site, const void *ptr, size_t size, int32_t filled) {
+    if (!filled)
+        return;
+    const unsigned char *data = (const unsigned char *)ptr;
+    size_t pattern;
+    memset(&pattern, MEMD_FILL_PATTERN, sizeof(pattern));
+
+    size_t used = size;
+    while (used >= sizeof(size_t)) {
+        size_t word;
+        memcpy(&word, data + used - sizeof(size_t), sizeof(word));
+        if (word != pattern)
+            break;
+        used -= sizeof(size_t);
+    }
+    while (used > 0 && data[used - 1] == (unsigned char)MEMD_FILL_PATTERN)
+        used--;
+
+    site->measured_count++;
+    site->measured_size += size;
+    site->used_size += used;
+    if (used == 0)
+        site->untouched_count++;
+}
+#else
+#define _memd_fill_begin() ((void)0)
+#define _memd_fill(ptr, size) ((void)0)
+#define _memd_fill_measure(site, ptr, size, filled) ((void)0)
+#define _memd_filled(record) 0
+#endif // MEMD_FILL_PATTERN
+
+#ifdef MEMD_SITE_POOLING
+/** 
+ * Per-thread freelists of the pooled sites, indexed by freelist slot.
+ */
+static MEMD_THREAD_LOCAL void *_memd_freelists[MEMD_MAX_POOLED_SITES];
+
+/** 
+ * Number of blocks in each of the calling thread's freelists.
+ */
+static MEMD_THREAD_LOCAL uint32_t _memd_freelist_counts[MEMD_MAX_POOLED_SITES];
+
+/** 
+ * Frees the blocks kept in the calling thread's freelists. Called with the
+ * MEMD lock held.
+ */
+static void _memd_freelists_drain(void) {
+    for (uint32_t slot = 0; slot < MEMD_MAX_POOLED_SITES; slot++) {
+        while (_memd_freelists[slot] != NULL) {
+            void *ptr = _memd_freelists[slot];
+            _memd_freelists[slot] = *(void **)ptr;
+            free(ptr);
+        }
+        _memd_freelist_counts[slot] = 0;
+    }
+}
+
+#ifdef MEMD_THREADSAFE
+/** 
+ * Drains the freelists of a thread when it exits.
+ */
+#ifdef _WIN32
+static void WINAPI _memd_freelists_exit(void *value) {
+#else
+static void _memd_freelists_exit(void *value) {
+#endif
+    (void)value;
+    MEMD_LOCK();
+    _memd_freelists_drain();
+    MEMD_UNLOCK();
+}
+
+/** 
+ * Key whose destructor drains the freelists of exiting threads.
+ */
+#ifdef _WIN32
+static DWORD _memd_freelists_key = FLS_OUT_OF_INDEXES;
+#else
+static pthread_key_t _memd_freelists_key;
+static int _memd_freelists_key_created = 0;
+#endif
+
+/** 
+ * Whether the calling thread has set the freelists key.
+ */
+static MEMD_THREAD_LOCAL int _memd_freelists_watched = 0;
+
+/** 
+ * Makes sure the freelists of the calling thread are drained when it exits.
+ * Called with the MEMD lock held.
+ */
+static void _memd_freelists_watch(void) {
+    if (_memd_freelists_watched)
+        return;
+#ifdef _WIN32
+    if (_memd_freelists_key == FLS_OUT_OF_INDEXES)
+        _memd_freelists_key = FlsAlloc(_memd_freelists_exit);
+    if (_memd_freelists_key != FLS_OUT_OF_INDEXES)
+        FlsSetValue(_memd_freelists_key, (void *)1);
+#else
+    if (!_memd_freelists_key_created)
+        _memd_freelists_key_created = pthread_key_create(&_memd_freelists_key, _memd_freelists_exit) == 0;
+    if (_memd_freelists_key_created)
+        pthread_setspecific(_memd_freelists_key, (void *)1);
+#endif
+    _memd_freelists_watched = 1;
+}
+#else
+#define _memd_freelists_watch() ((void)0)
+#endif // MEMD_THREADSAFE
+
+/** 
+ * Allocates a block for a site, serving sites that keep allocating the same
+ * small size from the calling thread's freelist.
+ */
+static void *_memd_pooled_malloc(size_t size, MEMD_Site *site) {
+    // watch for sites repeatedly allocating the same small size
+    if (site->pooled_slot == 0) {
+        if (size == site->last_size) {
+            site->repeat_count++;
+        } else {
+            site->last_size = (uint32_t)size;
+            site->repeat_count = 1;
+        }
+        if (site->repeat_count >= MEMD_SITE_POOLING_THRESHOLD &&
+            size >= sizeof(void *) && size <= MEMD_SITE_POOLING_MAX_SIZE &&
+            MEMD_Data.pooled_site_count < MEMD_MAX_POOLED_SITES)
+            site->pooled_slot = ++MEMD_Data.pooled_site_count;
+    }
+
+    void *ptr = NULL;
+    int32_t slot = -1;
+    if (site->pooled_slot != 0 && size == site->last_size) {
+        slot = (int32_t)site->pooled_slot - 1;
+        ptr = _memd_freelists[slot];
+        if (ptr != NULL) {
+            _memd_freelists[slot] = *(void **)ptr;
+            _memd_freelist_counts[slot]--;
+            site->pooled_hits++;
+        }
+    }
+    if (ptr == NULL)
+        ptr = malloc(size);
+
+    MEMD_Mem *mem = _insert((size_t)ptr, size, site);
+    if (mem != NULL)
+        mem->freelist = slot;
+    return ptr;
+}
+#endif // MEMD_SITE_POOLING
+
+/** 
+ * Compares two addresses for qsort.
+ */
+static int _memd_compare_address(const void *a, const void *b) {
+    size_t x = *(const size_t *)a;
+    size_t y = *(const size_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/** 
+ * Marks a deferred slab block in MEMD_Deferred.freelist.
+ */
+#define MEMD_DEFER_SLAB (-2)
+
+/** 
+ * Block freed while a report scans it, released when the report is done.
+ */
+typedef struct {
+    void *ptr;        /**< The freed block. */
+    int32_t freelist; /**< Site freelist slot the block returns to, -1, or MEMD_DEFER_SLAB. */
+} MEMD_Deferred;
+
+/** 
+ * Record of a block at the time of a report snapshot.
+ */
+typedef struct {
+    MEMD_Mem mem;           /**< Copy of the block's record. */
+    MEMD_Suppression *rule; /**< Rule suppressing the block, or NULL. */
+    const char *pool_name;  /**< Name of the block's pool, which may be destroyed during the report. */
+} MEMD_SnapshotBlock;
+
+/** 
+ * Point-in-time copy of the tracking data a report is built from. The
+ * records are copied under the MEMD lock, and the block contents are scanned
+ * after releasing it while other threads keep allocating. Blocks of the
+ * snapshot freed in the meantime keep their memory until the report is done,
+ * so the extra memory is bounded by the blocks live at the snapshot.
+ */
+typedef struct {
+    int active;                 /**< Whether freed blocks of the snapshot are deferred. */
+    MEMD_SnapshotBlock *blocks; /**< Tracked blocks, table records first. */
+    uint32_t count;             /**< Number of tracked blocks. */
+    size_t *addresses;          /**< Sorted addresses of the blocks that are scanned. */
+    uint32_t address_count;     /**< Number of scanned blocks. */
+    MEMD_Deferred *deferred;    /**< Blocks freed during the report, one slot per scanned block. */
+    uint32_t deferred_count;    /**< Number of deferred blocks. */
+    size_t total_allocated_size; /**< Total size of all allocated memory. */
+    size_t total_free_size;     /**< Total size of all freed memory. */
+#ifdef MEMD_LEAK_PREVIEW
+    MEMD_Site *groups[MEMD_LEAK_PREVIEW_GROUPS]; /**< Sites whose leaked blocks are previewed. */
+    int group_count;            /**< Number of previewed sites. */
+#endif
+    int suppression_count;      /**< Number of suppression rules at the snapshot. */
+    size_t hit_count[MEMD_MAX_SUPPRESSIONS]; /**< Leaked blocks suppressed by each rule in this report. */
+    size_t hit_size[MEMD_MAX_SUPPRESSIONS];  /**< Bytes of those blocks. */
+    uint32_t site_count;        /**< Number of registered sites at the snapshot. */
+    size_t tick;                /**< Allocation count at the snapshot, block ages are relative to it. */
+    char *tail;                 /**< Report sections formatted from the site statistics. */
+} MEMD_Snapshot;
+
+static MEMD_Snapshot _memd_snapshot;
+
+/** 
+ * Checks whether a report is scanning a block.
+ */
+static int _memd_snapshot_holds(const void *ptr) {
+    size_t address = (size_t)ptr;
+    return _memd_snapshot.active &&
+        bsearch(&address, _memd_snapshot.addresses, _memd_snapshot.address_count, sizeof(size_t), _memd_compare_address) != NULL;
+}
+
+/** 
+ * Keeps the memory of a freed block until the running report is done, if the
+ * report scans it. Called with the MEMD lock held.
+ * @return 1 if the block was deferred, 0 if it can be released now.
+ */
+static int _memd_snapshot_defer(void *ptr, int32_t freelist) {
+    if (!_memd_snapshot_holds(ptr))
+        return 0;
+    MEMD_Deferred *deferred = &_memd_snapshot.deferred[_memd_snapshot.deferred_count++];
+    deferred->ptr = ptr;
+    deferred->freelist = freelist;
+    return 1;
+}
+
+/** 
+ * Waits until the running report is done scanning, for blocks released by a
+ * deallocator outside MEMD, like the allocator of a tracking_allocator. Those
+ * can't be deferred, their allocator or upstream resource may be gone by the
+ * time the report ends. Called without the MEMD lock.
+ */
+static inline void _memd_snapshot_wait() {
+    MEMD_REPORT_LOCK();
+    MEMD_REPORT_UNLOCK();
+}
+
+/** 
+ * Drops the record of a block an external allocator is about to free. The
+ * memory goes away either way, so the record is dropped while tracking is
+ * paused too, and blocks without a record (allocated while paused or with a
+ * full table) are no double free. Waits for a report scanning the block.
+ * @return The size of the dropped record, or 0 if the block had none.
+ */
+static inline size_t _memd_untrack(const void *ptr) {
+    size_t size = 0;
+    MEMD_LOCK();
+    MEMD_Mem *mem = _find_by_address((size_t)ptr);
+    if (mem != NULL) {
+        size = mem->size;
+        _release(mem);
+    }
+    int scanned = _memd_snapshot_holds(ptr);
+    MEMD_UNLOCK();
+    if (scanned)
+        _memd_snapshot_wait();
+    return size;
+}
+
+#ifdef MEMD_SLAB_BACKEND
+/** 
+ * Tracking info of a slab block.
+ */
+typedef struct {
+    MEMD_Site *site; /**< The call site where the allocation occurred, NULL once freed. */
+    size_t size;     /**< The requested size of the allocation. */
+    size_t tick;     /**< Allocation count when the block was allocated. */
+#ifdef MEMD_FILL_PATTERN
+    int32_t filled;  /**< 1 if the block was filled with MEMD_FILL_PATTERN. */
+#endif
+} MEMD_SlabRecord;
+
+/** 
+ * Struct to represent a slab of equally sized blocks.
+ * Bit i of the bitmap is set while block i is allocated, and records[i] holds
+ * its tracking info.
+ */
+typedef struct MEMD_Slab {
+    uint32_t block_size;  /**< Size of the blocks, 0 while the slab is not carved. */
+    uint32_t block_count; /**< Number of blocks in the slab. */
+    uint32_t used_count;  /**< Number of allocated blocks. */
+    uint32_t hint;        /**< Lowest bitmap word that may have a free block. */
+    uint64_t bitmap[MEMD_SLAB_BLOCKS / 64]; /**< Allocation bitmap. */
+    MEMD_SlabRecord *records; /**< Tracking info, indexed like the bitmap. */
+    struct MEMD_Slab *next_partial; /**< Next slab of the class with free blocks. */
+} MEMD_Slab;
+
+/** 
+ * Global structure of the slab backend.
+ */
+struct {
+    char *region;        /**< Start of the slab address range. */
+    uint32_t carved;     /**< Number of slabs carved from the region. */
+    MEMD_Slab *partial[MEMD_SLAB_CLASSES]; /**< Slabs with free blocks, per class. */
+    MEMD_Slab slabs[MEMD_SLAB_REGION_SIZE / MEMD_SLAB_SIZE]; /**< Slab metadata, per slab. */
+} _memd_slab;
+
+/** 
+ * Block size of each size class.
+ */
+static const uint32_t _memd_slab_sizes[MEMD_SLAB_CLASSES] = { 16, 32, 48, 64, 96, 128, 192, 256 };
+
+/** 
+ * Size class of each allocation size, indexed by (size + 15) / 16.
+ */
+static const uint8_t _memd_slab_class[MEMD_SLAB_MAX_SIZE / 16 + 1] = { 0, 0, 1, 2, 3, 4, 4, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7 };
+
+/** 
+ * Returns the index of the lowest set bit of x, which must not be 0.
+ */
+static inline uint32_t _memd_ctz64(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+    return (uint32_t)__builtin_ctzll(x);
+#else
+    uint32_t n = 0;
+    while ((x & 1) == 0) {
+        x >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+/** 
+ * Returns whether ptr was handed out by the slab backend.
+ */
+static inline int _memd_slab_owns(const void *ptr) {
+    return _memd_slab.region != NULL && (const char *)ptr >= _memd_slab.region &&
+        (const char *)ptr < _memd_slab.region + (size_t)_memd_slab.carved * MEMD_SLAB_SIZE;
+}
+
+/** 
+ * Carves a new slab for a size class from the region.
+ * @return Pointer to the slab, or NULL if the region is exhausted.
+ */
+static MEMD_Slab *_memd_slab_carve(uint32_t cls) {
+    if (_memd_slab.region == NULL) {
+        _memd_slab.region = (char *)malloc(MEMD_SLAB_REGION_SIZE);
+        if (_memd_slab.region == NULL)
+            return NULL;
+    }
+    if (_memd_slab.carved >= MEMD_SLAB_REGION_SIZE / MEMD_SLAB_SIZE)
+        return NULL;
+
+    MEMD_Slab *slab = &_memd_slab.slabs[_memd_slab.carved];
+    slab->block_size = _memd_slab_sizes[cls];
+    slab->block_count = (uint32_t)(MEMD_SLAB_SIZE / slab->block_size);
+    slab->records = (MEMD_SlabRecord *)malloc(slab->block_count * sizeof(MEMD_SlabRecord));
+    if (slab->records == NULL) {
+        slab->block_size = 0;
+        return NULL;
+    }
+    _memd_slab.carved++;
+
+    // blocks past the end of the slab are marked as used so they are never handed out
+    for (uint32_t i = slab->block_count; i < MEMD_SLAB_BLOCKS; i++)
+        slab->bitmap[i / 64] |= (uint64_t)1 << (i % 64);
+
+    slab->next_partial = _memd_slab.partial[cls];
+    _memd_slab.partial[cls] = slab;
+    return slab;
+}
+
+/** 
+ * Allocates and records a small block from the slab of its size class.
+ * @return Pointer to the block, or NULL if no slab is left.
+ */
+static void *_memd_slab_alloc(size_t size, MEMD_Site *site) {
+    uint32_t cls = _memd_slab_class[(size + 15) >> 4];
+    MEMD_Slab *slab = _memd_slab.partial[cls];
+    if (slab == NULL && (slab = _memd_slab_carve(cls)) == NULL)
+        return NULL;
+
+    // take the lowest free block
+    uint32_t word = slab->hint;
+    while (slab->bitmap[word] == ~(uint64_t)0)
+        word++;
+    uint32_t index = word * 64 + _memd_ctz64(~slab->bitmap[word]);
+    slab->bitmap[word] |= (uint64_t)1 << (index % 64);
+    slab->hint = word;
+
+    // full slabs leave the partial list until a block is freed
+    if (++slab->used_count == slab->block_count)
+        _memd_slab.partial[cls] = slab->next_partial;
+
+    slab->records[index].site = site;
+    slab->records[index].size = size;
+#ifdef MEMD_FILL_PATTERN
+    slab->records[index].filled = _memd_filling;
+#endif
+    MEMD_Data.total_allocated_size += size;
+    slab->records[index].tick = ++MEMD_Data.alloc_count;
+    _memd_update_peak();
+    site->alloc_count++;
+    site->allocated_size += size;
+
+    size_t slab_index = (size_t)(slab - _memd_slab.slabs);
+    char *block = _memd_slab.region + (slab_index << MEMD_SLAB_SHIFT) + (size_t)index * slab->block_size;
+    _memd_event(MEMD_EVENT_ALLOC, (size_t)block, size, site);
+    return block;
+}
+
+/** 
+ * Finds the slab and block index of a pointer owned by the slab backend.
+ * @return Pointer to the slab, or NULL if ptr is not an allocated block.
+ */
+static MEMD_Slab *_memd_slab_find(const void *ptr, uint32_t *index) {
+    size_t offset = (size_t)((const char *)ptr - _memd_slab.region);
+    MEMD_Slab *slab = &_memd_slab.slabs[offset >> MEMD_SLAB_SHIFT];
+    size_t in_slab = offset & (MEMD_SLAB_SIZE - 1);
+
+    if (in_slab % slab->block_size != 0)
+        return NULL;
+    *index = (uint32_t)(in_slab / slab->block_size);
+    if ((slab->bitmap[*index / 64] & ((uint64_t)1 << (*index % 64))) == 0 || slab->records[*index].site == NULL)
+        return NULL;
+    return slab;
+}
+
+/** 
+ * Returns a block to its slab.
+ */
+static void _memd_slab_release(void *ptr) {
+    size_t offset = (size_t)((const char *)ptr - _memd_slab.region);
+    MEMD_Slab *slab = &_memd_slab.slabs[offset >> MEMD_SLAB_SHIFT];
+    uint32_t index = (uint32_t)((offset & (MEMD_SLAB_SIZE - 1)) / slab->block_size);
+
+    slab->records[index].site = NULL;
+    slab->bitmap[index / 64] &= ~((uint64_t)1 << (index % 64));
+    if (index / 64 < slab->hint)
+        slab->hint = index / 64;
+    if (slab->used_count-- == slab->block_count) {
+        uint32_t cls = _memd_slab_class[(slab->block_size + 15) >> 4];
+        slab->next_partial = _memd_slab.partial[cls];
+        _memd_slab.partial[cls] = slab;
+    }
+}
+
+/** 
+ * Removes the record of a slab block and returns the block to its slab.
+ */
+static void _memd_slab_free(void *ptr, MEMD_Site *site) {
+    uint32_t index;
+    MEMD_Slab *slab = _memd_slab_find(ptr, &index);
+    if (slab == NULL) {
+        WARN("Double free detected", site);
+        return;
+    }
+
+    MEMD_SlabRecord *record = &slab->records[index];
+    _memd_fill_measure(record->site, ptr, record->size, record->filled);
+    _memd_event(MEMD_EVENT_FREE, (size_t)ptr, 0, record->site);
+    MEMD_Data.total_free_size += record->size;
+    MEMD_Data.free_count++;
+    record->site->free_count++;
+    record->site->free_size += record->size;
+
+    // the block stays allocated in the bitmap until a running report is done
+    record->site = NULL;
+    if (!_memd_snapshot_defer(ptr, MEMD_DEFER_SLAB))
+        _memd_slab_release(ptr);
+}
+#endif // MEMD_SLAB_BACKEND
+
+/** 
+ * Returns the memory of a freed tracked block to where it came from.
+ */
+static void _memd_free_memory(void *ptr, int32_t freelist) {
+    if (_memd_snapshot_defer(ptr, freelist))
+        return;
+#ifdef MEMD_SITE_POOLING
+    // pooled blocks go back to the calling thread's freelist until it is full
+    if (freelist != -1 && _memd_freelist_counts[freelist] < MEMD_SITE_POOLING_MAX_FREE) {
+        _memd_freelists_watch();
+        *(void **)ptr = _memd_freelists[freelist];
+        _memd_freelists[freelist] = ptr;
+        _memd_freelist_counts[freelist]++;
+        return;
+    }
+#else
+    (void)freelist;
+#endif
+    free(ptr);
+}
+
+/** 
+ * Allocates and records a block from the slab backend, the site's freelist
+ * or malloc. Called with the MEMD lock held.
+ */
+static void *_tracked_malloc_block(size_t size, MEMD_Site *site) {
+#ifdef MEMD_SLAB_BACKEND
+    if (_memd_ignore != 1 && size > 0 && size <= MEMD_SLAB_MAX_SIZE) {
+        void *ptr = _memd_slab_alloc(size, site);
+        if (ptr != NULL)
+            return ptr;
+    }
+#endif
+#ifdef MEMD_SITE_POOLING
+    if (_memd_ignore != 1)
+        return _memd_pooled_malloc(size, site);
+#endif
+    void *ptr = malloc(size);
+
+    if (_memd_ignore != 1) {
+        // insert to memory data
+        _insert((size_t)ptr, size, site);
+    }
+
+    return ptr;
+}
+
+/** 
+ * Allocates and records a block, filling it with MEMD_FILL_PATTERN. Called
+ * with the MEMD lock held.
+ */
+static void *_tracked_malloc(size_t size, MEMD_Site *site) {
+    _memd_fill_begin();
+    void *ptr = _tracked_malloc_block(size, site);
+    _memd_fill(ptr, size);
+    return ptr;
+}
+
+/** 
+ * Allocates, zeroes and records a block. Called with the MEMD lock held.
+ */
+static void *_tracked_calloc(size_t num, size_t size, MEMD_Site *site) {
+    size_t totalSize = num * size;
+#ifdef MEMD_SLAB_BACKEND
+    if (_memd_ignore != 1 && totalSize > 0 && totalSize <= MEMD_SLAB_MAX_SIZE && totalSize / num == size) {
+        void *ptr = _memd_slab_alloc(totalSize, site);
+        if (ptr != NULL)
+            return memset(ptr, 0, totalSize);
+    }
+#endif
+    void *ptr = calloc(num, size);
+
+    if (_memd_ignore != 1 && ptr != NULL) {
+        _insert((size_t)ptr, totalSize, site);
+    }
+
+    return ptr;
+}
+
+/** 
+ * Removes the record of a block and frees it. Called with the MEMD lock held.
+ */
+static void _tracked_free(void *ptr, MEMD_Site *site) {
+    if (_memd_ignore != 1) {
+#ifdef MEMD_SLAB_BACKEND
+        if (_memd_slab_owns(ptr)) {
+            _memd_slab_free(ptr, site);
+            return;
+        }
+#endif
+        // erase memory data
+        MEMD_Mem *mem = _erase_block((size_t)ptr, site);
+        if (mem != NULL) {
+            _memd_fill_measure(mem->site, ptr, mem->size, mem->filled);
+            _memd_free_memory(ptr, mem->freelist);
+        }
+    }
+}
+
+/** 
+ * Allocates the new block of a realloc that moves the block and copies the
+ * old contents. Behind them, the block is filled if the old one was filled.
+ */
+static void *_tracked_move(const void *ptr, size_t oldSize, int32_t filled, size_t size, MEMD_Site *site) {
+#ifdef MEMD_FILL_PATTERN
+    _memd_filling = filled && _memd_ignore != 1;
+#else
+    (void)filled;
+#endif
+    void *newPtr = _tracked_malloc_block(size, site);
+    if (newPtr != NULL)
+        memcpy(newPtr, ptr, oldSize < size ? oldSize : size);
+#ifdef MEMD_FILL_PATTERN
+    if (newPtr != NULL && _memd_filling && oldSize < size)
+        memset((char *)newPtr + oldSize, MEMD_FILL_PATTERN, size - oldSize);
+    _memd_filling = 0;
+#endif
+    return newPtr;
+}
+
+/** 
+ * Resizes a block and moves its record. Called with the MEMD lock held.
+ */
+static void *_tracked_realloc(void *ptr, size_t size, MEMD_Site *site) {
+    if (ptr == NULL) {
+        // Equivalent to malloc
+        return _tracked_malloc(size, site);
+    } else if (size == 0) {
+        // Equivalent to free
+        _tracked_free(ptr, site);
+        return NULL;
+    } else {
+#ifdef MEMD_SLAB_BACKEND
+        // slab blocks can't be resized in place, so they are moved
+        if (_memd_slab_owns(ptr)) {
+            uint32_t index;
+            MEMD_Slab *slab = _memd_slab_find(ptr, &index);
+            MEMD_SlabRecord *record = slab != NULL ? &slab->records[index] : NULL;
+            void *newPtr = _tracked_move(ptr, record != NULL ? record->size : 0, _memd_filled(record), size, site);
+            if (newPtr != NULL)
+                _tracked_free(ptr, site);
+            return newPtr;
+        }
+#endif
+        // blocks a report is scanning are moved, so the old memory can be
+        // deferred, also while paused when the record is left as it is
+        if (_memd_snapshot_holds(ptr)) {
+            MEMD_Mem *old = _find_by_address((size_t)ptr);
+            void *newPtr = _tracked_move(ptr, old != NULL ? old->size : 0, _memd_filled(old), size, site);
+            if (newPtr != NULL) {
+                if (_memd_ignore != 1)
+                    _tracked_free(ptr, site);
+                else
+                    _memd_snapshot_defer(ptr, old != NULL ? old->freelist : -1);
+            }
+            return newPtr;
+        }
+#ifdef MEMD_FILL_PATTERN
+        // grown filled blocks get the pattern behind the old contents and
+        // stay filled
+        MEMD_Mem *old = _memd_ignore != 1 ? _find_by_address((size_t)ptr) : NULL;
+        int32_t filled = _memd_filled(old);
+        size_t oldSize = filled ? old->size : size;
+#endif
+        // Reallocate and update MEMD tracking if not ignored
+        void *newPtr = realloc(ptr, size);
+#ifdef MEMD_FILL_PATTERN
+        if (newPtr != NULL && oldSize < size)
+            memset((char *)newPtr + oldSize, MEMD_FILL_PATTERN, size - oldSize);
+        _memd_filling = filled;
+#endif
+        if (newPtr != NULL && _memd_ignore != 1) {
+            // Erase old entry
+            _erase((size_t)ptr, site);
+            // Insert new entry
+            _insert((size_t)newPtr, size, site);
+        }
+#ifdef MEMD_FILL_PATTERN
+        _memd_filling = 0;
+#endif
+        return newPtr;
+    }
+}
+
+/** 
+ * Custom implementation of malloc for tracking purposes.
+ */
+void *_memd_malloc(size_t size, MEMD_Site *site) {
+    MEMD_LOCK();
+    void *ptr = _tracked_malloc(size, site);
+    MEMD_UNLOCK();
+    return ptr;
+}
+
+/** 
+ * Allocates an uninitialized array of num elements of size bytes, behind
+ * MEMD_NEW_ARRAY.
+ * @return NULL if num * size overflows, like calloc.
+ */
+void *_memd_malloc_array(size_t num, size_t size, MEMD_Site *site) {
+    if (size != 0 && num > SIZE_MAX / size)
+        return NULL;
+    return _memd_malloc(num * size, site);
+}
+
+/** 
+ * Custom implementation of calloc for tracking purposes.
+ * Allocates memory for an array of num elements of size bytes each and initializes all bytes to zero.
+ */
+void *_memd_calloc(size_t num, size_t size, MEMD_Site *site) {
+    MEMD_LOCK();
+    void *ptr = _tracked_calloc(num, size, site);
+    MEMD_UNLOCK();
+    return ptr;
+}
+
+/** 
+ * Custom implementation of free for tracking purposes.
+ */
+void _memd_free(void *ptr, MEMD_Site *site) {
+    MEMD_LOCK();
+    _tracked_free(ptr, site);
+    MEMD_UNLOCK();
+}
+
+/** 
+ * Custom implementation of realloc for tracking purposes.
+ * Changes the size of the memory block pointed to by ptr to size bytes.
+ */
+void *_memd_realloc(void *ptr, size_t size, MEMD_Site *site) {
+    MEMD_LOCK();
+    void *newPtr = _tracked_realloc(ptr, size, site);
+    MEMD_UNLOCK();
+    return newPtr;
+}
+
+/** 
+ * Allocates n blocks of size bytes into out, taking the MEMD lock once and
+ * recording all blocks with a single pass over the allocation table.
+ * @return The number of blocks that were allocated.
+ */
+size_t _memd_malloc_batch(size_t n, size_t size, void **out, MEMD_Site *site) {
+    size_t count = 0;
+    uint32_t cursor = 0;
+
+    MEMD_LOCK();
+    for (size_t i = 0; i < n; i++) {
+        void *ptr = NULL;
+        _memd_fill_begin();
+#ifdef MEMD_SLAB_BACKEND
+        if (_memd_ignore != 1 && size > 0 && size <= MEMD_SLAB_MAX_SIZE)
+            ptr = _memd_slab_alloc(size, site);
+#endif
+        if (ptr == NULL) {
+            ptr = malloc(size);
+            if (_memd_ignore != 1)
+                _insert_from(&cursor, (size_t)ptr, size, site);
+        }
+        _memd_fill(ptr, size);
+        out[i] = ptr;
+        if (ptr != NULL)
+            count++;
+    }
+    MEMD_UNLOCK();
+    return count;
+}
+
+/** 
+ * Frees n blocks, taking the MEMD lock once. The addresses are sorted so all
+ * records are found with a single pass over the allocation table. NULL
+ * entries are skipped.
+ */
+void _memd_free_batch(void **ptrs, size_t n, MEMD_Site *site) {
+    MEMD_LOCK();
+    if (_memd_ignore == 1) {
+        MEMD_UNLOCK();
+        return;
+    }
+
+    // sorted addresses followed by one matched flag per address
+    size_t *sorted = (size_t *)malloc(n * (sizeof(size_t) + 1));
+    if (sorted == NULL) {
+        for (size_t i = 0; i < n; i++) {
+            if (ptrs[i] != NULL)
+                _tracked_free(ptrs[i], site);
+        }
+        MEMD_UNLOCK();
+        return;
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (ptrs[i] == NULL)
+            continue;
+#ifdef MEMD_SLAB_BACKEND
+        if (_memd_slab_owns(ptrs[i])) {
+            _memd_slab_free(ptrs[i], site);
+            continue;
+        }
+#endif
+        sorted[count++] = (size_t)ptrs[i];
+    }
+    qsort(sorted, count, sizeof(size_t), _memd_compare_address);
+    char *matched = (char *)(sorted + count);
+    memset(matched, 0, count);
+
+    size_t remaining = count;
+    for (uint32_t i = 0; i < MEMD_MAX_ALLOCATIONS && remaining > 0; i++) {
+        MEMD_Mem *mem = &MEMD_Data.mem[i];
+        if (mem->address == 0 || mem->pool != NULL)
+            continue;
+
+        // find the first unmatched copy of the address in the batch
+        size_t low = 0, high = count;
+        while (low < high) {
+            size_t mid = low + (high - low) / 2;
+            if (sorted[mid] < mem->address)
+                low = mid + 1;
+            else
+                high = mid;
+        }
+        if (low == count || sorted[low] != mem->address)
+            continue;
+
+        void *ptr = (void *)mem->address;
+        matched[low] = 1;
+        remaining--;
+        _memd_fill_measure(mem->site, ptr, mem->size, mem->filled);
+        _release(mem);
+        _memd_free_memory(ptr, mem->freelist);
+    }
+
+    // whatever is left over was not allocated (anymore)
+    for (size_t i = 0; i < count && remaining > 0; i++) {
+        if (matched[i] == 0) {
+            WARN("Double free detected", site);
+            remaining--;
+        }
+    }
+
+    free(sorted);
+    MEMD_UNLOCK();
+}
+
+/** 
+ * Registers a memory resource whose usage is listed in the report.
+ * @return Pointer to the resource statistics, or NULL if MEMD_MAX_RESOURCES is reached.
+ */
+MEMD_Resource *_memd_resource_register(const char *name, const char *file, uint32_t line) {
+    MEMD_Resource *resource = NULL;
+
+    MEMD_LOCK();
+    if (MEMD_Data.resource_count < MEMD_MAX_RESOURCES) {
+        resource = &MEMD_Data.resources[MEMD_Data.resource_count++];
+        resource->name = name;
+        resource->live_size = 0;
+        resource->peak_size = 0;
+        resource->site.tag = name;
+        _memd_site_register(&resource->site, file, line, NULL);
+    }
+    MEMD_UNLOCK();
+    return resource;
+}
+
+MEMD_Pool *memd_pool_create(const char *name) {
+    MEMD_Pool *pool = NULL;
+
+    MEMD_LOCK();
+    if (MEMD_Data.pool_count < MEMD_MAX_POOLS) {
+        pool = &MEMD_Data.pools[MEMD_Data.pool_count++];
+        pool->name = name;
+        pool->first = -1;
+        pool->live_count = 0;
+        pool->live_size = 0;
+        pool->peak_size = 0;
+    }
+    MEMD_UNLOCK();
+    return pool;
+}
+
+/** 
+ * Records a sub-allocation handed out by a user pool.
+ */
+void _memd_pool_alloc_notify(MEMD_Pool *pool, void *ptr, size_t size, MEMD_Site *site) {
+    if (pool == NULL)
+        return;
+
+    MEMD_LOCK();
+    MEMD_Mem *mem = _memd_ignore != 1 ? _insert((size_t)ptr, size, site) : NULL;
+    if (mem != NULL) {
+        // push the record to the front of the pool's list
+        int32_t index = (int32_t)(mem - MEMD_Data.mem);
+        mem->pool = pool;
+        mem->pool_prev = -1;
+        mem->pool_next = pool->first;
+        if (pool->first != -1)
+            MEMD_Data.mem[pool->first].pool_prev = index;
+        pool->first = index;
+        pool->live_count++;
+        pool->live_size += size;
+        if (pool->live_size > pool->peak_size)
+            pool->peak_size = pool->live_size;
+    }
+    MEMD_UNLOCK();
+}
+
+/** 
+ * Records that a user pool took back a sub-allocation.
+ */
+void _memd_pool_free_notify(MEMD_Pool *pool, void *ptr, MEMD_Site *site) {
+    if (pool == NULL)
+        return;
+
+    MEMD_LOCK();
+    if (_memd_ignore != 1) {
+        MEMD_Mem *mem = ptr != NULL ? _find_in_pool((size_t)ptr, pool) : NULL;
+        if (ptr == NULL) {
+            WARN("Tried to free a null ptr", site);
+        } else if (mem == NULL) {
+            WARN("Double free detected", site);
+        } else {
+            _pool_unlink(mem);
+            _release(mem);
+        }
+    }
+    MEMD_UNLOCK();
+}
+
+void memd_pool_reset(MEMD_Pool *pool) {
+    if (pool == NULL)
+        return;
+
+    MEMD_LOCK();
+    int32_t index = pool->first;
+    while (index != -1) {
+        MEMD_Mem *mem = &MEMD_Data.mem[index];
+        index = mem->pool_next;
+        mem->pool = NULL;
+        _release(mem);
+    }
+    pool->first = -1;
+    pool->live_count = 0;
+    pool->live_size = 0;
+    MEMD_UNLOCK();
+}
+
+#ifdef MEMD_HANDLES
+/** 
+ * Names of the handle kinds in reports and metrics.
+ */
+static const char *_memd_handle_names[MEMD_HANDLE_KINDS] = { "FILE", "fd", "socket", "DIR", "mutex", "custom" };
+
+/** 
+ * Open resource handles and the statistics of each kind.
+ */
+static struct {
+    MEMD_Handle handles[MEMD_MAX_HANDLES]; /**< Open handles, site NULL for free slots. */
+    uint32_t count;                        /**< Slots in use or freed, free slots after it are unused. */
+    uint32_t hint;                         /**< No free slot before it. */
+    MEMD_HandleStats stats[MEMD_HANDLE_KINDS]; /**< Statistics of each kind. */
+} _memd_handles;
+
+/** 
+ * Records a handle opened at site.
+ */
+static void _memd_handle_open(MEMD_HandleKind kind, uint64_t value, MEMD_Site *site) {
+    MEMD_LOCK();
+    if (_memd_ignore != 1) {
+        while (_memd_handles.hint < _memd_handles.count && _memd_handles.handles[_memd_handles.hint].site != NULL)
+            _memd_handles.hint++;
+        if (_memd_handles.hint == MEMD_MAX_HANDLES) {
+            WARN("Max handles reached", site);
+        } else {
+            MEMD_Handle *handle = &_memd_handles.handles[_memd_handles.hint++];
+            if (_memd_handles.hint > _memd_handles.count)
+                _memd_handles.count = _memd_handles.hint;
+            handle->value = value;
+            handle->site = site;
+            handle->kind = kind;
+            MEMD_HandleStats *stats = &_memd_handles.stats[kind];
+            stats->open_count++;
+            if (stats->open_count - stats->close_count > stats->peak_count)
+                stats->peak_count = stats->open_count - stats->close_count;
+        }
+    }
+    MEMD_UNLOCK();
+}
+
+/** 
+ * Removes the record of a handle of kind that is about to be closed.
+ * Handles MEMD didn't see being opened are ignored. The record is dropped
+ * while tracking is paused too, the value may be reused by the next open.
+ * @return 1 if the handle was tracked, 0 otherwise.
+ */
+static int _memd_handle_close(MEMD_HandleKind kind, uint64_t value) {
+    int found = 0;
+    MEMD_LOCK();
+    for (uint32_t i = 0; i < _memd_handles.count; i++) {
+        MEMD_Handle *handle = &_memd_handles.handles[i];
+        if (handle->site != NULL && handle->value == value && handle->kind == kind) {
+            handle->site = NULL;
+            _memd_handles.stats[kind].close_count++;
+            if (i < _memd_handles.hint)
+                _memd_handles.hint = i;
+            found = 1;
+            break;
+        }
+    }
+    MEMD_UNLOCK();
+    return found;
+}
+
+/** 
+ * Records a resource handle opened by user code.
+ */
+void _memd_handle_open_notify(MEMD_HandleKind kind, uint64_t value, MEMD_Site *site) {
+    if (kind < MEMD_HANDLE_KINDS)
+        _memd_handle_open(kind, value, site);
+}
+
+/** 
+ * Removes the record of a resource handle closed by user code.
+ */
+void _memd_handle_close_notify(MEMD_HandleKind kind, uint64_t value) {
+    if (kind < MEMD_HANDLE_KINDS)
+        _memd_handle_close(kind, value);
+}
+
+/** 
+ * Custom implementation of fopen for tracking purposes.
+ */
+FILE *_memd_fopen(const char *path, const char *mode, MEMD_Site *site) {
+    FILE *file = fopen(path, mode);
+    if (file != NULL)
+        _memd_handle_open(MEMD_HANDLE_FILE, (uint64_t)(uintptr_t)file, site);
+    return file;
+}
+
+/** 
+ * Custom implementation of fclose for tracking purposes. The record goes
+ * first, another thread may get the same FILE* as soon as it is closed.
+ */
+int _memd_fclose(FILE *file) {
+    _memd_handle_close(MEMD_HANDLE_FILE, (uint64_t)(uintptr_t)file);
+    return fclose(file);
+}
+
+#ifndef _WIN32
+/** 
+ * Custom implementation of open for tracking purposes. The mode is passed
+ * on when the flags create a file.
+ */
+int _memd_open(MEMD_Site *site, const char *path, int flags, ...) {
+    int fd;
+    int needs_mode = (flags & O_CREAT) != 0;
+#ifdef O_TMPFILE
+    needs_mode |= (flags & O_TMPFILE) == O_TMPFILE;
+#endif
+    if (needs_mode) {
+        va_list args;
+        va_start(args, flags);
+        mode_t mode = (mode_t)va_arg(args, int);
+        va_end(args);
+        fd = open(path, flags, mode);
+    } else {
+        fd = open(path, flags);
+    }
+    if (fd >= 0)
+        _memd_handle_open(MEMD_HANDLE_FD, (uint64_t)fd, site);
+    return fd;
+}
+
+/** 
+ * Custom implementation of close for tracking purposes, for descriptors of
+ * open and socket.
+ */
+int _memd_close(int fd) {
+    if (!_memd_handle_close(MEMD_HANDLE_FD, (uint64_t)fd))
+        _memd_handle_close(MEMD_HANDLE_SOCKET, (uint64_t)fd);
+    return close(fd);
+}
+
+/** 
+ * Custom implementation of socket for tracking purposes.
+ */
+int _memd_socket(int domain, int type, int protocol, MEMD_Site *site) {
+    int fd = socket(domain, type, protocol);
+    if (fd >= 0)
+        _memd_handle_open(MEMD_HANDLE_SOCKET, (uint64_t)fd, site);
+    return fd;
+}
+
+/** 
+ * Custom implementation of opendir for tracking purposes.
+ */
+DIR *_memd_opendir(const char *path, MEMD_Site *site) {
+    DIR *dir = opendir(path);
+    if (dir != NULL)
+        _memd_handle_open(MEMD_HANDLE_DIR, (uint64_t)(uintptr_t)dir, site);
+    return dir;
+}
+
+/** 
+ * Custom implementation of closedir for tracking purposes.
+ */
+int _memd_closedir(DIR *dir) {
+    _memd_handle_close(MEMD_HANDLE_DIR, (uint64_t)(uintptr_t)dir);
+    return closedir(dir);
+}
+
+/** 
+ * Custom implementation of pthread_mutex_init for tracking purposes.
+ */
+int _memd_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr, MEMD_Site *site) {
+    int result = pthread_mutex_init(mutex, attr);
+    if (result == 0)
+        _memd_handle_open(MEMD_HANDLE_MUTEX, (uint64_t)(uintptr_t)mutex, site);
+    return result;
+}
+
+/** 
+ * Custom implementation of pthread_mutex_destroy for tracking purposes.
+ */
+int _memd_mutex_destroy(pthread_mutex_t *mutex) {
+    int result = pthread_mutex_destroy(mutex);
+    if (result == 0)
+        _memd_handle_close(MEMD_HANDLE_MUTEX, (uint64_t)(uintptr_t)mutex);
+    return result;
+}
+#endif // _WIN32
+#endif // MEMD_HANDLES
+
+/** 
+ * Pause memd memory tracking.
+ */
+static inline void memd_pause() {
+    _memd_ignore = 1;
+}
+
+/** 
+ * Resume paused memd memory tracking.
+ */
+static inline void memd_resume() {
+    _memd_ignore = 0;
+}
+
+void memd_report_free(char* ptr) {
+    free(ptr); // Free the memory allocated for the report.
+}
+
+#ifdef MEMD_LEAK_PREVIEW
+/** 
+ * Collects the sites with the most leaked bytes into groups, largest first.
+ * @return The number of sites collected.
+ */
+static int _memd_preview_groups(MEMD_Site **groups) {
+    int count = 0;
+    for (MEMD_Site *site = MEMD_Data.sites; site != NULL; site = site->next) {
+        size_t leaked = site->allocated_size - site->free_size;
+        if (leaked == 0)
+            continue;
+
+        // insert into the sorted top list, dropping the smallest entry when full
+        int i = count < MEMD_LEAK_PREVIEW_GROUPS ? count++ : MEMD_LEAK_PREVIEW_GROUPS;
+        while (i > 0 && groups[i - 1]->allocated_size - groups[i - 1]->free_size < leaked) {
+            if (i < MEMD_LEAK_PREVIEW_GROUPS)
+                groups[i] = groups[i - 1];
+            i--;
+        }
+        if (i < MEMD_LEAK_PREVIEW_GROUPS)
+            groups[i] = site;
+    }
+    return count;
+}
+
+/** 
+ * Formats a hex/ASCII preview of the start of a leaked block into out, one row
+ * of 16 bytes per line, followed by its text if the block looks like a string.
+ */
+static void _memd_format_preview(char *out, size_t capacity, const unsigned char *data, size_t size) {
+    size_t length = size < MEMD_LEAK_PREVIEW ? size : MEMD_LEAK_PREVIEW;
+    size_t offset = 0;
+    // zero-size blocks get no rows
+    out[0] = '\0';
+
+    for (size_t row = 0; row < length; row += 16) {
+        offset += snprintf(out + offset, capacity - offset, "       ");
+        for (size_t i = row; i < row + 16; i++) {
+            if (i < length)
+                offset += snprintf(out + offset, capacity - offset, "%02x ", data[i]);
+            else
+                offset += snprintf(out + offset, capacity - offset, "   ");
+        }
+        offset += snprintf(out + offset, capacity - offset, " |");
+        for (size_t i = row; i < row + 16 && i < length; i++)
+            out[offset++] = data[i] >= 0x20 && data[i] < 0x7f ? (char)data[i] : '.';
+        offset += snprintf(out + offset, capacity - offset, "|\n");
+    }
+
+    // a run of at least 4 printable characters that ends the block or is
+    // NUL-terminated is probably a string
+    size_t text = 0;
+    while (text < size && text < MEMD_LEAK_PREVIEW_STRING && data[text] >= 0x20 && data[text] < 0x7f)
+        text++;
+    if (text >= 4 && (text == size || data[text] == '\0'))
+        snprintf(out + offset, capacity - offset, "       string \"%.*s\"\n", (int)text, (const char *)data);
+}
+#endif // MEMD_LEAK_PREVIEW
+
+/** 
+ * Matches text against a glob pattern, where * matches any run of characters
+ * and ? any single character. Backtracks only to the last *, so it runs in
+ * linear time for patterns with a single *.
+ */
+static int _memd_glob(const char *pattern, const char *text) {
+    const char *star = NULL, *resume = NULL;
+    if (text == NULL)
+        text = "";
+    while (*text != '\0') {
+        if (*pattern == '*') {
+            star = pattern++;
+            resume = text;
+        } else if (*pattern == '?' || *pattern == *text) {
+            pattern++;
+            text++;
+        } else if (star != NULL) {
+            pattern = star + 1;
+            text = ++resume;
+        } else {
+            return 0;
+        }
+    }
+    while (*pattern == '*')
+        pattern++;
+    return *pattern == '\0';
+}
+
+/** 
+ * Returns the rules whose patterns match a site as a bit mask. The patterns
+ * only depend on the site, so they are matched once per site and rule load,
+ * and a leaked block only has its size checked.
+ */
+static uint64_t _memd_suppress_mask(MEMD_Site *site) {
+    // the cache grows with the site ids, without it the rules are matched again
+    if (site->id >= MEMD_Data.suppress_cache_capacity) {
+        uint32_t capacity = MEMD_Data.site_count + 64;
+        MEMD_SuppressCache *cache = (MEMD_SuppressCache *)realloc(MEMD_Data.suppress_cache, capacity * sizeof(MEMD_SuppressCache));
+        if (cache != NULL) {
+            memset(cache + MEMD_Data.suppress_cache_capacity, 0,
+                (capacity - MEMD_Data.suppress_cache_capacity) * sizeof(MEMD_SuppressCache));
+            MEMD_Data.suppress_cache = cache;
+            MEMD_Data.suppress_cache_capacity = capacity;
+        }
+    }
+    MEMD_SuppressCache *entry = site->id < MEMD_Data.suppress_cache_capacity ? &MEMD_Data.suppress_cache[site->id] : NULL;
+    if (entry != NULL && entry->generation == MEMD_Data.suppression_generation)
+        return entry->mask;
+
+    uint64_t mask = 0;
+    for (int r = 0; r < MEMD_Data.suppression_count; r++) {
+        MEMD_Suppression *rule = &MEMD_Data.suppressions[r];
+        if ((rule->file == NULL || _memd_glob(rule->file, site->file)) &&
+            (rule->func == NULL || _memd_glob(rule->func, site->func)) &&
+            (rule->type == NULL || _memd_glob(rule->type, site->type)) &&
+            (rule->tag == NULL || _memd_glob(rule->tag, site->tag)))
+            mask |= (uint64_t)1 << r;
+    }
+    if (entry != NULL) {
+        entry->mask = mask;
+        entry->generation = MEMD_Data.suppression_generation;
+    }
+    return mask;
+}
+
+/** 
+ * Finds the first rule suppressing a leaked block of the given site and size.
+ * @return The rule, or NULL if the block is not suppressed.
+ */
+static MEMD_Suppression *_memd_suppression(MEMD_Site *site, size_t size) {
+    if (MEMD_Data.suppression_count == 0)
+        return NULL;
+    uint64_t mask = _memd_suppress_mask(site);
+    for (int r = 0; mask != 0; r++, mask >>= 1) {
+        MEMD_Suppression *rule = &MEMD_Data.suppressions[r];
+        if ((mask & 1) != 0 && size >= rule->min_size && size <= rule->max_size)
+            return rule;
+    }
+    return NULL;
+}
+
+/** 
+ * Node of the leak graph. Every leaked block is a node, and a block that holds
+ * a pointer into another leaked block has an edge to it.
+ */
+typedef struct {
+    size_t address;     /**< Address of the block, first so nodes sort by address. */
+    size_t size;        /**< Size of the block. */
+    MEMD_Site *site;    /**< Call site of the block. */
+    size_t first_edge;  /**< Offset of the node's edges in the edge array. */
+    uint32_t edge_count; /**< Number of leaked blocks the block points to. */
+    uint32_t in_degree;  /**< Number of leaked blocks pointing to the block. */
+    uint32_t root;       /**< Index of the root the block is reported under. */
+    size_t held_count;   /**< Blocks reachable from a root, including itself. */
+    size_t held_size;    /**< Bytes of those blocks. */
+} MEMD_LeakNode;
+
+/** 
+ * Leaked blocks grouped into the data structures they form.
+ */
+typedef struct {
+    MEMD_LeakNode *nodes; /**< Leaked blocks sorted by address. */
+    uint32_t count;       /**< Number of leaked blocks. */
+} MEMD_LeakGraph;
+
+/** 
+ * Finds the leaked block containing address.
+ * @return Index of the node, or -1 if address points into no leaked block.
+ */
+static int64_t _memd_leak_node_at(const MEMD_LeakGraph *graph, size_t address) {
+    uint32_t low = 0, high = graph->count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (graph->nodes[mid].address <= address)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    if (low == 0)
+        return -1;
+    const MEMD_LeakNode *node = &graph->nodes[low - 1];
+    if (address < node->address + node->size || address == node->address)
+        return low - 1;
+    return -1;
+}
+
+/** 
+ * Scans the words of a leaked block for pointers into other leaked blocks.
+ * Counts the edges of the block, or stores them in edges if it is not NULL.
+ * Only the node of the block is written, so blocks can be scanned in parallel.
+ */
+static void _memd_leak_scan(MEMD_LeakGraph *graph, uint32_t index, uint32_t *edges) {
+    MEMD_LeakNode *node = &graph->nodes[index];
+    const unsigned char *data = (const unsigned char *)node->address;
+    // other threads may write to the block between the passes, so no more
+    // edges are stored than were counted
+    uint32_t count = 0, capacity = edges != NULL ? node->edge_count : UINT32_MAX;
+    for (size_t offset = 0; offset + sizeof(size_t) <= node->size && count < capacity; offset += sizeof(size_t)) {
+        size_t value;
+        memcpy(&value, data + offset, sizeof(value));
+        int64_t target = _memd_leak_node_at(graph, value);
+        if (target < 0 || target == index)
+            continue;
+        if (edges != NULL)
+            edges[node->first_edge + count] = (uint32_t)target;
+        count++;
+    }
+    node->edge_count = count;
+}
+
+/** 
+ * Leaked blocks scanned by one thread of the report.
+ */
+typedef struct {
+    MEMD_LeakGraph *graph; /**< Graph the blocks belong to. */
+    uint32_t begin;        /**< First node of the slice. */
+    uint32_t end;          /**< Node after the slice. */
+    uint32_t *edges;       /**< Edge array, or NULL to count the edges. */
+} MEMD_LeakJob;
+
+/** 
+ * Scans a slice of leaked blocks.
+ */
+static void _memd_leak_scan_slice(MEMD_LeakJob *job) {
+    for (uint32_t i = job->begin; i < job->end; i++)
+        _memd_leak_scan(job->graph, i, job->edges);
+}
+
+#ifdef MEMD_REPORT_THREADS
+/** 
+ * Least number of bytes worth scanning on an extra thread.
+ */
+#define MEMD_REPORT_SLICE_BYTES (256 * 1024)
+
+#ifdef _WIN32
+typedef HANDLE MEMD_Thread;
+
+static DWORD WINAPI _memd_leak_thread_main(LPVOID arg) {
+    _memd_leak_scan_slice((MEMD_LeakJob *)arg);
+    return 0;
+}
+
+static int _memd_leak_thread_start(MEMD_Thread *thread, MEMD_LeakJob *job) {
+    *thread = CreateThread(NULL, 0, _memd_leak_thread_main, job, 0, NULL);
+    return *thread != NULL ? 0 : -1;
+}
+
+static void _memd_leak_thread_join(MEMD_Thread thread) {
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+}
+#else
+typedef pthread_t MEMD_Thread;
+
+static void *_memd_leak_thread_main(void *arg) {
+    _memd_leak_scan_slice((MEMD_LeakJob *)arg);
+    return NULL;
+}
+
+static int _memd_leak_thread_start(MEMD_Thread *thread, MEMD_LeakJob *job) {
+    return pthread_create(thread, NULL, _memd_leak_thread_main, job) == 0 ? 0 : -1;
+}
+
+static void _memd_leak_thread_join(MEMD_Thread thread) {
+    pthread_join(thread, NULL);
+}
+#endif
+#endif // MEMD_REPORT_THREADS
+
+/** 
+ * Scans all leaked blocks, split into slices of about the same number of
+ * bytes on up to MEMD_REPORT_THREADS threads.
+ */
+static void _memd_leak_scan_all(MEMD_LeakGraph *graph, uint32_t *edges) {
+#ifdef MEMD_REPORT_THREADS
+    MEMD_LeakJob jobs[MEMD_REPORT_THREADS];
+    MEMD_Thread threads[MEMD_REPORT_THREADS];
+
+    size_t total = 0;
+    for (uint32_t i = 0; i < graph->count; i++)
+        total += graph->nodes[i].size + 1;
+    int thread_count = (int)(total / MEMD_REPORT_SLICE_BYTES) + 1;
+    if (thread_count > MEMD_REPORT_THREADS)
+        thread_count = MEMD_REPORT_THREADS;
+    size_t share = total / (size_t)thread_count + 1;
+
+    int job_count = 0;
+    uint32_t begin = 0;
+    size_t bytes = 0;
+    for (uint32_t i = 0; i <= graph->count; i++) {
+        if (i == graph->count || (bytes >= share && job_count < thread_count - 1)) {
+            jobs[job_count].graph = graph;
+            jobs[job_count].begin = begin;
+            jobs[job_count].end = i;
+            jobs[job_count].edges = edges;
+            job_count++;
+            begin = i;
+            bytes = 0;
+        }
+        if (i < graph->count)
+            bytes += graph->nodes[i].size + 1;
+    }
+
+    // the first slice is scanned by the calling thread, and the slices of
+    // threads that could not be started after it
+    int started = 1;
+    while (started < job_count && _memd_leak_thread_start(&threads[started], &jobs[started]) == 0)
+        started++;
+    _memd_leak_scan_slice(&jobs[0]);
+    for (int i = started; i < job_count; i++)
+        _memd_leak_scan_slice(&jobs[i]);
+    for (int i = 1; i < started; i++)
+        _memd_leak_thread_join(threads[i]);
+#else
+    MEMD_LeakJob job = { graph, 0, graph->count, edges };
+    _memd_leak_scan_slice(&job);
+#endif
+}
+
+/** 
+ * Marks every unclaimed block reachable from root as part of its structure.
+ */
+static void _memd_leak_claim(MEMD_LeakGraph *graph, const uint32_t *edges, uint32_t *stack, uint32_t root) {
+    MEMD_LeakNode *nodes = graph->nodes;
+    uint32_t depth = 0;
+    nodes[root].root = root;
+    stack[depth++] = root;
+    while (depth > 0) {
+        MEMD_LeakNode *node = &nodes[stack[--depth]];
+        nodes[root].held_count++;
+        nodes[root].held_size += node->size;
+        for (uint32_t e = 0; e < node->edge_count; e++) {
+            uint32_t target = edges[node->first_edge + e];
+            if (nodes[target].root == UINT32_MAX) {
+                nodes[target].root = root;
+                stack[depth++] = target;
+            }
+        }
+    }
+}
+
+/** 
+ * Builds the leak graph from a conservative scan of the leaked malloc'd
+ * blocks of a snapshot and assigns every block to a root. Blocks no other
+ * leaked block points to are roots; blocks only reachable through cycles are
+ * claimed by the lowest address of their cycle. After sorting, the pass is
+ * linear in the number of blocks and pointers. Runs without the MEMD lock.
+ * @return 0 on success, or -1 if the graph could not be allocated.
+ */
+static int _memd_leak_graph(MEMD_LeakGraph *graph, const MEMD_Snapshot *snapshot) {
+    graph->count = 0;
+    graph->nodes = (MEMD_LeakNode *)malloc((snapshot->address_count > 0 ? snapshot->address_count : 1) * sizeof(MEMD_LeakNode));
+    if (graph->nodes == NULL)
+        return -1;
+
+    // pool blocks are left out, the chunks they were carved from may be gone
+    for (uint32_t i = 0; i < snapshot->count; i++) {
+        const MEMD_Mem *mem = &snapshot->blocks[i].mem;
+        if (mem->pool != NULL)
+            continue;
+        MEMD_LeakNode *node = &graph->nodes[graph->count++];
+        memset(node, 0, sizeof(*node));
+        node->address = mem->address;
+        node->size = mem->size;
+        node->site = mem->site;
+    }
+    qsort(graph->nodes, graph->count, sizeof(MEMD_LeakNode), _memd_compare_address);
+
+    // count the edges first, so they fit in one array indexed by first_edge
+    size_t edge_total = 0;
+    _memd_leak_scan_all(graph, NULL);
+    for (uint32_t i = 0; i < graph->count; i++) {
+        graph->nodes[i].first_edge = edge_total;
+        edge_total += graph->nodes[i].edge_count;
+        graph->nodes[i].root = UINT32_MAX;
+    }
+
+    uint32_t *edges = (uint32_t *)malloc((edge_total > 0 ? edge_total : 1) * sizeof(uint32_t));
+    uint32_t *stack = (uint32_t *)malloc((graph->count > 0 ? graph->count : 1) * sizeof(uint32_t));
+    if (edges == NULL || stack == NULL) {
+        free(edges);
+        free(stack);
+        free(graph->nodes);
+        graph->nodes = NULL;
+        return -1;
+    }
+    _memd_leak_scan_all(graph, edges);
+    for (uint32_t i = 0; i < graph->count; i++) {
+        for (uint32_t e = 0; e < graph->nodes[i].edge_count; e++)
+            graph->nodes[edges[graph->nodes[i].first_edge + e]].in_degree++;
+    }
+
+    for (uint32_t i = 0; i < graph->count; i++) {
+        if (graph->nodes[i].in_degree == 0)
+            _memd_leak_claim(graph, edges, stack, i);
+    }
+    for (uint32_t i = 0; i < graph->count; i++) {
+        if (graph->nodes[i].root == UINT32_MAX)
+            _memd_leak_claim(graph, edges, stack, i);
+    }
+
+    free(edges);
+    free(stack);
+    return 0;
+}
+
+/** 
+ * Tells whether a leaked block is listed in the report, and with how many
+ * blocks and bytes it holds. Blocks reachable from another root are not listed.
+ * @return 1 if the block is listed, 0 otherwise.
+ */
+static int _memd_leak_listed(const MEMD_LeakGraph *graph, size_t address, size_t *held_count, size_t *held_size) {
+    int64_t index = graph->nodes != NULL ? _memd_leak_node_at(graph, address) : -1;
+    *held_count = 1;
+    *held_size = 0;
+    if (index < 0 || graph->nodes[index].address != address)
+        return 1;
+    if (graph->nodes[index].root != (uint32_t)index)
+        return 0;
+    *held_count = graph->nodes[index].held_count;
+    *held_size = graph->nodes[index].held_size;
+    return 1;
+}
+
+/** 
+ * Formats a count with thousands separators, e.g. 12,000.
+ */
+static void _memd_format_count(char *out, size_t capacity, size_t count) {
+    char digits[24];
+    int length = snprintf(digits, sizeof(digits), "%lu", (unsigned long)count);
+    size_t offset = 0;
+    for (int i = 0; i < length && offset + 1 < capacity; i++) {
+        if (i > 0 && (length - i) % 3 == 0 && offset + 2 < capacity)
+            out[offset++] = ',';
+        out[offset++] = digits[i];
+    }
+    out[offset] = '\0';
+}
+
+/** 
+ * Formats a size in bytes, using KB, MB or GB with one decimal above 1 KB.
+ */
+static void _memd_format_size(char *out, size_t capacity, size_t size) {
+    static const char *units[] = { "KB", "MB", "GB" };
+    double value = (double)size;
+    int unit = -1;
+    while (value >= 1024.0 && unit < 2) {
+        value /= 1024.0;
+        unit++;
+    }
+    if (unit < 0)
+        snprintf(out, capacity, "%lu bytes", (unsigned long)size);
+    else
+        snprintf(out, capacity, "%.1f %s", value, units[unit]);
+}
+
+/** 
+ * Orders sites by their type name, and sites of the same type by id.
+ */
+static int _memd_compare_site_types(const void *a, const void *b) {
+    const MEMD_Site *x = *(MEMD_Site *const *)a;
+    const MEMD_Site *y = *(MEMD_Site *const *)b;
+    int order = strcmp(x->type, y->type);
+    if (order != 0)
+        return order;
+    return x->id < y->id ? -1 : x->id > y->id;
+}
+
+// Helper macro to append formatted output to the buffer of a report function
+#define APPEND_TO_REPORT(fmt, ...) do { \
+    int needed = snprintf(NULL, 0, fmt, ##__VA_ARGS__); \
+    if (needed < 0) break; \
+    if (offset + needed >= buffer_size) { \
+        while (offset + needed >= buffer_size) buffer_size *= 2; \
+        char* temp = (char*)realloc(report, buffer_size); \
+        if (!temp) { \
+            free(report); \
+            return NULL; /* Handle reallocation failure */ \
+        } \
+        report = temp; \
+    } \
+    int written = snprintf(report + offset, buffer_size - offset, fmt, ##__VA_ARGS__); \
+    if (written > 0) offset += (size_t)written; \
+} while (0)
+
+/** 
+ * Builds the report sections following the leaks from the site, resource,
+ * pool and arena statistics. Called with the MEMD lock held.
+ */
+static char* _memd_build_tail() {
+    size_t buffer_size = 1024 * 10; // Start with a 10KB buffer, adjust based on needs.
+    char* report = (char*)malloc(buffer_size);
+    if (!report) return NULL; // Failed to allocate memory for the report.
+
+    size_t offset = 0; // Tracks the current offset in the buffer.
+    report[0] = '\0';
+
+    int allocation_sites = 0;
+    for (MEMD_Site *site = MEMD_Data.sites; site != NULL; site = site->next) {
+        if (site->alloc_count == 0)
+            continue;
+        if (allocation_sites++ == 0)
+            APPEND_TO_REPORT("\n   Allocation Sites:\n");
+        APPEND_TO_REPORT("     %s:%d", site->file, site->line);
+        if (site->func != NULL)
+            APPEND_TO_REPORT(" (%s)", site->func);
+        if (site->tag != NULL)
+            APPEND_TO_REPORT(" [%s]", site->tag);
+        if (site->type != NULL)
+            APPEND_TO_REPORT(" <%s>", site->type);
+        APPEND_TO_REPORT(": %lu allocations, %lu frees, %lu bytes live\n",
+            site->alloc_count,
+            site->free_count,
+            site->allocated_size - site->free_size);
+    }
+
+    // leaked elements of MEMD_NEW sites, summed over all sites of the same
+    // type, which sorting by type puts next to each other
+    if (MEMD_Data.typed_sites_capacity < MEMD_Data.site_count) {
+        MEMD_Site **grown = (MEMD_Site **)realloc(MEMD_Data.typed_sites, MEMD_Data.site_count * sizeof(MEMD_Site *));
+        if (grown != NULL) {
+            MEMD_Data.typed_sites = grown;
+            MEMD_Data.typed_sites_capacity = MEMD_Data.site_count;
+        }
+    }
+    MEMD_Site **typed = MEMD_Data.typed_sites;
+    size_t typed_count = 0;
+    for (MEMD_Site *site = MEMD_Data.sites; site != NULL && typed_count < MEMD_Data.typed_sites_capacity; site = site->next) {
+        if (site->type != NULL && site->allocated_size != site->free_size)
+            typed[typed_count++] = site;
+    }
+    if (typed_count > 0) {
+        qsort(typed, typed_count, sizeof(MEMD_Site *), _memd_compare_site_types);
+        APPEND_TO_REPORT("\n   Leaked Types:\n");
+    }
+    for (size_t i = 0; i < typed_count;) {
+        const MEMD_Site *site = typed[i];
+        size_t leaked = 0;
+        for (; i < typed_count && strcmp(typed[i]->type, site->type) == 0; i++)
+            leaked += typed[i]->allocated_size - typed[i]->free_size;
+        char count[32], size[32];
+        // empty structs are a GNU C extension with a size of 0
+        _memd_format_count(count, sizeof(count), site->type_size > 0 ? leaked / site->type_size : 0);
+        _memd_format_size(size, sizeof(size), leaked);
+        APPEND_TO_REPORT("     leaked %s x %s (%s)\n", count, site->type, size);
+    }
+
+#ifdef MEMD_SITE_POOLING
+    if (MEMD_Data.pooled_site_count > 0) {
+        APPEND_TO_REPORT("\n   Pooled Sites:\n");
+        for (MEMD_Site *site = MEMD_Data.sites; site != NULL; site = site->next) {
+            if (site->pooled_slot == 0)
+                continue;
+            APPEND_TO_REPORT("     %s:%d: %u byte blocks, %lu of %lu allocations served from freelists\n",
+                site->file,
+                site->line,
+                site->last_size,
+                site->pooled_hits,
+                site->alloc_count);
+        }
+    }
+#endif
+
+#ifdef MEMD_FILL_PATTERN
+    APPEND_TO_REPORT("\n   Utilization:\n");
+    for (MEMD_Site *site = MEMD_Data.sites; site != NULL; site = site->next) {
+        if (site->measured_count == 0)
+            continue;
+        APPEND_TO_REPORT("     %s:%d: %lu blocks freed, %lu never written, %.1f%% of bytes used, %lu bytes wasted\n",
+            site->file,
+            site->line,
+            site->measured_count,
+            site->untouched_count,
+            site->measured_size > 0 ? 100.0 * (double)site->used_size / (double)site->measured_size : 100.0,
+            site->measured_size - site->used_size);
+    }
+#endif
+
+    if (MEMD_Data.resource_count > 0) {
+        APPEND_TO_REPORT("\n   Memory Resources:\n");
+        for (int i = 0; i < MEMD_Data.resource_count; i++) {
+            APPEND_TO_REPORT("     %s: %lu bytes live, %lu bytes peak\n", 
+                MEMD_Data.resources[i].name,
+                MEMD_Data.resources[i].live_size,
+                MEMD_Data.resources[i].peak_size);
+        }
+    }
+
+    if (MEMD_Data.pool_count > 0) {
+        APPEND_TO_REPORT("\n   Pools:\n");
+        for (int i = 0; i < MEMD_Data.pool_count; i++) {
+            APPEND_TO_REPORT("     %s: %lu blocks live, %lu bytes live, %lu bytes peak\n", 
+                MEMD_Data.pools[i].name,
+                MEMD_Data.pools[i].live_count,
+                MEMD_Data.pools[i].live_size,
+                MEMD_Data.pools[i].peak_size);
+        }
+    }
+
+    if (MEMD_Data.arenas != NULL) {
+        APPEND_TO_REPORT("\n   Arenas:\n");
+        for (MEMD_Arena *arena = MEMD_Data.arenas; arena != NULL; arena = arena->next) {
+            APPEND_TO_REPORT("     %s: %lu allocations, %lu resets, %lu bytes used of %lu reserved in %lu chunks, %lu bytes peak\n", 
+                arena->name,
+                arena->alloc_count,
+                arena->reset_count,
+                arena->used_size,
+                arena->reserved_size,
+                arena->chunk_count,
+                arena->peak_size);
+            for (size_t i = 0; i < arena->site_count; i++) {
+                const MEMD_ArenaSite *entry = &arena->sites[i];
+                APPEND_TO_REPORT("       %s:%d", entry->site->file, entry->site->line);
+                if (entry->site->func != NULL)
+                    APPEND_TO_REPORT(" (%s)", entry->site->func);
+                APPEND_TO_REPORT(": %lu blocks live, %lu bytes live\n", entry->live_count, entry->live_size);
+            }
+        }
+    }
+
+#ifdef MEMD_HANDLES
+    int handle_kinds = 0;
+    for (int kind = 0; kind < MEMD_HANDLE_KINDS; kind++) {
+        const MEMD_HandleStats *stats = &_memd_handles.stats[kind];
+        if (stats->open_count == 0)
+            continue;
+        if (handle_kinds++ == 0)
+            APPEND_TO_REPORT("\n   Handles:\n");
+        APPEND_TO_REPORT("     %s: %lu opened, %lu closed, %lu open, %lu peak\n",
+            _memd_handle_names[kind],
+            (unsigned long)stats->open_count,
+            (unsigned long)stats->close_count,
+            (unsigned long)(stats->open_count - stats->close_count),
+            (unsigned long)stats->peak_count);
+    }
+
+    // open handles grouped by kind, pointers in hex and descriptors in decimal
+    int open_handles = 0;
+    for (int kind = 0; kind < MEMD_HANDLE_KINDS; kind++) {
+        for (uint32_t i = 0; i < _memd_handles.count; i++) {
+            const MEMD_Handle *handle = &_memd_handles.handles[i];
+            if (handle->site == NULL || (int)handle->kind != kind)
+                continue;
+            if (open_handles++ == 0)
+                APPEND_TO_REPORT("\n   Open Handles:\n");
+            if (kind == MEMD_HANDLE_FD || kind == MEMD_HANDLE_SOCKET || kind == MEMD_HANDLE_CUSTOM)
+                APPEND_TO_REPORT("     %s %llu opened at %s:%u", _memd_handle_names[kind],
+                    (unsigned long long)handle->value, handle->site->file, handle->site->line);
+            else
+                APPEND_TO_REPORT("     %s 0x%llx opened at %s:%u", _memd_handle_names[kind],
+                    (unsigned long long)handle->value, handle->site->file, handle->site->line);
+            if (handle->site->func != NULL)
+                APPEND_TO_REPORT(" (%s)", handle->site->func);
+            APPEND_TO_REPORT("\n");
+        }
+    }
+#endif
+
+    if (MEMD_Data.warning_count > 0) {
+        APPEND_TO_REPORT("\n   Warnings:\n");
+        for (int i = 0; i < MEMD_Data.warning_count; i++) {
+            APPEND_TO_REPORT("     %s:%d: %s\n", 
+                MEMD_Data.warnings[i].file,
+                MEMD_Data.warnings[i].line,
+                MEMD_Data.warnings[i].message);
+        }
+    }
+
+    APPEND_TO_REPORT("\n----------------------------------\n\n");
+
+    return report;
+}
+
+/** 
+ * Number of buckets of the block age histogram. Each bucket is 16 times as
+ * wide as the previous one, the last one holds all older blocks.
+ */
+#define MEMD_AGE_BUCKETS 7
+
+/** 
+ * Block age histogram of a site, or of all blocks if site is NULL.
+ */
+typedef struct {
+    const MEMD_Site *site; /**< The call site. */
+    size_t count;          /**< Number of live blocks. */
+    size_t size;           /**< Total size of the live blocks. */
+    size_t buckets[MEMD_AGE_BUCKETS]; /**< Number of live blocks per age bucket. */
+} MEMD_AgeRow;
+
+/** 
+ * Returns the histogram bucket of a block age.
+ */
+static int _memd_age_bucket(size_t age) {
+    int bucket = 0;
+    while (bucket < MEMD_AGE_BUCKETS - 1 && age >= (size_t)16 << (4 * bucket))
+        bucket++;
+    return bucket;
+}
+
+/** 
+ * Adds a block to an age histogram.
+ */
+static void _memd_age_add(MEMD_AgeRow *row, const MEMD_Mem *mem, size_t age) {
+    row->site = mem->site;
+    row->count++;
+    row->size += mem->size;
+    row->buckets[_memd_age_bucket(age)]++;
+}
+
+/** 
+ * Orders age histograms by their number of blocks, most first.
+ */
+static int _memd_compare_age_rows(const void *a, const void *b) {
+    size_t count_a = ((const MEMD_AgeRow *)a)->count;
+    size_t count_b = ((const MEMD_AgeRow *)b)->count;
+    return count_a < count_b ? 1 : count_a > count_b ? -1 : 0;
+}
+
+/** 
+ * Block age histograms of a report.
+ */
+typedef struct {
+    MEMD_AgeRow total;               /**< Histogram of all live blocks. */
+    MEMD_AgeRow top[MEMD_AGE_SITES]; /**< Histograms of the sites holding most blocks. */
+    int top_count;                   /**< Number of listed sites. */
+    const MEMD_SnapshotBlock *oldest[MEMD_OLDEST_BLOCKS]; /**< Oldest live blocks, oldest first. */
+    int oldest_count;                /**< Number of listed blocks. */
+} MEMD_Ages;
+
+/** 
+ * Collects the block age histograms of a snapshot. The age of a block is the
+ * number of allocations made since it, so blocks allocated during startup
+ * stand apart from blocks that keep accumulating. Suppressed blocks are
+ * left out. Runs without the MEMD lock.
+ * @return 0 on success, or -1 if the histograms could not be allocated.
+ */
+static int _memd_collect_ages(const MEMD_Snapshot *snapshot, MEMD_Ages *ages) {
+    memset(ages, 0, sizeof(*ages));
+
+    // one histogram per site id, only the sites holding most blocks are kept
+    MEMD_AgeRow *rows = (MEMD_AgeRow *)calloc(snapshot->site_count + 1, sizeof(MEMD_AgeRow));
+    if (rows == NULL) return -1;
+    for (uint32_t i = 0; i < snapshot->count; i++) {
+        const MEMD_SnapshotBlock *block = &snapshot->blocks[i];
+        if (block->rule != NULL)
+            continue;
+        size_t age = snapshot->tick - block->mem.tick;
+        _memd_age_add(&ages->total, &block->mem, age);
+        _memd_age_add(&rows[block->mem.site->id], &block->mem, age);
+
+        // the oldest blocks are kept sorted by their tick
+        int j = ages->oldest_count < MEMD_OLDEST_BLOCKS ? ages->oldest_count++ : MEMD_OLDEST_BLOCKS;
+        for (; j > 0 && ages->oldest[j - 1]->mem.tick > block->mem.tick; j--) {
+            if (j < MEMD_OLDEST_BLOCKS)
+                ages->oldest[j] = ages->oldest[j - 1];
+        }
+        if (j < MEMD_OLDEST_BLOCKS)
+            ages->oldest[j] = block;
+    }
+    qsort(rows, snapshot->site_count + 1, sizeof(MEMD_AgeRow), _memd_compare_age_rows);
+    while (ages->top_count < MEMD_AGE_SITES && ages->top_count <= (int)snapshot->site_count &&
+           rows[ages->top_count].count > 0) {
+        ages->top[ages->top_count] = rows[ages->top_count];
+        ages->top_count++;
+    }
+    free(rows);
+    return 0;
+}
+
+/** 
+ * Builds the report from a snapshot and its leak graph. Runs without the
+ * MEMD lock.
+ */
+static char* _memd_build_report(MEMD_Snapshot *snapshot, const MEMD_LeakGraph *graph) {
+    size_t buffer_size = 1024 * 10; // Start with a 10KB buffer, adjust based on needs.
+    char* report = (char*)malloc(buffer_size);
+    if (!report) return NULL; // Failed to allocate memory for the report.
+
+    size_t offset = 0; // Tracks the current offset in the buffer.
+
+    APPEND_TO_REPORT("\n----------------------------------\n");
+    APPEND_TO_REPORT("MEMD Leak Summary:\n");
+    APPEND_TO_REPORT("----------------------------------\n\n");
+    APPEND_TO_REPORT("   Total Memory allocated %lu bytes\n", snapshot->total_allocated_size);
+    APPEND_TO_REPORT("   Total Memory freed     %lu bytes\n", snapshot->total_free_size);
+    APPEND_TO_REPORT("   Memory Leaked          %lu bytes\n", snapshot->total_allocated_size - snapshot->total_free_size);
+
+#ifdef MEMD_LEAK_PREVIEW
+    MEMD_Site *const *groups = snapshot->groups;
+    int group_count = snapshot->group_count;
+    char preview[(MEMD_LEAK_PREVIEW / 16 + 1) * 80 + MEMD_LEAK_PREVIEW_STRING + 32];
+
+    // appends the preview of a leaked block if its site is one of the groups
+    #define APPEND_PREVIEW(site, data, size) do { \
+        for (int g = 0; g < group_count; g++) { \
+            if (groups[g] == (site)) { \
+                _memd_format_preview(preview, sizeof(preview), (const unsigned char *)(data), size); \
+                APPEND_TO_REPORT("%s", preview); \
+                break; \
+            } \
+        } \
+    } while (0)
+#else
+    #define APPEND_PREVIEW(site, data, size) ((void)0)
+#endif
+
+    // leaked structures are listed once, at their root block
+    size_t held_count, held_size;
+    char held_blocks[32], held_bytes[32];
+    #define APPEND_HELD() do { \
+        if (held_count > 1) { \
+            _memd_format_count(held_blocks, sizeof(held_blocks), held_count); \
+            _memd_format_size(held_bytes, sizeof(held_bytes), held_size); \
+            APPEND_TO_REPORT(", holding %s blocks (%s)", held_blocks, held_bytes); \
+        } \
+    } while (0)
+
+    // suppressed leaks are counted per rule in the snapshot instead of being
+    // listed, rules are only ever appended, so the loaded ones stay as they are
+    int rule;
+    int suppressed = 0;
+    #define SUPPRESSED(block, size) ((block)->rule != NULL && \
+        (rule = (int)((block)->rule - MEMD_Data.suppressions), \
+         snapshot->hit_count[rule] += held_count, \
+         snapshot->hit_size[rule] += held_count > 1 ? held_size : (size), ++suppressed))
+
+    // arena blocks are only counted, so the header waits for a listed block
+    int listed = 0;
+    if (snapshot->total_free_size != snapshot->total_allocated_size) {
+        for (uint32_t i = 0; i < snapshot->count; i++) {
+            const MEMD_SnapshotBlock *block = &snapshot->blocks[i];
+            const MEMD_Mem *mem = &block->mem;
+            held_count = 1;
+            held_size = 0;
+            if (mem->pool == NULL && !_memd_leak_listed(graph, mem->address, &held_count, &held_size))
+                continue;
+            if (SUPPRESSED(block, mem->size))
+                continue;
+            if (listed++ == 0)
+                APPEND_TO_REPORT("\n   Detailed Report:\n");
+            APPEND_TO_REPORT("     Memory leak at %s:%d: (%lu bytes)", 
+                mem->site->file,
+                mem->site->line,
+                mem->size);
+            if (mem->alignment != 0)
+                APPEND_TO_REPORT(" (aligned %u)", mem->alignment);
+            if (mem->site->tag != NULL)
+                APPEND_TO_REPORT(" [%s]", mem->site->tag);
+            if (mem->pool != NULL)
+                APPEND_TO_REPORT(" [%s]", block->pool_name);
+            else
+                APPEND_HELD();
+            APPEND_TO_REPORT("\n");
+            // the chunk a pool block was carved from may be gone already
+            if (mem->pool == NULL)
+                APPEND_PREVIEW(mem->site, mem->address, mem->size);
+        }
+    }
+
+    if (suppressed > 0) {
+        APPEND_TO_REPORT("\n   Suppressed Leaks:\n");
+        for (int r = 0; r < snapshot->suppression_count; r++) {
+            if (snapshot->hit_count[r] > 0)
+                APPEND_TO_REPORT("     %s:%u: %lu blocks (%lu bytes)\n", MEMD_Data.suppressions[r].source,
+                    MEMD_Data.suppressions[r].line, snapshot->hit_count[r], snapshot->hit_size[r]);
+        }
+    }
+
+    #undef APPEND_PREVIEW
+    #undef APPEND_HELD
+    #undef SUPPRESSED
+
+    MEMD_Ages ages;
+    if (_memd_collect_ages(snapshot, &ages) == 0 && ages.total.count > 0) {
+        static const char *labels[MEMD_AGE_BUCKETS] = { "<16", "<256", "<4K", "<64K", "<1M", "<16M", "older" };
+        char count[32], size[32];
+        APPEND_TO_REPORT("\n   Block Ages (allocations since):\n     ");
+        for (int b = 0; b < MEMD_AGE_BUCKETS; b++)
+            APPEND_TO_REPORT("%8s", labels[b]);
+        APPEND_TO_REPORT("\n");
+        for (int r = -1; r < ages.top_count; r++) {
+            const MEMD_AgeRow *row = r < 0 ? &ages.total : &ages.top[r];
+            APPEND_TO_REPORT("     ");
+            for (int b = 0; b < MEMD_AGE_BUCKETS; b++)
+                APPEND_TO_REPORT("%8lu", (unsigned long)row->buckets[b]);
+            _memd_format_count(count, sizeof(count), row->count);
+            _memd_format_size(size, sizeof(size), row->size);
+            if (r < 0) {
+                APPEND_TO_REPORT("   all blocks: %s (%s)\n", count, size);
+                continue;
+            }
+            APPEND_TO_REPORT("   %s:%d", row->site->file, row->site->line);
+            if (row->site->func != NULL)
+                APPEND_TO_REPORT(" (%s)", row->site->func);
+            APPEND_TO_REPORT(": %s (%s)\n", count, size);
+        }
+
+        APPEND_TO_REPORT("\n   Oldest Live Blocks:\n");
+        for (int i = 0; i < ages.oldest_count; i++) {
+            const MEMD_Mem *mem = &ages.oldest[i]->mem;
+            _memd_format_count(count, sizeof(count), snapshot->tick - mem->tick);
+            APPEND_TO_REPORT("     %s:%d: (%lu bytes) allocation #%lu, %s allocations ago\n",
+                mem->site->file,
+                mem->site->line,
+                (unsigned long)mem->size,
+                (unsigned long)mem->tick,
+                count);
+        }
+    }
+    APPEND_TO_REPORT("%s", snapshot->tail);
+
+    return report; // Return the dynamically allocated report buffer.
+}
+
+#undef APPEND_TO_REPORT
+
+/** 
+ * Adds a block to the snapshot.
+ */
+static void _memd_snapshot_add(MEMD_Snapshot *snapshot, const MEMD_Mem *mem) {
+    MEMD_SnapshotBlock *block = &snapshot->blocks[snapshot->count++];
+    block->mem = *mem;
+    block->rule = _memd_suppression(mem->site, mem->size);
+    block->pool_name = mem->pool != NULL ? mem->pool->name : NULL;
+    if (mem->pool == NULL)
+        snapshot->addresses[snapshot->address_count++] = mem->address;
+}
+
+/** 
+ * Copies the records of all tracked blocks and formats the statistics
+ * sections of the report. From then on, frees of the copied blocks are
+ * deferred. Called with the MEMD lock held.
+ * @return 0 on success, or -1 if the snapshot could not be allocated.
+ */
+static int _memd_snapshot_take(MEMD_Snapshot *snapshot) {
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < MEMD_MAX_ALLOCATIONS; i++)
+        count += MEMD_Data.mem[i].address != 0;
+#ifdef MEMD_SLAB_BACKEND
+    for (uint32_t i = 0; i < _memd_slab.carved; i++)
+        count += _memd_slab.slabs[i].used_count;
+#endif
+
+    memset(snapshot, 0, sizeof(*snapshot));
+    size_t capacity = count > 0 ? count : 1;
+    snapshot->blocks = (MEMD_SnapshotBlock *)malloc(capacity * sizeof(MEMD_SnapshotBlock));
+    snapshot->addresses = (size_t *)malloc(capacity * sizeof(size_t));
+    snapshot->deferred = (MEMD_Deferred *)malloc(capacity * sizeof(MEMD_Deferred));
+    snapshot->tail = _memd_build_tail();
+    if (snapshot->blocks == NULL || snapshot->addresses == NULL || snapshot->deferred == NULL || snapshot->tail == NULL) {
+        free(snapshot->blocks);
+        free(snapshot->addresses);
+        free(snapshot->deferred);
+        free(snapshot->tail);
+        memset(snapshot, 0, sizeof(*snapshot));
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < MEMD_MAX_ALLOCATIONS; i++) {
+        if (MEMD_Data.mem[i].address != 0)
+            _memd_snapshot_add(snapshot, &MEMD_Data.mem[i]);
+    }
+#ifdef MEMD_SLAB_BACKEND
+    for (uint32_t i = 0; i < _memd_slab.carved; i++) {
+        MEMD_Slab *slab = &_memd_slab.slabs[i];
+        for (uint32_t index = 0; index < slab->block_count && slab->used_count > 0; index++) {
+            if ((slab->bitmap[index / 64] & ((uint64_t)1 << (index % 64))) == 0)
+                continue;
+            MEMD_Mem mem;
+            memset(&mem, 0, sizeof(mem));
+            mem.address = (size_t)(_memd_slab.region + ((size_t)i << MEMD_SLAB_SHIFT) + (size_t)index * slab->block_size);
+            mem.size = slab->records[index].size;
+            mem.site = slab->records[index].site;
+            mem.tick = slab->records[index].tick;
+            mem.pool_prev = mem.pool_next = mem.freelist = -1;
+            _memd_snapshot_add(snapshot, &mem);
+        }
+    }
+#endif
+    qsort(snapshot->addresses, snapshot->address_count, sizeof(size_t), _memd_compare_address);
+
+    snapshot->total_allocated_size = MEMD_Data.total_allocated_size;
+    snapshot->total_free_size = MEMD_Data.total_free_size;
+    snapshot->suppression_count = MEMD_Data.suppression_count;
+    memset(snapshot->hit_count, 0, sizeof(snapshot->hit_count));
+    memset(snapshot->hit_size, 0, sizeof(snapshot->hit_size));
+    snapshot->site_count = MEMD_Data.site_count;
+    snapshot->tick = MEMD_Data.alloc_count;
+#ifdef MEMD_LEAK_PREVIEW
+    snapshot->group_count = _memd_preview_groups(snapshot->groups);
+#endif
+    snapshot->active = 1;
+    return 0;
+}
+
+/** 
+ * Releases the blocks freed while the snapshot was scanned and the snapshot
+ * itself. Called with the MEMD lock held.
+ */
+static void _memd_snapshot_release(MEMD_Snapshot *snapshot) {
+    snapshot->active = 0;
+    for (uint32_t i = 0; i < snapshot->deferred_count; i++) {
+#ifdef MEMD_SLAB_BACKEND
+        if (snapshot->deferred[i].freelist == MEMD_DEFER_SLAB) {
+            _memd_slab_release(snapshot->deferred[i].ptr);
+            continue;
+        }
+#endif
+        _memd_free_memory(snapshot->deferred[i].ptr, snapshot->deferred[i].freelist);
+    }
+    free(snapshot->blocks);
+    free(snapshot->addresses);
+    free(snapshot->deferred);
+    free(snapshot->tail);
+    memset(snapshot, 0, sizeof(*snapshot));
+}
+
+char* memd_report() {
+    MEMD_LeakGraph graph;
+    char* report = NULL;
+
+    // the lock is only held to copy the records, other threads keep
+    // allocating and freeing while the blocks are scanned
+    MEMD_REPORT_LOCK();
+    MEMD_LOCK();
+#ifdef MEMD_SITE_POOLING
+    _memd_freelists_drain();
+#endif
+    int taken = _memd_snapshot_take(&_memd_snapshot);
+    MEMD_UNLOCK();
+    if (taken == 0) {
+        // without the graph every leaked block is listed on its own
+        _memd_leak_graph(&graph, &_memd_snapshot);
+        report = _memd_build_report(&_memd_snapshot, &graph);
+        free(graph.nodes);
+        MEMD_LOCK();
+        // the hit counts of the rules are published once the report is done
+        for (int r = 0; report != NULL && r < _memd_snapshot.suppression_count; r++) {
+            MEMD_Data.suppressions[r].hit_count = _memd_snapshot.hit_count[r];
+            MEMD_Data.suppressions[r].hit_size = _memd_snapshot.hit_size[r];
+        }
+        _memd_snapshot_release(&_memd_snapshot);
+        MEMD_UNLOCK();
+    }
+    MEMD_REPORT_UNLOCK();
+    return report;
+}
+
+/** 
+ * Writes a string field of a saved report, or "-" if it is missing.
+ */
+static void _memd_save_field(FILE *file, const char *text) {
+    fputs(text != NULL && text[0] != '\0' ? text : "-", file);
+    fputc('\t', file);
+}
+
+/** 
+ * Statistics of a site, copied for memd_report_save.
+ */
+typedef struct {
+    const MEMD_Site *site; /**< The site, for its names and line. */
+    size_t alloc_count;    /**< Allocations. */
+    size_t free_count;     /**< Frees. */
+    size_t allocated_size; /**< Bytes allocated. */
+    size_t free_size;      /**< Bytes freed. */
+} MEMD_SaveEntry;
+
+int memd_report_save(const char *path) {
+    // the counts are copied under the lock, the file is written without it
+    MEMD_LOCK();
+    size_t count = 0;
+    MEMD_SaveEntry *entries = (MEMD_SaveEntry *)malloc((MEMD_Data.site_count > 0 ? MEMD_Data.site_count : 1) * sizeof(MEMD_SaveEntry));
+    for (MEMD_Site *site = MEMD_Data.sites; entries != NULL && site != NULL; site = site->next) {
+        if (site->alloc_count == 0)
+            continue;
+        entries[count].site = site;
+        entries[count].alloc_count = site->alloc_count;
+        entries[count].free_count = site->free_count;
+        entries[count].allocated_size = site->allocated_size;
+        entries[count].free_size = site->free_size;
+        count++;
+    }
+    MEMD_UNLOCK();
+    if (entries == NULL)
+        return -1;
+
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        free(entries);
+        return -1;
+    }
+    fprintf(file, "# MEMD report 1\n");
+    fprintf(file, "# file\tline\tfunc\ttype\ttag\tallocations\tfrees\tallocated\tfreed\n");
+    for (size_t i = 0; i < count; i++) {
+        const MEMD_Site *site = entries[i].site;
+        _memd_save_field(file, site->file);
+        fprintf(file, "%u\t", site->line);
+        _memd_save_field(file, site->func);
+        _memd_save_field(file, site->type);
+        _memd_save_field(file, site->tag);
+        fprintf(file, "%lu\t%lu\t%lu\t%lu\n",
+            (unsigned long)entries[i].alloc_count,
+            (unsigned long)entries[i].free_count,
+            (unsigned long)entries[i].allocated_size,
+            (unsigned long)entries[i].free_size);
+    }
+    free(entries);
+
+    int failed = ferror(file);
+    if (fclose(file) != 0)
+        failed = 1;
+    return failed ? -1 : 0;
+}
+
+/** 
+ * Returns the value of a site for a query sort key.
+ */
+static size_t _memd_query_key(const MEMD_Site *site, MEMD_SortKey sort) {
+    switch (sort) {
+    case MEMD_SORT_BLOCKS: return site->alloc_count - site->free_count;
+    case MEMD_SORT_ALLOCATIONS: return site->alloc_count;
+    case MEMD_SORT_ALLOCATED: return site->allocated_size;
+    default: return site->allocated_size - site->free_size;
+    }
+}
+
+/** 
+ * Checks whether site a ranks before site b, breaking ties by site id so
+ * queries are stable.
+ */
+static int _memd_query_before(const MEMD_Site *a, const MEMD_Site *b, MEMD_SortKey sort) {
+    size_t key_a = _memd_query_key(a, sort), key_b = _memd_query_key(b, sort);
+    return key_a != key_b ? key_a > key_b : a->id < b->id;
+}
+
+/** 
+ * Restores the heap property below index of a heap whose root ranks last.
+ */
+static void _memd_query_sift_down(MEMD_Site **heap, size_t count, size_t index, MEMD_SortKey sort) {
+    for (;;) {
+        size_t last = index, child = 2 * index + 1;
+        if (child < count && _memd_query_before(heap[last], heap[child], sort))
+            last = child;
+        if (child + 1 < count && _memd_query_before(heap[last], heap[child + 1], sort))
+            last = child + 1;
+        if (last == index)
+            return;
+        MEMD_Site *swap = heap[index];
+        heap[index] = heap[last];
+        heap[last] = swap;
+        index = last;
+    }
+}
+
+/** 
+ * Formats a query result line of a site into out, or measures it if out is NULL.
+ * @return The length of the line.
+ */
+static int _memd_query_line(char *out, size_t capacity, const MEMD_Site *site) {
+    char blocks[32], bytes[32], allocations[32];
+    _memd_format_count(blocks, sizeof(blocks), site->alloc_count - site->free_count);
+    _memd_format_size(bytes, sizeof(bytes), site->allocated_size - site->free_size);
+    _memd_format_count(allocations, sizeof(allocations), site->alloc_count);
+    return snprintf(out, capacity, "     %s:%u%s%s%s%s%s%s%s%s%s: %s blocks live (%s), %s allocations\n",
+        site->file, site->line,
+        site->func != NULL ? " (" : "", site->func != NULL ? site->func : "", site->func != NULL ? ")" : "",
+        site->tag != NULL ? " [" : "", site->tag != NULL ? site->tag : "", site->tag != NULL ? "]" : "",
+        site->type != NULL ? " <" : "", site->type != NULL ? site->type : "", site->type != NULL ? ">" : "",
+        blocks, bytes, allocations);
+}
+
+/** 
+ * Finds the sites matching a query, ranked first to last, into heap, which
+ * holds capacity sites. Called with the MEMD lock held.
+ * @return The number of sites found.
+ */
+static size_t _memd_query_top(const MEMD_Query *query, MEMD_SortKey sort, MEMD_Site **heap, size_t capacity) {
+    // keep the top sites in a heap whose root ranks last, replacing it
+    // whenever a site ranks before it
+    size_t count = 0;
+    for (MEMD_Site *site = MEMD_Data.sites; site != NULL; site = site->next) {
+        if (site->alloc_count == 0 || site->allocated_size - site->free_size < query->min_size)
+            continue;
+        if ((query->file != NULL && !_memd_glob(query->file, site->file)) ||
+            (query->tag != NULL && !_memd_glob(query->tag, site->tag)))
+            continue;
+        if (count < capacity) {
+            size_t index = count++;
+            while (index > 0 && _memd_query_before(heap[(index - 1) / 2], site, sort)) {
+                heap[index] = heap[(index - 1) / 2];
+                index = (index - 1) / 2;
+            }
+            heap[index] = site;
+        } else if (capacity > 0 && _memd_query_before(site, heap[0], sort)) {
+            heap[0] = site;
+            _memd_query_sift_down(heap, count, 0, sort);
+        }
+    }
+
+    // moving the last ranked site to the end leaves the heap sorted first to last
+    for (size_t end = count; end > 1; end--) {
+        MEMD_Site *swap = heap[0];
+        heap[0] = heap[end - 1];
+        heap[end - 1] = swap;
+        _memd_query_sift_down(heap, end - 1, 0, sort);
+    }
+    return count;
+}
+
+char* memd_query(const MEMD_Query *query) {
+    static const char *keys[] = { "live bytes", "live blocks", "allocations", "bytes allocated" };
+    MEMD_SortKey sort = query->sort <= MEMD_SORT_ALLOCATED ? query->sort : MEMD_SORT_BYTES;
+    char *result = NULL;
+
+    MEMD_LOCK();
+    size_t capacity = MEMD_Data.site_count;
+    if (query->limit > 0 && query->limit < capacity)
+        capacity = query->limit;
+    MEMD_Site **heap = (MEMD_Site **)malloc((capacity > 0 ? capacity : 1) * sizeof(MEMD_Site *));
+    if (heap == NULL) {
+        MEMD_UNLOCK();
+        return NULL;
+    }
+    size_t count = _memd_query_top(query, sort, heap, capacity);
+
+    int header = snprintf(NULL, 0, "   Sites by %s:\n", keys[sort]);
+    size_t length = (size_t)header + 1;
+    for (size_t i = 0; i < count; i++)
+        length += (size_t)_memd_query_line(NULL, 0, heap[i]);
+    result = (char *)malloc(length);
+    if (result != NULL) {
+        size_t offset = (size_t)snprintf(result, length, "   Sites by %s:\n", keys[sort]);
+        for (size_t i = 0; i < count; i++)
+            offset += (size_t)_memd_query_line(result + offset, length - offset, heap[i]);
+    }
+    MEMD_UNLOCK();
+    free(heap);
+    return result;
+}
+
+/** 
+ * Live memory of a site or tag, copied for memd_metrics_write.
+ */
+typedef struct {
+    const MEMD_Site *site; /**< The site, or a site of the tag. */
+    size_t live_count;     /**< Live blocks. */
+    size_t live_size;      /**< Live bytes. */
+} MEMD_MetricsEntry;
+
+/** 
+ * Writes a label value with backslashes, quotes and newlines escaped.
+ */
+static void _memd_metrics_label(FILE *file, const char *name, const char *value) {
+    fprintf(file, "%s=\"", name);
+    for (const char *c = value; *c != '\0'; c++) {
+        if (*c == '\\' || *c == '"')
+            fputc('\\', file);
+        if (*c == '\n')
+            fputs("\\n", file);
+        else
+            fputc(*c, file);
+    }
+    fputc('"', file);
+}
+
+/** 
+ * Writes the labels of a site.
+ */
+static void _memd_metrics_site(FILE *file, const MEMD_Site *site) {
+    fputc('{', file);
+    _memd_metrics_label(file, "file", site->file);
+    fprintf(file, ",line=\"%u\"", site->line);
+    if (site->func != NULL) {
+        fputc(',', file);
+        _memd_metrics_label(file, "func", site->func);
+    }
+    fputc('}', file);
+}
+
+/** 
+ * Number of temp file names memd_metrics_write has tried.
+ */
+static unsigned long _memd_metrics_temp_count = 0;
+
+/** 
+ * Creates a temp file next to path that no other write uses. The name is
+ * numbered and the file is opened exclusively, so a periodic export, a manual
+ * call and other processes never write into the same file.
+ * @return The opened file with its name in temp, or NULL on failure.
+ */
+static FILE *_memd_metrics_temp(const char *path, char *temp, size_t length) {
+    for (int attempt = 0; attempt < MEMD_METRICS_TEMP_ATTEMPTS; attempt++) {
+        MEMD_LOCK();
+        unsigned long number = ++_memd_metrics_temp_count;
+        MEMD_UNLOCK();
+        snprintf(temp, length, "%s.%lu.tmp", path, number);
+        FILE *file = fopen(temp, "wx");
+        if (file != NULL)
+            return file;
+    }
+    return NULL;
+}
+
+int memd_metrics_write(const char *path) {
+    size_t length = strlen(path) + 32;
+    char *temp = (char *)malloc(length);
+    if (temp == NULL)
+        return -1;
+
+    MEMD_Site *top[MEMD_METRICS_SITES];
+    MEMD_MetricsEntry sites[MEMD_METRICS_SITES], tags[MEMD_METRICS_TAGS];
+    MEMD_Query query;
+    memset(&query, 0, sizeof(query));
+    query.sort = MEMD_SORT_BYTES;
+    query.min_size = 1;
+    int tag_count = 0;
+#ifdef MEMD_HANDLES
+    size_t open_handles[MEMD_HANDLE_KINDS];
+#endif
+
+    MEMD_LOCK();
+    size_t allocated = MEMD_Data.total_allocated_size;
+    size_t freed = MEMD_Data.total_free_size;
+    size_t peak_size = MEMD_Data.peak_size;
+    size_t alloc_count = MEMD_Data.alloc_count;
+    size_t free_count = MEMD_Data.free_count;
+    size_t warning_total = MEMD_Data.warning_total;
+    size_t site_count = _memd_query_top(&query, MEMD_SORT_BYTES, top, MEMD_METRICS_SITES);
+    for (size_t i = 0; i < site_count; i++) {
+        sites[i].site = top[i];
+        sites[i].live_count = top[i]->alloc_count - top[i]->free_count;
+        sites[i].live_size = top[i]->allocated_size - top[i]->free_size;
+    }
+    for (MEMD_Site *site = MEMD_Data.sites; site != NULL; site = site->next) {
+        if (site->tag == NULL)
+            continue;
+        int t = 0;
+        while (t < tag_count && strcmp(tags[t].site->tag, site->tag) != 0)
+            t++;
+        if (t == tag_count) {
+            if (tag_count == MEMD_METRICS_TAGS)
+                continue;
+            tags[tag_count].site = site;
+            tags[tag_count].live_count = 0;
+            tags[tag_count].live_size = 0;
+            tag_count++;
+        }
+        tags[t].live_count += site->alloc_count - site->free_count;
+        tags[t].live_size += site->allocated_size - site->free_size;
+    }
+#ifdef MEMD_HANDLES
+    for (int kind = 0; kind < MEMD_HANDLE_KINDS; kind++)
+        open_handles[kind] = _memd_handles.stats[kind].open_count - _memd_handles.stats[kind].close_count;
+#endif
+    MEMD_UNLOCK();
+
+    FILE *file = _memd_metrics_temp(path, temp, length);
+    if (file == NULL) {
+        free(temp);
+        return -1;
+    }
+    fprintf(file, "# TYPE memd_live_bytes gauge\n# HELP memd_live_bytes Bytes of the live tracked blocks.\n");
+    fprintf(file, "memd_live_bytes %lu\n", (unsigned long)(allocated - freed));
+    fprintf(file, "# TYPE memd_live_blocks gauge\n# HELP memd_live_blocks Number of live tracked blocks.\n");
+    fprintf(file, "memd_live_blocks %lu\n", (unsigned long)(alloc_count - free_count));
+    fprintf(file, "# TYPE memd_peak_bytes gauge\n# HELP memd_peak_bytes Most live bytes since start or the last peak reset.\n");
+    fprintf(file, "memd_peak_bytes %lu\n", (unsigned long)peak_size);
+    fprintf(file, "# TYPE memd_allocations counter\n# HELP memd_allocations Tracked allocations.\n");
+    fprintf(file, "memd_allocations_total %lu\n", (unsigned long)alloc_count);
+    fprintf(file, "# TYPE memd_frees counter\n# HELP memd_frees Frees of tracked blocks.\n");
+    fprintf(file, "memd_frees_total %lu\n", (unsigned long)free_count);
+    fprintf(file, "# TYPE memd_allocated_bytes counter\n# HELP memd_allocated_bytes Bytes of the tracked allocations.\n");
+    fprintf(file, "memd_allocated_bytes_total %lu\n", (unsigned long)allocated);
+    fprintf(file, "# TYPE memd_freed_bytes counter\n# HELP memd_freed_bytes Bytes of the freed tracked blocks.\n");
+    fprintf(file, "memd_freed_bytes_total %lu\n", (unsigned long)freed);
+    fprintf(file, "# TYPE memd_warnings counter\n# HELP memd_warnings Warnings like double frees.\n");
+    fprintf(file, "memd_warnings_total %lu\n", (unsigned long)warning_total);
+
+    if (tag_count > 0) {
+        fprintf(file, "# TYPE memd_tag_live_bytes gauge\n# HELP memd_tag_live_bytes Live bytes of the sites of a tag.\n");
+        for (int t = 0; t < tag_count; t++) {
+            fprintf(file, "memd_tag_live_bytes{");
+            _memd_metrics_label(file, "tag", tags[t].site->tag);
+            fprintf(file, "} %lu\n", (unsigned long)tags[t].live_size);
+        }
+        fprintf(file, "# TYPE memd_tag_live_blocks gauge\n# HELP memd_tag_live_blocks Live blocks of the sites of a tag.\n");
+        for (int t = 0; t < tag_count; t++) {
+            fprintf(file, "memd_tag_live_blocks{");
+            _memd_metrics_label(file, "tag", tags[t].site->tag);
+            fprintf(file, "} %lu\n", (unsigned long)tags[t].live_count);
+        }
+    }
+#ifdef MEMD_HANDLES
+    fprintf(file, "# TYPE memd_open_handles gauge\n# HELP memd_open_handles Open resource handles of a kind.\n");
+    for (int kind = 0; kind < MEMD_HANDLE_KINDS; kind++)
+        fprintf(file, "memd_open_handles{kind=\"%s\"} %lu\n", _memd_handle_names[kind], (unsigned long)open_handles[kind]);
+#endif
+    if (site_count > 0) {
+        fprintf(file, "# TYPE memd_site_live_bytes gauge\n# HELP memd_site_live_bytes Live bytes of the sites holding the most.\n");
+        for (size_t i = 0; i < site_count; i++) {
+            fprintf(file, "memd_site_live_bytes");
+            _memd_metrics_site(file, sites[i].site);
+            fprintf(file, " %lu\n", (unsigned long)sites[i].live_size);
+        }
+        fprintf(file, "# TYPE memd_site_live_blocks gauge\n# HELP memd_site_live_blocks Live blocks of the sites holding the most bytes.\n");
+        for (size_t i = 0; i < site_count; i++) {
+            fprintf(file, "memd_site_live_blocks");
+            _memd_metrics_site(file, sites[i].site);
+            fprintf(file, " %lu\n", (unsigned long)sites[i].live_count);
+        }
+    }
+    fprintf(file, "# EOF\n");
+
+    int failed = ferror(file);
+    if (fclose(file) != 0)
+        failed = 1;
+#ifdef _WIN32
+    // rename doesn't replace an existing file on Windows
+    if (!failed)
+        remove(path);
+#endif
+    if (failed || rename(temp, path) != 0) {
+        remove(temp);
+        failed = 1;
+    }
+    free(temp);
+    return failed ? -1 : 0;
+}
+
+/** 
+ * Parses a size=MIN-MAX term of a suppression rule.
+ * @return 0 on success, -1 if the range is malformed.
+ */
+static int _memd_parse_size_range(const char *text, size_t *min_size, size_t *max_size) {
+    char *end;
+    *min_size = 0;
+    *max_size = (size_t)-1;
+    if (*text != '-') {
+        *min_size = (size_t)strtoull(text, &end, 10);
+        if (end == text)
+            return -1;
+        if (*end == '\0') {
+            *max_size = *min_size;
+            return 0;
+        }
+        text = end;
+    }
+    if (*text++ != '-')
+        return -1;
+    if (*text != '\0') {
+        *max_size = (size_t)strtoull(text, &end, 10);
+        if (end == text || *end != '\0')
+            return -1;
+    }
+    return *min_size <= *max_size ? 0 : -1;
+}
+
+int memd_suppressions_load(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return -1;
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    size_t path_length = strlen(path);
+
+    // the rules point into this buffer, which is kept for the whole run
+    char *text = length >= 0 ? (char *)malloc((size_t)length + path_length + 2) : NULL;
+    if (text == NULL || fread(text, 1, (size_t)length, file) != (size_t)length) {
+        free(text);
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+    text[length] = '\0';
+    char *source = text + length + 1;
+    memcpy(source, path, path_length + 1);
+
+    MEMD_LOCK();
+    int loaded = 0;
+    uint32_t line = 0;
+    for (char *next = text; *next != '\0'; ) {
+        char *cursor = next;
+        char *end = strchr(cursor, '\n');
+        next = end != NULL ? end + 1 : cursor + strlen(cursor);
+        if (end != NULL)
+            *end = '\0';
+        line++;
+
+        MEMD_Suppression rule;
+        memset(&rule, 0, sizeof(rule));
+        rule.max_size = (size_t)-1;
+        rule.source = source;
+        rule.line = line;
+        int terms = 0, valid = 1;
+        while (valid) {
+            while (*cursor == ' ' || *cursor == '\t' || *cursor == '\r')
+                *cursor++ = '\0';
+            if (*cursor == '\0' || *cursor == '#')
+                break;
+            char *term = cursor;
+            while (*cursor != '\0' && *cursor != ' ' && *cursor != '\t' && *cursor != '\r')
+                cursor++;
+            if (*cursor != '\0')
+                *cursor++ = '\0';
+
+            char *value = strchr(term, '=');
+            if (value == NULL) {
+                valid = 0;
+                break;
+            }
+            *value++ = '\0';
+            if (strcmp(term, "file") == 0)
+                rule.file = value;
+            else if (strcmp(term, "func") == 0)
+                rule.func = value;
+            else if (strcmp(term, "type") == 0)
+                rule.type = value;
+            else if (strcmp(term, "tag") == 0)
+                rule.tag = value;
+            else if (strcmp(term, "size") != 0 || _memd_parse_size_range(value, &rule.min_size, &rule.max_size) != 0)
+                valid = 0;
+            terms++;
+        }
+        if (terms == 0 && valid)
+            continue;
+
+        MEMD_Site where;
+        where.file = source;
+        where.line = line;
+        if (!valid) {
+            WARN("Invalid suppression rule", &where);
+        } else if (MEMD_Data.suppression_count == MEMD_MAX_SUPPRESSIONS) {
+            WARN("Max suppressions reached", &where);
+        } else {
+            MEMD_Data.suppressions[MEMD_Data.suppression_count++] = rule;
+            loaded++;
+        }
+    }
+    MEMD_Data.suppression_generation++;
+    MEMD_UNLOCK();
+    return loaded;
+}
+
+void memd_heap_root(const void *start, size_t size) {
+    MEMD_LOCK();
+    if (MEMD_Data.root_count < MEMD_MAX_ROOTS) {
+        MEMD_Data.roots[MEMD_Data.root_count].start = start;
+        MEMD_Data.roots[MEMD_Data.root_count].size = size;
+        MEMD_Data.root_count++;
+    }
+    MEMD_UNLOCK();
+}
+
+/** 
+ * Buffered writer of heap dump chunks. Records are collected in a large
+ * buffer, so the file is written sequentially in few big writes.
+ */
+typedef struct {
+    FILE *file;           /**< The dump file. */
+    char *buffer;         /**< MEMD_HEAP_DUMP_BUFFER bytes of pending output. */
+    size_t used;          /**< Bytes of pending output. */
+    size_t chunk;         /**< Offset of the open chunk's header in buffer. */
+    MEMD_DumpChunk header; /**< Header of the open chunk. */
+    int open;             /**< Whether a chunk is open. */
+    int failed;           /**< Whether a write failed. */
+} MEMD_DumpWriter;
+
+/** 
+ * Closes the open chunk, if any, by filling in its header.
+ */
+static void _memd_dump_close(MEMD_DumpWriter *writer) {
+    if (writer->open)
+        memcpy(writer->buffer + writer->chunk, &writer->header, sizeof(MEMD_DumpChunk));
+    writer->open = 0;
+}
+
+/** 
+ * Closes the open chunk and writes out the pending output.
+ */
+static void _memd_dump_flush(MEMD_DumpWriter *writer) {
+    _memd_dump_close(writer);
+    if (writer->used > 0 && fwrite(writer->buffer, 1, writer->used, writer->file) != writer->used)
+        writer->failed = 1;
+    writer->used = 0;
+}
+
+/** 
+ * Starts a chunk of the given type, closing the open one.
+ */
+static void _memd_dump_chunk(MEMD_DumpWriter *writer, const char *type) {
+    _memd_dump_close(writer);
+    if (writer->used + sizeof(MEMD_DumpChunk) > MEMD_HEAP_DUMP_BUFFER)
+        _memd_dump_flush(writer);
+    memcpy(writer->header.type, type, sizeof(writer->header.type));
+    writer->header.count = 0;
+    writer->header.length = 0;
+    writer->chunk = writer->used;
+    writer->used += sizeof(MEMD_DumpChunk);
+    writer->open = 1;
+}
+
+/** 
+ * Appends a record made of count parts to the open chunk. When the buffer is
+ * full the chunk is continued in a new one, and records that don't fit into
+ * the buffer at all get a chunk of their own, written straight from memory.
+ */
+static void _memd_dump_record(MEMD_DumpWriter *writer, const void **parts, const size_t *sizes, int count) {
+    static const char padding[8] = { 0 };
+    size_t length = 0;
+    for (int i = 0; i < count; i++)
+        length += sizes[i];
+    size_t pad = (8 - length % 8) % 8;
+
+    if (writer->used + length + pad > MEMD_HEAP_DUMP_BUFFER) {
+        char type[4];
+        memcpy(type, writer->header.type, sizeof(type));
+        _memd_dump_flush(writer);
+        if (sizeof(MEMD_DumpChunk) + length + pad > MEMD_HEAP_DUMP_BUFFER) {
+            MEMD_DumpChunk chunk;
+            memcpy(chunk.type, type, sizeof(chunk.type));
+            chunk.count = 1;
+            chunk.length = length + pad;
+            if (fwrite(&chunk, sizeof(chunk), 1, writer->file) != 1)
+                writer->failed = 1;
+            for (int i = 0; i < count; i++) {
+                if (sizes[i] > 0 && fwrite(parts[i], 1, sizes[i], writer->file) != sizes[i])
+                    writer->failed = 1;
+            }
+            if (pad > 0 && fwrite(padding, 1, pad, writer->file) != pad)
+                writer->failed = 1;
+            _memd_dump_chunk(writer, type);
+            return;
+        }
+        _memd_dump_chunk(writer, type);
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (sizes[i] > 0)
+            memcpy(writer->buffer + writer->used, parts[i], sizes[i]);
+        writer->used += sizes[i];
+    }
+    memset(writer->buffer + writer->used, 0, pad);
+    writer->used += pad;
+    writer->header.count++;
+    writer->header.length += length + pad;
+}
+
+/** 
+ * Appends a block or root range record with its contents.
+ */
+static void _memd_dump_block(MEMD_DumpWriter *writer, const void *address, size_t size, size_t stored,
+                             uint32_t site, uint32_t flags) {
+    MEMD_DumpBlock block;
+    block.address = (uint64_t)(size_t)address;
+    block.size = size;
+    block.stored = stored;
+    block.site = site;
+    block.flags = flags;
+    const void *parts[2] = { &block, address };
+    size_t sizes[2] = { sizeof(block), stored };
+    _memd_dump_record(writer, parts, sizes, 2);
+}
+
+/** 
+ * Bytes of a block's contents written to heap dumps.
+ */
+static size_t _memd_dump_stored(size_t size) {
+    return MEMD_HEAP_DUMP_MAX_BLOCK > 0 && size > MEMD_HEAP_DUMP_MAX_BLOCK ? MEMD_HEAP_DUMP_MAX_BLOCK : size;
+}
+
+/** 
+ * Appends a root range, leaving out MEMD's own tracking data, which points
+ * to every block.
+ */
+static void _memd_dump_root(MEMD_DumpWriter *writer, const char *start, const char *end) {
+    const char *excluded[][2] = {
+        { (const char *)&MEMD_Data, (const char *)&MEMD_Data + sizeof(MEMD_Data) },
+#ifdef MEMD_SLAB_BACKEND
+        { (const char *)&_memd_slab, (const char *)&_memd_slab + sizeof(_memd_slab) },
+#endif
+    };
+    size_t excluded_count = sizeof(excluded) / sizeof(excluded[0]);
+
+    while (start < end) {
+        // the range runs up to the next excluded object starting inside it
+        const char *stop = end;
+        const char *resume = end;
+        for (size_t i = 0; i < excluded_count; i++) {
+            if (excluded[i][0] <= start && start < excluded[i][1]) {
+                stop = start;
+                resume = excluded[i][1];
+                break;
+            }
+            if (start < excluded[i][0] && excluded[i][0] < stop) {
+                stop = excluded[i][0];
+                resume = excluded[i][1];
+            }
+        }
+        if (stop > start)
+            _memd_dump_block(writer, start, (size_t)(stop - start), (size_t)(stop - start), 0, 0);
+        start = resume;
+    }
+}
+
+/** 
+ * Appends the chunk of all registered call sites.
+ */
+static void _memd_dump_sites(MEMD_DumpWriter *writer) {
+    _memd_dump_chunk(writer, MEMD_DUMP_SITES);
+    for (MEMD_Site *site = MEMD_Data.sites; site != NULL; site = site->next) {
+        MEMD_DumpSite record;
+        record.id = site->id;
+        record.line = site->line;
+        record.file_length = site->file != NULL ? (uint32_t)strlen(site->file) : 0;
+        record.func_length = site->func != NULL ? (uint32_t)strlen(site->func) : 0;
+        record.type_length = site->type != NULL ? (uint32_t)strlen(site->type) : 0;
+        record.tag_length = site->tag != NULL ? (uint32_t)strlen(site->tag) : 0;
+        const void *parts[5] = { &record, site->file, site->func, site->type, site->tag };
+        size_t sizes[5] = { sizeof(record), record.file_length, record.func_length, record.type_length, record.tag_length };
+        _memd_dump_record(writer, parts, sizes, 5);
+    }
+}
+
+#if defined(__linux__) && defined(__GLIBC__)
+#ifdef __cplusplus
+extern "C" {
+#endif
+/** 
+ * Start of the data segment and end of the bss segment of the executable.
+ */
+extern char __data_start[], _end[];
+#ifdef __cplusplus
+}
+#endif
+#endif
+
+int memd_heap_dump(const char *path) {
+    FILE *file = fopen(path, "wb");
+    if (file == NULL)
+        return -1;
+    MEMD_DumpWriter writer;
+    memset(&writer, 0, sizeof(writer));
+    writer.file = file;
+    writer.buffer = (char *)malloc(MEMD_HEAP_DUMP_BUFFER);
+    if (writer.buffer == NULL) {
+        fclose(file);
+        return -1;
+    }
+
+    // the records are copied under the lock and the contents written without
+    // it, like a report, blocks freed in the meantime stay until the end
+    MEMD_REPORT_LOCK();
+    MEMD_LOCK();
+    MEMD_DumpHeader header;
+    memcpy(header.magic, MEMD_DUMP_MAGIC, sizeof(header.magic));
+    header.version = MEMD_DUMP_VERSION;
+    header.byte_order = MEMD_DUMP_BYTE_ORDER;
+    memcpy(writer.buffer, &header, sizeof(header));
+    writer.used = sizeof(header);
+
+    _memd_dump_sites(&writer);
+    int taken = _memd_snapshot_take(&_memd_snapshot);
+    int root_count = MEMD_Data.root_count;
+    MEMD_Root roots[MEMD_MAX_ROOTS];
+    memcpy(roots, MEMD_Data.roots, (size_t)root_count * sizeof(MEMD_Root));
+    MEMD_UNLOCK();
+
+    if (taken != 0) {
+        MEMD_REPORT_UNLOCK();
+        free(writer.buffer);
+        fclose(file);
+        return -1;
+    }
+
+    _memd_dump_chunk(&writer, MEMD_DUMP_BLOCKS);
+    for (uint32_t i = 0; i < _memd_snapshot.count; i++) {
+        const MEMD_Mem *mem = &_memd_snapshot.blocks[i].mem;
+        if (mem->pool != NULL)
+            _memd_dump_block(&writer, (const void *)mem->address, mem->size, 0, mem->site->id, MEMD_DUMP_POOL_BLOCK);
+        else
+            _memd_dump_block(&writer, (const void *)mem->address, mem->size, _memd_dump_stored(mem->size), mem->site->id, 0);
+    }
+
+    _memd_dump_chunk(&writer, MEMD_DUMP_ROOTS);
+    for (int i = 0; i < root_count; i++) {
+        const char *start = (const char *)roots[i].start;
+        _memd_dump_root(&writer, start, start + roots[i].size);
+    }
+#if defined(__linux__) && defined(__GLIBC__)
+    _memd_dump_root(&writer, __data_start, _end);
+#endif
+
+    _memd_dump_chunk(&writer, MEMD_DUMP_END);
+    _memd_dump_flush(&writer);
+
+    MEMD_LOCK();
+    _memd_snapshot_release(&_memd_snapshot);
+    MEMD_UNLOCK();
+    MEMD_REPORT_UNLOCK();
+
+    free(writer.buffer);
+    if (fclose(file) != 0)
+        writer.failed = 1;
+    return writer.failed ? -1 : 0;
+}
+
+int memd_event_log_open(const char *path) {
+    MEMD_LOCK();
+    if (_memd_events.file != NULL) {
+        MEMD_UNLOCK();
+        return -1;
+    }
+    FILE *file = fopen(path, "wb");
+    MEMD_EventBuffer *buffers = (MEMD_EventBuffer *)calloc(MEMD_EVENT_THREADS, sizeof(MEMD_EventBuffer));
+    MEMD_DumpHeader header;
+    memcpy(header.magic, MEMD_EVENT_MAGIC, sizeof(header.magic));
+    header.version = MEMD_EVENT_VERSION;
+    header.byte_order = MEMD_DUMP_BYTE_ORDER;
+    if (file == NULL || buffers == NULL || fwrite(&header, sizeof(header), 1, file) != 1) {
+        if (file != NULL)
+            fclose(file);
+        free(buffers);
+        MEMD_UNLOCK();
+        return -1;
+    }
+    _memd_events.buffers = buffers;
+    _memd_events.failed = 0;
+    _memd_events.file = file;
+    MEMD_UNLOCK();
+    return 0;
+}
+
+int memd_event_log_close() {
+    MEMD_LOCK();
+    if (_memd_events.file == NULL) {
+        MEMD_UNLOCK();
+        return -1;
+    }
+    for (int i = 0; i < MEMD_EVENT_THREADS; i++)
+        _memd_event_flush(&_memd_events.buffers[i]);
+
+    MEMD_DumpWriter writer;
+    memset(&writer, 0, sizeof(writer));
+    writer.file = _memd_events.file;
+    writer.buffer = (char *)malloc(MEMD_HEAP_DUMP_BUFFER);
+    int failed = _memd_events.failed || writer.buffer == NULL;
+    if (writer.buffer != NULL) {
+        _memd_dump_sites(&writer);
+        _memd_dump_chunk(&writer, MEMD_DUMP_END);
+        _memd_dump_flush(&writer);
+        free(writer.buffer);
+        failed |= writer.failed;
+    }
+    if (fclose(_memd_events.file) != 0)
+        failed = 1;
+    free(_memd_events.buffers);
+    _memd_events.file = NULL;
+    _memd_events.buffers = NULL;
+    MEMD_UNLOCK();
+    return failed ? -1 : 0;
+}
+
+void memd_reset_peak() {
+    MEMD_LOCK();
+    MEMD_Data.peak_size = MEMD_Data.total_allocated_size - MEMD_Data.total_free_size;
+    for (int i = 0; i < MEMD_Data.resource_count; i++)
+        MEMD_Data.resources[i].peak_size = MEMD_Data.resources[i].live_size;
+    for (int i = 0; i < MEMD_Data.pool_count; i++)
+        MEMD_Data.pools[i].peak_size = MEMD_Data.pools[i].live_size;
+    for (MEMD_Arena *arena = MEMD_Data.arenas; arena != NULL; arena = arena->next)
+        arena->peak_size = arena->used_size;
+#ifdef MEMD_HANDLES
+    for (int kind = 0; kind < MEMD_HANDLE_KINDS; kind++)
+        _memd_handles.stats[kind].peak_count = _memd_handles.stats[kind].open_count - _memd_handles.stats[kind].close_count;
+#endif
+    MEMD_UNLOCK();
+}
+
+#ifdef MEMD_CONTROL
+/** 
+ * Longest command the control channel accepts.
+ */
+#define MEMD_CONTROL_LINE 512
+
+/** 
+ * Flags of writes to control clients, so a client that hung up doesn't
+ * raise SIGPIPE.
+ */
+#ifdef MSG_NOSIGNAL
+#define MEMD_CONTROL_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define MEMD_CONTROL_SEND_FLAGS 0
+#endif
+
+/** 
+ * State of the control channel.
+ */
+static struct {
+    int state;           /**< 0 while closed, 1 while open, 2 while closing. */
+    int listener;        /**< The listening socket. */
+    int wake[2];         /**< Pipe whose write end stops the thread. */
+    pthread_t thread;    /**< Thread serving the clients. */
+    struct sockaddr_un address; /**< Address of the socket. */
+} _memd_control;
+
+/** 
+ * Writes length bytes of text to a client.
+ * @return 0 on success, or -1 if the client is gone.
+ */
+static int _memd_control_send(int client, const char *text, size_t length) {
+    while (length > 0) {
+        ssize_t sent = send(client, text, length, MEMD_CONTROL_SEND_FLAGS);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return -1;
+        text += sent;
+        length -= (size_t)sent;
+    }
+    return 0;
+}
+
+/** 
+ * Runs a command of the control channel and writes its output to a client.
+ * @return 0 on success, or -1 if the client is gone.
+ */
+static int _memd_control_command(int client, char *line) {
+    char *arg = strchr(line, ' ');
+    if (arg != NULL) {
+        *arg++ = '\0';
+        while (*arg == ' ')
+            arg++;
+        if (*arg == '\0')
+            arg = NULL;
+    }
+
+    char reply[256] = "";
+    char *text = NULL;
+    int result = 0;
+    if (strcmp(line, "report") == 0) {
+        text = memd_report();
+        result = text != NULL ? 0 : -1;
+    } else if (strcmp(line, "top") == 0) {
+        MEMD_Query query;
+        memset(&query, 0, sizeof(query));
+        query.sort = MEMD_SORT_BYTES;
+        query.limit = arg != NULL ? strtoul(arg, NULL, 10) : 10;
+        text = memd_query(&query);
+        result = text != NULL ? 0 : -1;
+    } else if (strcmp(line, "stats") == 0) {
+        char live[32], peak[32];
+        MEMD_LOCK();
+        size_t allocated = MEMD_Data.total_allocated_size;
+        size_t freed = MEMD_Data.total_free_size;
+        size_t peak_size = MEMD_Data.peak_size;
+        size_t warning_total = MEMD_Data.warning_total;
+        MEMD_UNLOCK();
+        _memd_format_size(live, sizeof(live), allocated - freed);
+        _memd_format_size(peak, sizeof(peak), peak_size);
+        snprintf(reply, sizeof(reply),
+            "   Live: %s\n   Peak: %s\n   Total Memory allocated %lu bytes\n   Total Memory freed     %lu bytes\n   Warnings: %lu\n",
+            live, peak, (unsigned long)allocated, (unsigned long)freed, (unsigned long)warning_total);
+    } else if (strcmp(line, "snapshot") == 0 && arg != NULL) {
+        result = memd_heap_dump(arg);
+    } else if (strcmp(line, "events") == 0 && arg != NULL) {
+        result = strcmp(arg, "off") == 0 ? memd_event_log_close() : memd_event_log_open(arg);
+    } else if (strcmp(line, "reset-peak") == 0 && arg == NULL) {
+        memd_reset_peak();
+    } else if (strcmp(line, "pause") == 0 && arg == NULL) {
+        memd_pause();
+    } else if (strcmp(line, "resume") == 0 && arg == NULL) {
+        memd_resume();
+    } else {
+        result = -1;
+    }
+
+    if (text != NULL) {
+        int sent = _memd_control_send(client, text, strlen(text));
+        memd_report_free(text);
+        if (sent != 0)
+            return -1;
+    }
+    strcat(reply, result == 0 ? "ok\n" : "error\n");
+    return _memd_control_send(client, reply, strlen(reply));
+}
+
+/** 
+ * Waits until fd is readable or the channel is closed.
+ * @return 1 if fd is readable, or 0 if the thread has to stop.
+ */
+static int _memd_control_wait(int fd) {
+    struct pollfd fds[2];
+    fds[0].fd = fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = _memd_control.wake[0];
+    fds[1].events = POLLIN;
+    for (;;) {
+        fds[0].revents = 0;
+        fds[1].revents = 0;
+        if (poll(fds, 2, -1) < 0 && errno != EINTR)
+            return 0;
+        if (fds[1].revents != 0)
+            return 0;
+        if (fds[0].revents != 0)
+            return 1;
+    }
+}
+
+/** 
+ * Serves the commands of one client until it hangs up.
+ * @return 0 when the client is done, or -1 if the thread has to stop.
+ */
+static int _memd_control_serve(int client) {
+    char line[MEMD_CONTROL_LINE];
+    size_t used = 0;
+    for (;;) {
+        if (!_memd_control_wait(client))
+            return -1;
+        ssize_t received = recv(client, line + used, sizeof(line) - 1 - used, 0);
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received <= 0)
+            return 0;
+        used += (size_t)received;
+
+        // run every complete line, keeping the start of the next one
+        char *start = line, *end;
+        while ((end = (char *)memchr(start, '\n', used - (size_t)(start - line))) != NULL) {
+            *end = '\0';
+            if (end > start && end[-1] == '\r')
+                end[-1] = '\0';
+            if (*start != '\0' && _memd_control_command(client, start) != 0)
+                return 0;
+            start = end + 1;
+        }
+        used -= (size_t)(start - line);
+        memmove(line, start, used);
+        if (used == sizeof(line) - 1) {
+            _memd_control_send(client, "error\n", 6);
+            return 0;
+        }
+    }
+}
+
+/** 
+ * Returns whether a client runs as the same user as the process. The socket
+ * can write files with the process's privileges, so other users are refused
+ * even if the file permissions of the socket let them connect.
+ */
+static int _memd_control_trusted(int client) {
+#if defined(SO_PEERCRED)
+    // struct ucred is only declared with _GNU_SOURCE, this is its layout
+    struct { pid_t pid; uid_t uid; gid_t gid; } credentials;
+    socklen_t length = sizeof(credentials);
+    if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &credentials, &length) != 0 || length != sizeof(credentials))
+        return 0;
+    return credentials.uid == geteuid();
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
+    uid_t uid;
+    gid_t gid;
+    return getpeereid(client, &uid, &gid) == 0 && uid == geteuid();
+#else
+    // only the socket's file permissions protect it
+    (void)client;
+    return 1;
+#endif
+}
+
+/** 
+ * Main function of the control thread, serving one client at a time.
+ */
+static void *_memd_control_main(void *arg) {
+    (void)arg;
+    while (_memd_control_wait(_memd_control.listener)) {
+        int client = accept(_memd_control.listener, NULL, NULL);
+        if (client < 0)
+            continue;
+        if (!_memd_control_trusted(client)) {
+            close(client);
+            continue;
+        }
+        int result = _memd_control_serve(client);
+        close(client);
+        if (result != 0)
+            break;
+    }
+    return NULL;
+}
+
+/** 
+ * Whether the socket address is taken by a socket left over by a previous run.
+ * Strict C99 builds don't declare lstat and S_ISSOCK, so other kinds of files
+ * are ruled out with stat, and a socket nobody listens on is stale.
+ */
+static int _memd_control_stale(const struct sockaddr_un *address) {
+    struct stat status;
+    if (stat(address->sun_path, &status) != 0 ||
+        S_ISREG(status.st_mode) || S_ISDIR(status.st_mode) || S_ISFIFO(status.st_mode) ||
+        S_ISCHR(status.st_mode) || S_ISBLK(status.st_mode))
+        return 0;
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe < 0)
+        return 0;
+    int refused = connect(probe, (const struct sockaddr *)address, sizeof(*address)) != 0 && errno == ECONNREFUSED;
+    close(probe);
+    return refused;
+}
+
+int memd_control_open(const char *path) {
+    MEMD_LOCK();
+    if (_memd_control.state != 0 || strlen(path) >= sizeof(_memd_control.address.sun_path)) {
+        MEMD_UNLOCK();
+        return -1;
+    }
+    memset(&_memd_control.address, 0, sizeof(_memd_control.address));
+    _memd_control.address.sun_family = AF_UNIX;
+    strcpy(_memd_control.address.sun_path, path);
+
+    // a socket left over by a previous run would make bind fail, any other
+    // file at the path is left alone
+    if (_memd_control_stale(&_memd_control.address))
+        unlink(path);
+    _memd_control.listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (_memd_control.listener < 0) {
+        MEMD_UNLOCK();
+        return -1;
+    }
+
+    // only the owner may connect, the socket is created without group and
+    // other permissions
+    mode_t mask = umask(077);
+    int bound = bind(_memd_control.listener, (struct sockaddr *)&_memd_control.address, sizeof(_memd_control.address));
+    umask(mask);
+    if (bound != 0) {
+        close(_memd_control.listener);
+        MEMD_UNLOCK();
+        return -1;
+    }
+    if (chmod(path, 0600) != 0 ||
+        listen(_memd_control.listener, 4) != 0 ||
+        pipe(_memd_control.wake) != 0) {
+        close(_memd_control.listener);
+        unlink(path);
+        MEMD_UNLOCK();
+        return -1;
+    }
+    if (pthread_create(&_memd_control.thread, NULL, _memd_control_main, NULL) != 0) {
+        close(_memd_control.listener);
+        close(_memd_control.wake[0]);
+        close(_memd_control.wake[1]);
+        unlink(path);
+        MEMD_UNLOCK();
+        return -1;
+    }
+    _memd_control.state = 1;
+    MEMD_UNLOCK();
+    return 0;
+}
+
+int memd_control_close() {
+    MEMD_LOCK();
+    if (_memd_control.state != 1) {
+        MEMD_UNLOCK();
+        return -1;
+    }
+    _memd_control.state = 2;
+    MEMD_UNLOCK();
+
+    // joined without the lock, the thread may be running a command that needs it
+    char stop = 1;
+    while (write(_memd_control.wake[1], &stop, 1) < 0 && errno == EINTR)
+        ;
+    pthread_join(_memd_control.thread, NULL);
+    close(_memd_control.listener);
+    close(_memd_control.wake[0]);
+    close(_memd_control.wake[1]);
+    unlink(_memd_control.address.sun_path);
+
+    MEMD_LOCK();
+    _memd_control.state = 0;
+    MEMD_UNLOCK();
+    return 0;
+}
+#else
+int memd_control_open(const char *path) {
+    (void)path;
+    return -1;
+}
+
+int memd_control_close() {
+    return -1;
+}
+#endif // MEMD_CONTROL
+
+#ifdef MEMD_REPORTER
+/** 
+ * A site whose live memory grew since the previous periodic report.
+ */
+typedef struct {
+    const MEMD_Site *site; /**< The site. */
+    size_t live_count;     /**< Live blocks of the site. */
+    size_t live_size;      /**< Live bytes of the site. */
+    size_t grown_count;    /**< Blocks added since the previous report. */
+    size_t grown_size;     /**< Bytes added since the previous report. */
+} MEMD_Growth;
+
+/** 
+ * State of the reporter thread.
+ */
+static struct {
+    int state;             /**< 0 while stopped, 1 while running, 2 while stopping. */
+    MEMD_Reporter config;  /**< Copy of the configuration, with its own path. */
+    uint32_t report_count; /**< Number of reports written. */
+    size_t *last_counts;   /**< Live blocks of each site id at the previous report. */
+    size_t *last_sizes;    /**< Live bytes of each site id at the previous report. */
+    uint32_t last_capacity; /**< Number of site ids the arrays hold. */
+#ifdef _WIN32
+    HANDLE thread;         /**< The reporter thread. */
+    HANDLE wake;           /**< Event that stops the thread. */
+#else
+    pthread_t thread;      /**< The reporter thread. */
+    int wake[2];           /**< Pipe whose write end stops the thread. */
+#endif
+} _memd_reporter;
+
+/** 
+ * Waits for the report interval.
+ * @return 1 when the interval has passed, or 0 if the reporter is stopped.
+ */
+static int _memd_reporter_wait() {
+#ifdef _WIN32
+    return WaitForSingleObject(_memd_reporter.wake, _memd_reporter.config.interval_ms) == WAIT_TIMEOUT;
+#else
+    struct pollfd fd;
+    fd.fd = _memd_reporter.wake[0];
+    fd.events = POLLIN;
+    fd.revents = 0;
+    int result = poll(&fd, 1, (int)_memd_reporter.config.interval_ms);
+    return result == 0 || (result < 0 && errno == EINTR);
+#endif
+}
+
+/** 
+ * Compares growing sites by bytes added, largest first.
+ */
+static int _memd_compare_growth(const void *a, const void *b) {
+    size_t x = ((const MEMD_Growth *)a)->grown_size;
+    size_t y = ((const MEMD_Growth *)b)->grown_size;
+    return x > y ? -1 : x < y;
+}
+
+/** 
+ * Collects the sites whose live blocks or bytes grew since the previous
+ * report. Called with the MEMD lock held.
+ * @return Number of growing sites, or -1 when out of memory.
+ */
+static int _memd_reporter_growth(MEMD_Growth **out) {
+    uint32_t site_count = MEMD_Data.site_count;
+    if (site_count + 1 > _memd_reporter.last_capacity) {
+        uint32_t capacity = site_count + 1 + site_count / 2;
+        size_t *counts = (size_t *)realloc(_memd_reporter.last_counts, capacity * sizeof(size_t));
+        if (counts != NULL)
+            _memd_reporter.last_counts = counts;
+        size_t *sizes = (size_t *)realloc(_memd_reporter.last_sizes, capacity * sizeof(size_t));
+        if (sizes != NULL)
+            _memd_reporter.last_sizes = sizes;
+        if (counts == NULL || sizes == NULL)
+            return -1;
+        memset(counts + _memd_reporter.last_capacity, 0, (capacity - _memd_reporter.last_capacity) * sizeof(size_t));
+        memset(sizes + _memd_reporter.last_capacity, 0, (capacity - _memd_reporter.last_capacity) * sizeof(size_t));
+        _memd_reporter.last_capacity = capacity;
+    }
+    MEMD_Growth *growth = (MEMD_Growth *)malloc((site_count > 0 ? site_count : 1) * sizeof(MEMD_Growth));
+    if (growth == NULL)
+        return -1;
+
+    int count = 0;
+    for (MEMD_Site *site = MEMD_Data.sites; site != NULL; site = site->next) {
+        size_t live_count = site->alloc_count - site->free_count;
+        size_t live_size = site->allocated_size - site->free_size;
+        size_t *last_count = &_memd_reporter.last_counts[site->id];
+        size_t *last_size = &_memd_reporter.last_sizes[site->id];
+        if (live_count > *last_count || live_size > *last_size) {
+            MEMD_Growth *entry = &growth[count++];
+            entry->site = site;
+            entry->live_count = live_count;
+            entry->live_size = live_size;
+            entry->grown_count = live_count > *last_count ? live_count - *last_count : 0;
+            entry->grown_size = live_size > *last_size ? live_size - *last_size : 0;
+        }
+        *last_count = live_count;
+        *last_size = live_size;
+    }
+    *out = growth;
+    return count;
+}
+
+/** 
+ * Moves path to path.1, path.1 to path.2 and so on, dropping the oldest file.
+ */
+static void _memd_reporter_rotate(const char *path, uint32_t file_count) {
+    size_t length = strlen(path) + 16;
+    char *from = (char *)malloc(length);
+    char *to = (char *)malloc(length);
+    if (from != NULL && to != NULL) {
+        snprintf(to, length, "%s.%u", path, file_count);
+        remove(to);
+        for (uint32_t i = file_count; i > 1; i--) {
+            snprintf(from, length, "%s.%u", path, i - 1);
+            snprintf(to, length, "%s.%u", path, i);
+            rename(from, to);
+        }
+        snprintf(to, length, "%s.1", path);
+        rename(path, to);
+    }
+    free(from);
+    free(to);
+}
+
+/** 
+ * Converts a time to local time without sharing localtime's result with the
+ * program's own calls. Strict C99 builds don't declare localtime_r, there the
+ * result is copied under the MEMD lock, which at least orders MEMD's calls.
+ * @return 1 on success, 0 if the time can't be converted.
+ */
+static int _memd_localtime(const time_t *now, struct tm *out) {
+#if defined(_WIN32)
+    return localtime_s(out, now) == 0;
+#elif defined(_POSIX_C_SOURCE) || defined(_XOPEN_SOURCE) || defined(_DEFAULT_SOURCE) || \
+      defined(_BSD_SOURCE) || defined(_GNU_SOURCE) || defined(__APPLE__)
+    return localtime_r(now, out) != NULL;
+#else
+    MEMD_LOCK();
+    struct tm *local = localtime(now);
+    if (local != NULL)
+        *out = *local;
+    MEMD_UNLOCK();
+    return local != NULL;
+#endif
+}
+
+/** 
+ * Appends a periodic report to the reporter's file: the totals, the sites
+ * that grew since the previous report and, every config.full_every reports,
+ * the full report.
+ */
+static void _memd_reporter_write() {
+    MEMD_Reporter *config = &_memd_reporter.config;
+    MEMD_Growth *growth = NULL;
+    if (config->metrics_path != NULL)
+        memd_metrics_write(config->metrics_path);
+    if (config->path == NULL)
+        return;
+
+    MEMD_LOCK();
+    size_t allocated = MEMD_Data.total_allocated_size;
+    size_t freed = MEMD_Data.total_free_size;
+    size_t peak_size = MEMD_Data.peak_size;
+    int warning_count = MEMD_Data.warning_count;
+    int growth_count = _memd_reporter_growth(&growth);
+    MEMD_UNLOCK();
+
+    uint32_t number = ++_memd_reporter.report_count;
+    char *full = config->full_every > 0 && number % config->full_every == 0 ? memd_report() : NULL;
+    FILE *file = fopen(config->path, "a");
+    if (file != NULL) {
+        char date[32] = "";
+        time_t now = time(NULL);
+        struct tm local;
+        if (_memd_localtime(&now, &local))
+            strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &local);
+        fprintf(file, "\n----------------------------------\n");
+        fprintf(file, "MEMD Report %u (%s):\n", number, date);
+        fprintf(file, "----------------------------------\n\n");
+        fprintf(file, "   Total Memory allocated %lu bytes\n", (unsigned long)allocated);
+        fprintf(file, "   Total Memory freed     %lu bytes\n", (unsigned long)freed);
+        fprintf(file, "   Memory Live            %lu bytes\n", (unsigned long)(allocated - freed));
+        fprintf(file, "   Memory Peak            %lu bytes\n", (unsigned long)peak_size);
+        fprintf(file, "   Warnings               %d\n", warning_count);
+
+        if (growth_count > 0) {
+            qsort(growth, (size_t)growth_count, sizeof(MEMD_Growth), _memd_compare_growth);
+            fprintf(file, "\n   Growth:\n");
+            for (int i = 0; i < growth_count && i < MEMD_REPORTER_SITES; i++) {
+                char grown[32], live[32];
+                _memd_format_size(grown, sizeof(grown), growth[i].grown_size);
+                _memd_format_size(live, sizeof(live), growth[i].live_size);
+                fprintf(file, "     %s:%u", growth[i].site->file, growth[i].site->line);
+                if (growth[i].site->func != NULL)
+                    fprintf(file, " (%s)", growth[i].site->func);
+                fprintf(file, ": +%lu blocks (+%s), %lu blocks live (%s)\n",
+                    (unsigned long)growth[i].grown_count, grown,
+                    (unsigned long)growth[i].live_count, live);
+            }
+            if (growth_count > MEMD_REPORTER_SITES)
+                fprintf(file, "     ... and %d more sites\n", growth_count - MEMD_REPORTER_SITES);
+        }
+        if (full != NULL)
+            fputs(full, file);
+
+        long size = ftell(file);
+        fclose(file);
+        if (config->max_size > 0 && config->file_count > 0 && size >= 0 && (size_t)size >= config->max_size)
+            _memd_reporter_rotate(config->path, config->file_count);
+    }
+    memd_report_free(full);
+    free(growth);
+}
+
+/** 
+ * Main function of the reporter thread. It writes a report every interval,
+ * and a last one when it is stopped.
+ */
+#ifdef _WIN32
+static DWORD WINAPI _memd_reporter_main(LPVOID arg) {
+    (void)arg;
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_LOWEST);
+#else
+static void *_memd_reporter_main(void *arg) {
+    (void)arg;
+#ifdef __linux__
+    // on Linux the nice value of PRIO_PROCESS 0 is the calling thread's
+    setpriority(PRIO_PROCESS, 0, 19);
+#endif
+#endif
+    while (_memd_reporter_wait())
+        _memd_reporter_write();
+    _memd_reporter_write();
+    return 0;
+}
+
+/** 
+ * Copies a path of the reporter's configuration.
+ * @return The copy, or NULL if path is NULL or out of memory.
+ */
+static char *_memd_reporter_path(const char *path) {
+    char *copy = path != NULL ? (char *)malloc(strlen(path) + 1) : NULL;
+    if (copy != NULL)
+        strcpy(copy, path);
+    return copy;
+}
+
+/** 
+ * Frees the paths of the reporter's configuration.
+ */
+static void _memd_reporter_free_paths() {
+    free((char *)_memd_reporter.config.path);
+    free((char *)_memd_reporter.config.metrics_path);
+    _memd_reporter.config.path = NULL;
+    _memd_reporter.config.metrics_path = NULL;
+}
+
+int memd_reporter_start(const MEMD_Reporter *config) {
+    if ((config->path == NULL && config->metrics_path == NULL) || config->interval_ms == 0)
+        return -1;
+    MEMD_LOCK();
+    if (_memd_reporter.state != 0) {
+        MEMD_UNLOCK();
+        return -1;
+    }
+    _memd_reporter.config = *config;
+    _memd_reporter.config.path = _memd_reporter_path(config->path);
+    _memd_reporter.config.metrics_path = _memd_reporter_path(config->metrics_path);
+    if ((config->path != NULL && _memd_reporter.config.path == NULL) ||
+        (config->metrics_path != NULL && _memd_reporter.config.metrics_path == NULL)) {
+        _memd_reporter_free_paths();
+        MEMD_UNLOCK();
+        return -1;
+    }
+    _memd_reporter.report_count = 0;
+
+    int started;
+#ifdef _WIN32
+    _memd_reporter.wake = CreateEvent(NULL, TRUE, FALSE, NULL);
+    _memd_reporter.thread = _memd_reporter.wake != NULL ? CreateThread(NULL, 0, _memd_reporter_main, NULL, 0, NULL) : NULL;
+    started = _memd_reporter.thread != NULL;
+    if (!started && _memd_reporter.wake != NULL)
+        CloseHandle(_memd_reporter.wake);
+#else
+    started = pipe(_memd_reporter.wake) == 0;
+    if (started && pthread_create(&_memd_reporter.thread, NULL, _memd_reporter_main, NULL) != 0) {
+        close(_memd_reporter.wake[0]);
+        close(_memd_reporter.wake[1]);
+        started = 0;
+    }
+#endif
+    if (!started) {
+        _memd_reporter_free_paths();
+        MEMD_UNLOCK();
+        return -1;
+    }
+    _memd_reporter.state = 1;
+    MEMD_UNLOCK();
+    return 0;
+}
+
+int memd_reporter_stop() {
+    MEMD_LOCK();
+    if (_memd_reporter.state != 1) {
+        MEMD_UNLOCK();
+        return -1;
+    }
+    _memd_reporter.state = 2;
+    MEMD_UNLOCK();
+
+    // joined without the lock, the thread needs it for its last report
+#ifdef _WIN32
+    SetEvent(_memd_reporter.wake);
+    WaitForSingleObject(_memd_reporter.thread, INFINITE);
+    CloseHandle(_memd_reporter.thread);
+    CloseHandle(_memd_reporter.wake);
+#else
+    char stop = 1;
+    while (write(_memd_reporter.wake[1], &stop, 1) < 0 && errno == EINTR)
+        ;
+    pthread_join(_memd_reporter.thread, NULL);
+    close(_memd_reporter.wake[0]);
+    close(_memd_reporter.wake[1]);
+#endif
+
+    MEMD_LOCK();
+    _memd_reporter_free_paths();
+    free(_memd_reporter.last_counts);
+    free(_memd_reporter.last_sizes);
+    _memd_reporter.last_counts = NULL;
+    _memd_reporter.last_sizes = NULL;
+    _memd_reporter.last_capacity = 0;
+    _memd_reporter.state = 0;
+    MEMD_UNLOCK();
+    return 0;
+}
+#else
+int memd_reporter_start(const MEMD_Reporter *config) {
+    (void)config;
+    return -1;
+}
+
+int memd_reporter_stop() {
+    return -1;
+}
+#endif // MEMD_REPORTER
+
+#ifdef __cplusplus
+namespace memd {
+
+/** 
+ * Returns the call site shared by all containers tagged with Tag, whatever
+ * their value type, registering it on first use.
+ */
+template <typename Tag>
+MEMD_Site *tag_site() {
+    static MEMD_Site site;
+    if (MEMD_LOAD_ACQUIRE(site.id) == 0) {
+        memd::source_location where = Tag::where();
+        site.tag = Tag::name();
+        _memd_site_register(&site, where.file_name(), (uint32_t)where.line(), NULL);
+    }
+    return &site;
+}
+
+/** 
+ * STL allocator adaptor that records the allocations of a single container.
+ * Allocations are forwarded to Alloc and tracked under the name and declaring
+ * location of Tag (see MEMD_CONTAINER_TAG). Alloc is held as an empty base, so
+ * a tracking_allocator over a stateless allocator is itself stateless.
+ */
+template <typename T, typename Tag, typename Alloc = std::allocator<T> >
+class tracking_allocator : private std::allocator_traits<Alloc>::template rebind_alloc<T> {
+    typedef typename std::allocator_traits<Alloc>::template rebind_alloc<T> base_type;
+    typedef std::allocator_traits<base_type> traits;
+
+    template <typename, typename, typename> friend class tracking_allocator;
+
+public:
+    typedef T value_type;
+    typedef typename traits::pointer pointer;
+    typedef typename traits::size_type size_type;
+    typedef typename traits::propagate_on_container_copy_assignment propagate_on_container_copy_assignment;
+    typedef typename traits::propagate_on_container_move_assignment propagate_on_container_move_assignment;
+    typedef typename traits::propagate_on_container_swap propagate_on_container_swap;
+
+    template <typename U>
+    struct rebind {
+        typedef tracking_allocator<U, Tag, typename std::allocator_traits<Alloc>::template rebind_alloc<U> > other;
+    };
+
+    tracking_allocator() {}
+    tracking_allocator(const base_type &alloc) : base_type(alloc) {}
+    template <typename U, typename A>
+    tracking_allocator(const tracking_allocator<U, Tag, A> &other) : base_type(other.base()) {}
+
+    pointer allocate(size_type n) {
+        pointer p = traits::allocate(base(), n);
+        MEMD_LOCK();
+        if (_memd_ignore != 1)
+            _insert((size_t)std::addressof(*p), n * sizeof(T), site());
+        MEMD_UNLOCK();
+        return p;
+    }
+
+    // tracking never decides whether memory is freed
+    void deallocate(pointer p, size_type n) {
+        _memd_untrack(std::addressof(*p));
+        traits::deallocate(base(), p, n);
+    }
+
+    tracking_allocator select_on_container_copy_construction() const {
+        return tracking_allocator(traits::select_on_container_copy_construction(base()));
+    }
+
+    template <typename U, typename A>
+    bool operator==(const tracking_allocator<U, Tag, A> &other) const { return base() == other.base(); }
+    template <typename U, typename A>
+    bool operator!=(const tracking_allocator<U, Tag, A> &other) const { return !(*this == other); }
+
+private:
+    base_type &base() { return *this; }
+    const base_type &base() const { return *this; }
+    static MEMD_Site *site() { return tag_site<Tag>(); }
+};
+
+#ifdef MEMD_HAS_PMR
+/** 
+ * std::pmr::memory_resource that forwards to an upstream resource and records
+ * every allocation, with its size and alignment, in the tracker. The live and
+ * peak bytes of each resource are listed in the report under its name.
+ */
+class tracking_resource : public std::pmr::memory_resource {
+public:
+    explicit tracking_resource(const char *name,
+                               std::pmr::memory_resource *upstream = std::pmr::get_default_resource(),
+                               memd::source_location where = MEMD_CURRENT_LOCATION())
+        : upstream_(upstream), stats_(_memd_resource_register(name, where.file_name(), (uint32_t)where.line())) {}
+
+    tracking_resource(const tracking_resource &) = delete;
+    tracking_resource &operator=(const tracking_resource &) = delete;
+
+    std::pmr::memory_resource *upstream_resource() const { return upstream_; }
+    size_t live_bytes() const { return stats_ ? stats_->live_size : 0; }
+    size_t peak_bytes() const { return stats_ ? stats_->peak_size : 0; }
+
+protected:
+    void *do_allocate(size_t bytes, size_t alignment) override {
+        void *p = upstream_->allocate(bytes, alignment);
+        MEMD_LOCK();
+        if (_memd_ignore != 1 && stats_ != NULL) {
+            MEMD_Mem *mem = _insert((size_t)p, bytes, &stats_->site);
+            if (mem != NULL) {
+                mem->alignment = (uint32_t)alignment;
+                stats_->live_size += bytes;
+                if (stats_->live_size > stats_->peak_size)
+                    stats_->peak_size = stats_->live_size;
+            }
+        }
+        MEMD_UNLOCK();
+        return p;
+    }
+
+    // tracking never decides whether memory is freed
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+        size_t size = _memd_untrack(p);
+        if (size != 0 && stats_ != NULL) {
+            MEMD_LOCK();
+            stats_->live_size -= size;
+            MEMD_UNLOCK();
+        }
+        upstream_->deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return this == &other;
+    }
+
+private:
+    std::pmr::memory_resource *upstream_;
+    MEMD_Resource *stats_;
+};
+#endif // MEMD_HAS_PMR
+
+/** 
+ * Destroys the constructed elements of a typed block and frees it, unless the
+ * construction finished. Cleans up when a constructor throws.
+ */
+template <typename T>
+struct typed_guard {
+    T *p;
+    size_t built;
+    MEMD_Site *site;
+
+    ~typed_guard() {
+        if (p == NULL)
+            return;
+        while (built > 0)
+            p[--built].~T();
+        _memd_free(p, site);
+    }
+};
+
+/** 
+ * Typed hooks behind MEMD_NEW and MEMD_DELETE in C++. Objects are constructed
+ * in tracked malloc'd memory, so they must be destroyed with MEMD_DELETE.
+ * Since the memory is released with free, T can't be over-aligned.
+ */
+template <typename T>
+T *typed_new(MEMD_Site *site) {
+    static_assert(alignof(T) <= alignof(std::max_align_t), "MEMD_NEW doesn't support over-aligned types");
+    typed_guard<T> guard = { (T *)_memd_malloc(sizeof(T), site), 0, site };
+    if (guard.p == NULL)
+        return NULL;
+    T *p = new (guard.p) T;
+    guard.p = NULL;
+    return p;
+}
+
+template <typename T>
+T *typed_new_array(size_t n, MEMD_Site *site) {
+    static_assert(alignof(T) <= alignof(std::max_align_t), "MEMD_NEW_ARRAY doesn't support over-aligned types");
+    typed_guard<T> guard = { (T *)_memd_malloc_array(n, sizeof(T), site), 0, site };
+    T *p = guard.p;
+    for (; guard.p != NULL && guard.built < n; guard.built++)
+        new (p + guard.built) T;
+    guard.p = NULL;
+    return p;
+}
+
+template <typename T>
+void typed_delete(T *p, MEMD_Site *site) {
+    if (p == NULL)
+        return;
+    p->~T();
+    _memd_free(p, site);
+}
+
+template <typename T>
+void typed_delete_array(T *p, size_t n, MEMD_Site *site) {
+    if (p == NULL)
+        return;
+    while (n > 0)
+        p[--n].~T();
+    _memd_free(p, site);
+}
+
+} // namespace memd
+#endif // __cplusplus
+
+// Redefine standard allocation functions to use MEMD tracking versions.
+#define malloc(size) _memd_malloc(size, MEMD_SITE())
+#define free(ptr) _memd_free(ptr, MEMD_SITE())
+#define calloc(num, size) _memd_calloc(num, size, MEMD_SITE())
+#define realloc(ptr, size) _memd_realloc(ptr, size, MEMD_SITE())
+
+// Report sub-allocations of user pools from the calling site.
+#define memd_pool_alloc_notify(pool, ptr, size) _memd_pool_alloc_notify(pool, ptr, size, MEMD_SITE())
+#define memd_pool_free_notify(pool, ptr) _memd_pool_free_notify(pool, ptr, MEMD_SITE())
+
+// Record arena blocks at the calling site.
+#define memd_arena_alloc(arena, size) _memd_arena_alloc(arena, size, MEMD_SITE())
+
+// Track resource handles opened and closed at the calling site. The
+// descriptor functions are only wrapped in C with MEMD_HANDLES_FD, their
+// macros would also rewrite members like ops->close(x) or, in C++,
+// std::ifstream::close.
+#ifdef MEMD_HANDLES
+#define memd_handle_open_notify(kind, value) _memd_handle_open_notify(kind, (uint64_t)(uintptr_t)(value), MEMD_SITE())
+#define memd_handle_close_notify(kind, value) _memd_handle_close_notify(kind, (uint64_t)(uintptr_t)(value))
+#define fopen(path, mode) _memd_fopen(path, mode, MEMD_SITE())
+#define fclose(file) _memd_fclose(file)
+#ifndef _WIN32
+#if defined(MEMD_HANDLES_FD) && !defined(__cplusplus)
+#define open(...) _memd_open(MEMD_SITE(), __VA_ARGS__)
+#define close(fd) _memd_close(fd)
+#define socket(domain, type, protocol) _memd_socket(domain, type, protocol, MEMD_SITE())
+#endif
+#define opendir(path) _memd_opendir(path, MEMD_SITE())
+#define closedir(dir) _memd_closedir(dir)
+#define pthread_mutex_init(mutex, attr) _memd_mutex_init(mutex, attr, MEMD_SITE())
+#define pthread_mutex_destroy(mutex) _memd_mutex_destroy(mutex)
+#endif
+#else
+#define memd_handle_open_notify(kind, value) ((void)0)
+#define memd_handle_close_notify(kind, value) ((void)0)
+#endif
+
+// Batched allocation and free, see _memd_malloc_batch and _memd_free_batch.
+#define memd_malloc_batch(n, size, out) _memd_malloc_batch(n, size, out, MEMD_SITE())
+#define memd_free_batch(ptrs, n) _memd_free_batch(ptrs, n, MEMD_SITE())
+
+// Typed allocation, recording T as the element type of the calling site.
+#ifdef __cplusplus
+#define MEMD_NEW(T) memd::typed_new<T>(MEMD_TYPED_SITE(T))
+#define MEMD_NEW_ARRAY(T, n) memd::typed_new_array<T>(n, MEMD_TYPED_SITE(T))
+#define MEMD_DELETE(ptr) memd::typed_delete(ptr, MEMD_SITE())
+#define MEMD_DELETE_ARRAY(ptr, n) memd::typed_delete_array(ptr, n, MEMD_SITE())
+#else
+#define MEMD_NEW(T) ((T *)_memd_malloc(sizeof(T), MEMD_TYPED_SITE(T)))
+#define MEMD_NEW_ARRAY(T, n) ((T *)_memd_malloc_array(n, sizeof(T), MEMD_TYPED_SITE(T)))
+#define MEMD_DELETE(ptr) _memd_free(ptr, MEMD_SITE())
+#define MEMD_DELETE_ARRAY(ptr, n) _memd_free(ptr, MEMD_SITE())
+#endif
+
+#endif // MEMD_IMPLEMENTATION
+
+#else // USE_MEMD not defined
+
+/** 
+ * Defines no-operation versions of MEMD functions when MEMD is disabled.
+ */
+#define memd_report() ((void*)0)
+#define memd_report_free(char) ((void)0)
+#define memd_pause() ((void)0)
+#define memd_resume() ((void)0)
+#define memd_pool_create(name) ((MEMD_Pool*)0)
+#define memd_pool_alloc_notify(pool, ptr, size) ((void)0)
+#define memd_pool_free_notify(pool, ptr) ((void)0)
+#define memd_pool_reset(pool) ((void)0)
+#define memd_heap_dump(path) (-1)
+#define memd_report_save(path) (-1)
+#define memd_query(query) ((char*)0)
+#define memd_metrics_write(path) (-1)
+#define memd_suppressions_load(path) (0)
+#define memd_heap_root(start, size) ((void)0)
+#define memd_event_log_open(path) (-1)
+#define memd_event_log_close() (-1)
+#define memd_reset_peak() ((void)0)
+#define memd_control_open(path) (-1)
+#define memd_control_close() (-1)
+#define memd_reporter_start(config) (-1)
+#define memd_reporter_stop() (-1)
+#define memd_handle_open_notify(kind, value) ((void)0)
+#define memd_handle_close_notify(kind, value) ((void)0)
+
+/** 
+ * Without MEMD the batch functions are plain loops.
+ */
+static inline size_t memd_malloc_batch(size_t n, size_t size, void **out) {
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) {
+        out[i] = malloc(size);
+        if (out[i] != NULL)
+            count++;
+    }
+    return count;
+}
+
+static inline void memd_free_batch(void **ptrs, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        free(ptrs[i]);
+}
+
+/** 
+ * Without MEMD the typed allocation macros map to new and delete in C++ and
+ * to malloc and free in C.
+ */
+#ifdef __cplusplus
+#define MEMD_NEW(T) (new T)
+#define MEMD_NEW_ARRAY(T, n) (new T[n])
+#define MEMD_DELETE(ptr) (delete (ptr))
+#define MEMD_DELETE_ARRAY(ptr, n) (delete[] (ptr))
+#else
+#define MEMD_NEW(T) ((T *)malloc(sizeof(T)))
+#define MEMD_NEW_ARRAY(T, n) ((T *)malloc(sizeof(T) * (n)))
+#define MEMD_DELETE(ptr) free(ptr)
+#define MEMD_DELETE_ARRAY(ptr, n) free(ptr)
+#endif
+
+#ifdef __cplusplus
+namespace memd {
+/** 
+ * Without MEMD the tracking allocator collapses to the underlying allocator.
+ */
+template <typename T, typename Tag, typename Alloc = std::allocator<T> >
+using tracking_allocator = typename std::allocator_traits<Alloc>::template rebind_alloc<T>;
+
+#ifdef MEMD_HAS_PMR
+/** 
+ * Without MEMD the tracking resource only forwards to its upstream resource.
+ */
+class tracking_resource : public std::pmr::memory_resource {
+public:
+    explicit tracking_resource(const char *,
+                               std::pmr::memory_resource *upstream = std::pmr::get_default_resource())
+        : upstream_(upstream) {}
+
+    std::pmr::memory_resource *upstream_resource() const { return upstream_; }
+    size_t live_bytes() const { return 0; }
+    size_t peak_bytes() const { return 0; }
+
+protected:
+    void *do_allocate(size_t bytes, size_t alignment) override { return upstream_->allocate(bytes, alignment); }
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override { upstream_->deallocate(p, bytes, alignment); }
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override { return this == &other; }
+
+private:
+    std::pmr::memory_resource *upstream_;
+};
+#endif // MEMD_HAS_PMR
+} // namespace memd
+#endif // __cplusplus
+
+#endif // USE_MEMD
+
+#ifdef MEMD_IMPLEMENTATION
+
+// The arena gets its chunks from the C library directly, so the parentheses
+// keep MEMD's malloc and free macros from expanding.
+
+/** 
+ * Rounds size up to MEMD_ARENA_ALIGNMENT.
+ */
+static inline size_t _memd_arena_align(size_t size) {
+    return (size + (MEMD_ARENA_ALIGNMENT - 1)) & ~(size_t)(MEMD_ARENA_ALIGNMENT - 1);
+}
+
+/** 
+ * Returns the first usable byte of an arena chunk.
+ */
+static inline char *_memd_arena_data(MEMD_ArenaChunk *chunk) {
+    return (char *)chunk + _memd_arena_align(sizeof(MEMD_ArenaChunk));
+}
+
+MEMD_Arena *memd_arena_create(const char *name, size_t chunk_size) {
+    MEMD_Arena *arena = (MEMD_Arena *)(calloc)(1, sizeof(MEMD_Arena));
+    if (arena == NULL)
+        return NULL;
+
+    arena->name = name;
+    arena->chunk_size = _memd_arena_align(chunk_size > 0 ? chunk_size : 64 * 1024);
+#ifdef USE_MEMD
+    MEMD_LOCK();
+    arena->next = MEMD_Data.arenas;
+    MEMD_Data.arenas = arena;
+    MEMD_UNLOCK();
+#endif
+    return arena;
+}
+
+#ifdef USE_MEMD
+/** 
+ * Counts the live blocks of an arena as freed at their call sites. Called
+ * with the MEMD lock held.
+ */
+static void _memd_arena_release(MEMD_Arena *arena) {
+    for (size_t i = 0; i < arena->site_count; i++) {
+        MEMD_ArenaSite *entry = &arena->sites[i];
+        MEMD_Data.total_free_size += entry->live_size;
+        MEMD_Data.free_count += entry->live_count;
+        entry->site->free_count += entry->live_count;
+        entry->site->free_size += entry->live_size;
+    }
+    arena->site_count = 0;
+}
+#endif // USE_MEMD
+
+/** 
+ * Bumps size aligned bytes from the arena, adding a chunk if needed.
+ */
+static void *_memd_arena_bump(MEMD_Arena *arena, size_t size) {
+    // bump from the current chunk, or move on to the next chunk that fits
+    MEMD_ArenaChunk *chunk = arena->current;
+    while (chunk != NULL && chunk->size - chunk->used < size)
+        chunk = chunk->next;
+
+    if (chunk == NULL) {
+        size_t chunk_size = size > arena->chunk_size ? size : arena->chunk_size;
+        chunk = (MEMD_ArenaChunk *)(malloc)(_memd_arena_align(sizeof(MEMD_ArenaChunk)) + chunk_size);
+        if (chunk == NULL)
+            return NULL;
+
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        // link the new chunk right after the current one
+        if (arena->current != NULL) {
+            chunk->next = arena->current->next;
+            arena->current->next = chunk;
+        } else {
+            chunk->next = arena->first;
+            arena->first = chunk;
+        }
+        arena->chunk_count++;
+        arena->reserved_size += chunk_size;
+    }
+    arena->current = chunk;
+
+    void *ptr = _memd_arena_data(chunk) + chunk->used;
+    chunk->used += size;
+    arena->used_size += size;
+    if (arena->used_size > arena->peak_size)
+        arena->peak_size = arena->used_size;
+    arena->alloc_count++;
+    return ptr;
+}
+
+void *(memd_arena_alloc)(MEMD_Arena *arena, size_t size) {
+    size = _memd_arena_align(size > 0 ? size : 1);
+#ifdef USE_MEMD
+    // reports read the statistics of the arena under the lock
+    MEMD_LOCK();
+    void *ptr = _memd_arena_bump(arena, size);
+    MEMD_UNLOCK();
+    return ptr;
+#else
+    return _memd_arena_bump(arena, size);
+#endif
+}
+
+void memd_arena_reset(MEMD_Arena *arena) {
+#ifdef USE_MEMD
+    MEMD_LOCK();
+    _memd_arena_release(arena);
+#endif
+    for (MEMD_ArenaChunk *chunk = arena->first; chunk != NULL; chunk = chunk->next) {
+#ifdef MEMD_ARENA_POISON
+        memset(_memd_arena_data(chunk), MEMD_ARENA_POISON, chunk->used);
+#endif
+        chunk->used = 0;
+    }
+    arena->current = arena->first;
+    arena->used_size = 0;
+    arena->reset_count++;
+#ifdef USE_MEMD
+    MEMD_UNLOCK();
+#endif
+}
+
+void memd_arena_destroy(MEMD_Arena *arena) {
+#ifdef USE_MEMD
+    MEMD_LOCK();
+    _memd_arena_release(arena);
+    for (MEMD_Arena **link = &MEMD_Data.arenas; *link != NULL; link = &(*link)->next) {
+        if (*link == arena) {
+            *link = arena->next;
+            break;
+        }
+    }
+    MEMD_UNLOCK();
+#endif
+    MEMD_ArenaChunk *chunk = arena->first;
+    while (chunk != NULL) {
+        MEMD_ArenaChunk *next = chunk->next;
+        (free)(chunk);
+        chunk = next;
+    }
+    (free)(arena->sites);
+    (free)(arena);
+}
+
+#ifdef USE_MEMD
+/** 
+ * Allocates from an arena and counts the block at the given call site. The
+ * sites are searched linearly, arenas are usually filled from a few sites.
+ */
+void *_memd_arena_alloc(MEMD_Arena *arena, size_t size, MEMD_Site *site) {
+    MEMD_LOCK();
+    void *ptr = (memd_arena_alloc)(arena, size);
+    if (ptr != NULL && _memd_ignore != 1) {
+        MEMD_ArenaSite *entry = NULL;
+        for (size_t i = arena->site_count; i-- > 0 && entry == NULL; ) {
+            if (arena->sites[i].site == site)
+                entry = &arena->sites[i];
+        }
+        if (entry == NULL && arena->site_count == arena->site_capacity) {
+            size_t capacity = arena->site_capacity > 0 ? arena->site_capacity * 2 : 4;
+            MEMD_ArenaSite *sites = (MEMD_ArenaSite *)(realloc)(arena->sites, capacity * sizeof(MEMD_ArenaSite));
+            if (sites != NULL) {
+                arena->sites = sites;
+                arena->site_capacity = capacity;
+            }
+        }
+        if (entry == NULL && arena->site_count < arena->site_capacity) {
+            entry = &arena->sites[arena->site_count++];
+            entry->site = site;
+            entry->live_count = 0;
+            entry->live_size = 0;
+        }
+        if (entry != NULL) {
+            entry->live_count++;
+            entry->live_size += size;
+            MEMD_Data.total_allocated_size += size;
+            MEMD_Data.alloc_count++;
+            _memd_update_peak();
+            site->alloc_count++;
+            site->allocated_size += size;
+        } else {
+            WARN("Arena block could not be counted", site);
+        }
+    }
+    MEMD_UNLOCK();
+    return ptr;
+}
+#endif // USE_MEMD
+
+#endif // MEMD_IMPLEMENTATION
 
 #endif // __MEMD_H__
\ No newline at end of file
@@ -0,0 +1,447 @@
+/**
+ * memd_diff: compares two MEMD reports saved with memd_report_save.
+ *
+ * Sites of the baseline and candidate runs are matched by file name and
+ * function. A site keeps its match when its line moved, as long as it moved
+ * less than the drift window. The tool lists sites that leak in the
+ * candidate but not in the baseline, and sites whose live bytes or blocks
+ * grew. It exits with 1 if there are any, so it can gate merges.
+ *
+ * Build: gcc -std=c99 -O2 tools/memd_diff.c -o memd_diff
+ * Usage: memd_diff [-l lines] [-b bytes] baseline candidate
+ */
+#include "../memd.h"
+
+/**
+ * Struct to represent a site of a saved report.
+ */
+typedef struct {
+    const char *file;    /**< Base name of the source file. */
+    const char *path;    /**< The source file as saved. */
+    const char *func;    /**< The function, "-" if unknown. */
+    uint32_t line;       /**< The source line. */
+    uint64_t live_count; /**< Blocks allocated and not freed. */
+    uint64_t live_size;  /**< Bytes allocated and not freed. */
+    uint64_t hash;       /**< Hash of file and func. */
+    int64_t match;       /**< Index of the matched baseline site, or -1. */
+} DiffSite;
+
+/**
+ * Struct to represent a saved report.
+ */
+typedef struct {
+    char *text;       /**< Contents of the file, split into fields in place. */
+    DiffSite *sites;  /**< Sites in file order. */
+    uint32_t count;   /**< Number of sites. */
+} DiffReport;
+
+/**
+ * Prints an error and exits.
+ */
+static void diff_fail(const char *message, const char *detail) {
+    fprintf(stderr, "memd_diff: %s%s%s\n", message, detail ? ": " : "", detail ? detail : "");
+    exit(2);
+}
+
+/**
+ * Allocates count elements of size bytes, exiting when out of memory.
+ */
+static void *diff_alloc(size_t count, size_t size) {
+    void *p = calloc(count > 0 ? count : 1, size);
+    if (p == NULL)
+        diff_fail("out of memory", NULL);
+    return p;
+}
+
+/**
+ * FNV-1a hash of a string, continuing from hash.
+ */
+static uint64_t diff_hash(uint64_t hash, const char *text) {
+    for (; *text != '\0'; text++)
+        hash = (hash ^ (unsigned char)*text) * 1099511628211ull;
+    return (hash ^ 0xff) * 1099511628211ull;
+}
+
+/**
+ * Splits the next tab separated field off the line at *cursor.
+ * @return The field, terminated.
+ */
+static char *diff_field(char **cursor) {
+    char *field = *cursor;
+    char *end = field;
+    while (*end != '\t' && *end != '\0')
+        end++;
+    *cursor = *end != '\0' ? end + 1 : end;
+    *end = '\0';
+    return field;
+}
+
+/**
+ * Reads a saved report. Lines starting with # are skipped.
+ */
+static void diff_load(DiffReport *report, const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        diff_fail("cannot open", path);
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (length < 0)
+        diff_fail("cannot read", path);
+    report->text = (char *)diff_alloc((size_t)length + 1, 1);
+    if (fread(report->text, 1, (size_t)length, file) != (size_t)length)
+        diff_fail("cannot read", path);
+    fclose(file);
+    if (strncmp(report->text, "# MEMD report 1", 15) != 0)
+        diff_fail("not a saved MEMD report", path);
+
+    uint32_t lines = 0;
+    for (long i = 0; i < length; i++)
+        lines += report->text[i] == '\n';
+    report->sites = (DiffSite *)diff_alloc(lines + 1, sizeof(DiffSite));
+
+    char *next = report->text;
+    while (*next != '\0') {
+        char *cursor = next;
+        char *end = strchr(cursor, '\n');
+        if (end != NULL) {
+            *end = '\0';
+            next = end + 1;
+        } else {
+            next = cursor + strlen(cursor);
+        }
+        if (*cursor == '#' || *cursor == '\0' || *cursor == '\r')
+            continue;
+
+        DiffSite *site = &report->sites[report->count++];
+        site->path = diff_field(&cursor);
+        site->line = (uint32_t)strtoul(diff_field(&cursor), NULL, 10);
+        site->func = diff_field(&cursor);
+        diff_field(&cursor); // type
+        diff_field(&cursor); // tag
+        uint64_t allocs = strtoull(diff_field(&cursor), NULL, 10);
+        uint64_t frees = strtoull(diff_field(&cursor), NULL, 10);
+        uint64_t allocated = strtoull(diff_field(&cursor), NULL, 10);
+        uint64_t freed = strtoull(diff_field(&cursor), NULL, 10);
+
+        // build directories differ between runs, so only the base name counts
+        site->file = site->path;
+        for (const char *c = site->path; *c != '\0'; c++) {
+            if (*c == '/' || *c == '\\')
+                site->file = c + 1;
+        }
+        site->live_count = allocs - frees;
+        site->live_size = allocated - freed;
+        site->hash = diff_hash(diff_hash(14695981039346656037ull, site->file), site->func);
+        site->match = -1;
+    }
+}
+
+static const DiffReport *diff_sorting;
+
+/**
+ * Orders baseline sites by file, function and line.
+ */
+static int diff_compare_site(const void *a, const void *b) {
+    const DiffSite *x = &diff_sorting->sites[*(const uint32_t *)a];
+    const DiffSite *y = &diff_sorting->sites[*(const uint32_t *)b];
+    if (x->hash != y->hash)
+        return x->hash < y->hash ? -1 : 1;
+    int order = strcmp(x->file, y->file);
+    if (order == 0)
+        order = strcmp(x->func, y->func);
+    if (order == 0)
+        order = x->line < y->line ? -1 : x->line > y->line;
+    return order;
+}
+
+/**
+ * Baseline sites sorted into groups of the same file and function, with an
+ * open addressing hash table from file and function to each group.
+ */
+static struct {
+    uint32_t *order;     /**< Baseline site indices sorted by diff_compare_site. */
+    uint32_t *slots;     /**< Hash table of group starts + 1, 0 for empty slots. */
+    uint32_t *ends;      /**< End of the group starting at each position of order. */
+    size_t mask;         /**< Size of the hash table - 1. */
+} groups;
+
+/**
+ * Sorts and hashes the baseline sites.
+ */
+static void diff_index(const DiffReport *base) {
+    groups.order = (uint32_t *)diff_alloc(base->count, sizeof(uint32_t));
+    groups.ends = (uint32_t *)diff_alloc(base->count, sizeof(uint32_t));
+    for (uint32_t i = 0; i < base->count; i++)
+        groups.order[i] = i;
+    diff_sorting = base;
+    qsort(groups.order, base->count, sizeof(uint32_t), diff_compare_site);
+
+    size_t capacity = 16;
+    while (capacity < (size_t)base->count * 2)
+        capacity *= 2;
+    groups.mask = capacity - 1;
+    groups.slots = (uint32_t *)diff_alloc(capacity, sizeof(uint32_t));
+
+    uint32_t start = 0;
+    for (uint32_t i = 1; i <= base->count; i++) {
+        const DiffSite *first = &base->sites[groups.order[start]];
+        if (i < base->count) {
+            const DiffSite *site = &base->sites[groups.order[i]];
+            if (site->hash == first->hash && strcmp(site->file, first->file) == 0 && strcmp(site->func, first->func) == 0)
+                continue;
+        }
+        groups.ends[start] = i;
+        size_t slot = first->hash & groups.mask;
+        while (groups.slots[slot] != 0)
+            slot = (slot + 1) & groups.mask;
+        groups.slots[slot] = start + 1;
+        start = i;
+    }
+}
+
+/**
+ * Finds the group of baseline sites with the file and function of site.
+ * @return 1 and the group's range in order, or 0 if there is none.
+ */
+static int diff_group(const DiffReport *base, const DiffSite *site, uint32_t *begin, uint32_t *end) {
+    for (size_t slot = site->hash & groups.mask; groups.slots[slot] != 0; slot = (slot + 1) & groups.mask) {
+        uint32_t start = groups.slots[slot] - 1;
+        const DiffSite *first = &base->sites[groups.order[start]];
+        if (first->hash == site->hash && strcmp(first->file, site->file) == 0 && strcmp(first->func, site->func) == 0) {
+            *begin = start;
+            *end = groups.ends[start];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Aligns the baseline sites order[begin, end) with the candidate sites
+ * cands[0, count), both sorted by line. Edits move lines but keep the order of
+ * the sites in a function, so the alignment keeps the order too. It matches
+ * as many sites as possible that moved at most drift lines, then prefers the
+ * matches that moved the least. Huge groups are matched greedily in order.
+ */
+static void diff_align(const DiffReport *base, DiffReport *candidate, uint32_t begin, uint32_t end,
+                       const uint32_t *cands, uint32_t count, uint32_t drift) {
+    static int64_t *table;
+    static size_t table_size;
+    uint32_t rows = end - begin;
+    size_t width = (size_t)count + 1;
+    size_t cells = ((size_t)rows + 1) * width;
+
+#define DIFF_LINE(i) base->sites[groups.order[begin + (i)]].line
+#define DIFF_CAND(j) (&candidate->sites[cands[j]])
+#define DIFF_DISTANCE(i, j) (DIFF_LINE(i) > DIFF_CAND(j)->line ? DIFF_LINE(i) - DIFF_CAND(j)->line : DIFF_CAND(j)->line - DIFF_LINE(i))
+
+    if (cells > ((size_t)1 << 22)) {
+        uint32_t i = 0, j = 0;
+        while (i < rows && j < count) {
+            if (DIFF_DISTANCE(i, j) <= drift)
+                DIFF_CAND(j++)->match = groups.order[begin + i++];
+            else if (DIFF_LINE(i) < DIFF_CAND(j)->line)
+                i++;
+            else
+                j++;
+        }
+        return;
+    }
+
+    if (cells > table_size) {
+        free(table);
+        table_size = cells;
+        table = (int64_t *)diff_alloc(cells, sizeof(int64_t));
+    }
+    // each match scores far more than any displacement costs
+    const int64_t match_score = (int64_t)1 << 40;
+    for (uint32_t i = 0; i <= rows; i++) {
+        for (uint32_t j = 0; j <= count; j++) {
+            int64_t best = 0;
+            if (i > 0 && table[(i - 1) * width + j] > best)
+                best = table[(i - 1) * width + j];
+            if (j > 0 && table[i * width + j - 1] > best)
+                best = table[i * width + j - 1];
+            if (i > 0 && j > 0 && DIFF_DISTANCE(i - 1, j - 1) <= drift) {
+                int64_t score = table[(i - 1) * width + j - 1] + match_score - DIFF_DISTANCE(i - 1, j - 1);
+                if (score > best)
+                    best = score;
+            }
+            table[i * width + j] = best;
+        }
+    }
+
+    uint32_t i = rows, j = count;
+    while (i > 0 && j > 0) {
+        int64_t score = table[i * width + j];
+        if (DIFF_DISTANCE(i - 1, j - 1) <= drift &&
+            score == table[(i - 1) * width + j - 1] + match_score - DIFF_DISTANCE(i - 1, j - 1)) {
+            DIFF_CAND(j - 1)->match = groups.order[begin + i - 1];
+            i--;
+            j--;
+        } else if (score == table[(i - 1) * width + j]) {
+            i--;
+        } else {
+            j--;
+        }
+    }
+
+#undef DIFF_LINE
+#undef DIFF_CAND
+#undef DIFF_DISTANCE
+}
+
+static const DiffReport *diff_matching;
+
+/**
+ * Orders candidate site indices by baseline group, then by line.
+ */
+static int diff_compare_candidate(const void *a, const void *b) {
+    const DiffSite *x = &diff_matching->sites[*(const uint32_t *)a];
+    const DiffSite *y = &diff_matching->sites[*(const uint32_t *)b];
+    if (x->match != y->match)
+        return x->match < y->match ? -1 : 1;
+    return x->line < y->line ? -1 : x->line > y->line;
+}
+
+/**
+ * Matches the candidate sites to the baseline sites, group by group.
+ */
+static void diff_match(const DiffReport *base, DiffReport *candidate, uint32_t drift) {
+    uint32_t *cands = (uint32_t *)diff_alloc(candidate->count, sizeof(uint32_t));
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < candidate->count; i++) {
+        uint32_t begin, end;
+        // the group start is kept in match until the sites are aligned
+        if (diff_group(base, &candidate->sites[i], &begin, &end)) {
+            candidate->sites[i].match = begin;
+            cands[count++] = i;
+        }
+    }
+    diff_matching = candidate;
+    qsort(cands, count, sizeof(uint32_t), diff_compare_candidate);
+
+    for (uint32_t first = 0; first < count; ) {
+        uint32_t begin = (uint32_t)candidate->sites[cands[first]].match;
+        uint32_t last = first;
+        while (last < count && candidate->sites[cands[last]].match == begin)
+            candidate->sites[cands[last++]].match = -1;
+        diff_align(base, candidate, begin, groups.ends[begin], cands + first, last - first, drift);
+        first = last;
+    }
+    free(cands);
+}
+
+static const DiffReport *diff_base;
+static const DiffReport *diff_candidate;
+
+/**
+ * Growth of the live bytes of a candidate site over its baseline site.
+ */
+static int64_t diff_growth(const DiffSite *site) {
+    int64_t old = site->match >= 0 ? (int64_t)diff_base->sites[site->match].live_size : 0;
+    return (int64_t)site->live_size - old;
+}
+
+/**
+ * Orders candidate sites by descending growth of live bytes.
+ */
+static int diff_compare_growth(const void *a, const void *b) {
+    int64_t x = diff_growth(&diff_candidate->sites[*(const uint32_t *)a]);
+    int64_t y = diff_growth(&diff_candidate->sites[*(const uint32_t *)b]);
+    return x > y ? -1 : x < y;
+}
+
+/**
+ * Prints a site as file:line (func).
+ */
+static void diff_print_site(const DiffSite *site) {
+    printf("     %s:%u", site->path, site->line);
+    if (strcmp(site->func, "-") != 0)
+        printf(" (%s)", site->func);
+}
+
+int main(int argc, char **argv) {
+    uint32_t drift = 50;
+    uint64_t min_growth = 0;
+    const char *paths[2] = { NULL, NULL };
+    int path_count = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-l") == 0 && i + 1 < argc)
+            drift = (uint32_t)strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+            min_growth = strtoull(argv[++i], NULL, 10);
+        else if (path_count < 2)
+            paths[path_count++] = argv[i];
+        else
+            path_count = 3;
+    }
+    if (path_count != 2) {
+        fprintf(stderr, "usage: memd_diff [-l lines] [-b bytes] baseline candidate\n");
+        return 2;
+    }
+
+    DiffReport base, candidate;
+    memset(&base, 0, sizeof(base));
+    memset(&candidate, 0, sizeof(candidate));
+    diff_load(&base, paths[0]);
+    diff_load(&candidate, paths[1]);
+    diff_base = &base;
+    diff_candidate = &candidate;
+    diff_index(&base);
+
+    diff_match(&base, &candidate, drift);
+
+    uint32_t *leaks = (uint32_t *)diff_alloc(candidate.count, sizeof(uint32_t));
+    uint32_t *grown = (uint32_t *)diff_alloc(candidate.count, sizeof(uint32_t));
+    uint32_t leak_count = 0, grown_count = 0;
+    for (uint32_t i = 0; i < candidate.count; i++) {
+        const DiffSite *site = &candidate.sites[i];
+        const DiffSite *old = site->match >= 0 ? &base.sites[site->match] : NULL;
+        if (site->live_count == 0)
+            continue;
+        if (old == NULL || old->live_count == 0)
+            leaks[leak_count++] = i;
+        else if ((site->live_size > old->live_size && site->live_size - old->live_size > min_growth) ||
+                 (site->live_count > old->live_count && min_growth == 0))
+            grown[grown_count++] = i;
+    }
+    qsort(leaks, leak_count, sizeof(uint32_t), diff_compare_growth);
+    qsort(grown, grown_count, sizeof(uint32_t), diff_compare_growth);
+
+    printf("\n----------------------------------\n");
+    printf("MEMD Report Diff:\n");
+    printf("----------------------------------\n\n");
+    printf("   Baseline  %s (%u sites)\n", paths[0], base.count);
+    printf("   Candidate %s (%u sites)\n", paths[1], candidate.count);
+
+    if (leak_count > 0) {
+        printf("\n   New Leaks:\n");
+        for (uint32_t i = 0; i < leak_count; i++) {
+            const DiffSite *site = &candidate.sites[leaks[i]];
+            diff_print_site(site);
+            printf(": %llu blocks, %llu bytes\n", (unsigned long long)site->live_count, (unsigned long long)site->live_size);
+        }
+    }
+
+    if (grown_count > 0) {
+        printf("\n   Growth:\n");
+        for (uint32_t i = 0; i < grown_count; i++) {
+            const DiffSite *site = &candidate.sites[grown[i]];
+            const DiffSite *old = &base.sites[site->match];
+            diff_print_site(site);
+            if (old->line != site->line)
+                printf(" [was line %u]", old->line);
+            printf(": %+lld blocks, %+lld bytes (%llu -> %llu bytes)\n",
+                (long long)site->live_count - (long long)old->live_count,
+                (long long)diff_growth(site),
+                (unsigned long long)old->live_size,
+                (unsigned long long)site->live_size);
+        }
+    }
+
+    printf("\n   %u new leaks, %u sites grew\n", leak_count, grown_count);
+    printf("\n----------------------------------\n");
+    return leak_count > 0 || grown_count > 0 ? 1 : 0;
+}
@@ -0,0 +1,509 @@
+/**
+ * memd_events: decoder and replay of MEMD event logs.
+ *
+ * Reads a log written between memd_event_log_open and memd_event_log_close.
+ * The chunks of each thread are decoded as streams and merged by sequence
+ * number, so the events come out in the order the program made them while
+ * only one chunk per thread is held in memory. By default every event is
+ * printed; -s replays the log instead and prints the peak and final live
+ * heap, the encoded size per event and the busiest allocation sites.
+ *
+ * Build: gcc -std=c99 -O2 tools/memd_events.c -o memd_events
+ * Usage: memd_events [-s] [-n top] log
+ */
+#include "../memd.h"
+
+/**
+ * Struct to represent a call site read from the log.
+ */
+typedef struct {
+    uint32_t line;           /**< The source line of the site. */
+    char *file;              /**< The source file. */
+    char *func;              /**< The function, or NULL. */
+    uint64_t alloc_count;    /**< Allocations replayed at the site. */
+    uint64_t allocated_size; /**< Bytes allocated at the site. */
+} EventsSite;
+
+/**
+ * Location of an EVNT chunk in the log.
+ */
+typedef struct {
+    long offset;     /**< Offset of the chunk's payload. */
+    uint64_t length; /**< Bytes of payload. */
+    uint32_t count;  /**< Number of events. */
+} EventsChunk;
+
+/**
+ * The chunks of one thread and the position of its stream.
+ */
+typedef struct {
+    EventsChunk *chunks;     /**< Chunks of the thread in file order. */
+    uint32_t chunk_count;    /**< Number of chunks. */
+    uint32_t chunk_capacity; /**< Allocated chunk entries. */
+    uint32_t next_chunk;     /**< Next chunk to load. */
+    unsigned char *buffer;   /**< Payload of the loaded chunk. */
+    size_t buffer_size;      /**< Allocated bytes of buffer. */
+    MEMD_EventReader reader; /**< Decoder of the loaded chunk. */
+    MEMD_Event event;        /**< Next event of the stream. */
+} EventsThread;
+
+/**
+ * Live block of the replay.
+ */
+typedef struct {
+    uint64_t address; /**< Address of the block, 0 for an empty slot. */
+    uint64_t size;    /**< Size of the block. */
+} EventsBlock;
+
+/**
+ * The log and the replay state.
+ */
+static struct {
+    FILE *file;                /**< The log file. */
+    const char *path;          /**< Path of the log. */
+    EventsSite *sites;         /**< Sites, indexed by id. */
+    uint32_t site_limit;       /**< Highest site id + 1. */
+    EventsThread *threads;     /**< Streams, indexed by thread number - 1. */
+    uint32_t thread_count;     /**< Number of threads. */
+    uint32_t *heap;            /**< Threads with events left, by next sequence number. */
+    uint32_t heap_count;       /**< Number of threads in the heap. */
+    uint64_t event_count;      /**< Events in the log. */
+    uint64_t encoded_size;     /**< Bytes of encoded events, without chunk headers. */
+    EventsBlock *blocks;       /**< Open-addressing table of live blocks. */
+    uint64_t block_capacity;   /**< Slots of the table, a power of 2. */
+    uint64_t live_count;       /**< Live blocks. */
+    uint64_t live_size;        /**< Live bytes. */
+    uint64_t peak_size;        /**< Most live bytes. */
+    uint64_t peak_count;       /**< Live blocks at the peak. */
+    uint64_t peak_sequence;    /**< Event at the peak. */
+    uint64_t alloc_count;      /**< Allocations replayed. */
+    uint64_t free_count;       /**< Frees replayed. */
+    uint64_t unknown_frees;    /**< Frees of blocks the log never allocated. */
+} events;
+
+/**
+ * Prints an error and exits.
+ */
+static void events_fail(const char *message, const char *detail) {
+    fprintf(stderr, "memd_events: %s%s%s\n", message, detail ? ": " : "", detail ? detail : "");
+    exit(1);
+}
+
+/**
+ * Allocates count elements of size bytes, exiting when out of memory.
+ */
+static void *events_alloc(size_t count, size_t size) {
+    void *p = calloc(count > 0 ? count : 1, size);
+    if (p == NULL)
+        events_fail("out of memory", NULL);
+    return p;
+}
+
+/**
+ * Formats a size in bytes, using KB, MB or GB with one decimal above 1 KB.
+ */
+static void events_format_size(char *out, size_t capacity, uint64_t size) {
+    static const char *units[] = { "KB", "MB", "GB" };
+    double value = (double)size;
+    int unit = -1;
+    while (value >= 1024.0 && unit < 2) {
+        value /= 1024.0;
+        unit++;
+    }
+    if (unit < 0)
+        snprintf(out, capacity, "%llu bytes", (unsigned long long)size);
+    else
+        snprintf(out, capacity, "%.1f %s", value, units[unit]);
+}
+
+/**
+ * Reads exactly length bytes, exiting on a short read.
+ */
+static void events_read(void *out, size_t length) {
+    if (length > 0 && fread(out, 1, length, events.file) != length)
+        events_fail("truncated log", events.path);
+}
+
+/**
+ * Copies a string of the site chunk into its own buffer.
+ */
+static char *events_string(const unsigned char *data, uint32_t length) {
+    char *text = (char *)events_alloc((size_t)length + 1, 1);
+    memcpy(text, data, length);
+    return text;
+}
+
+/**
+ * Reads the sites of a SITE chunk.
+ */
+static void events_load_sites(const MEMD_DumpChunk *chunk) {
+    unsigned char *data = (unsigned char *)events_alloc((size_t)chunk->length, 1);
+    events_read(data, (size_t)chunk->length);
+
+    // the first pass finds the highest id, the second one reads the sites
+    for (int pass = 0; pass < 2; pass++) {
+        size_t at = 0;
+        for (uint32_t i = 0; i < chunk->count; i++) {
+            const unsigned char *record = data + at;
+            size_t left = (size_t)chunk->length - at;
+            MEMD_DumpSite site;
+            if (left < sizeof(site))
+                events_fail("truncated log", events.path);
+            memcpy(&site, record, sizeof(site));
+            // the strings must fit in the chunk too before they are copied
+            uint64_t strings_length = (uint64_t)site.file_length + site.func_length + site.type_length + site.tag_length;
+            if (strings_length > left - sizeof(site))
+                events_fail("truncated log", events.path);
+            size_t length = sizeof(site) + (size_t)strings_length;
+            // the limit is one past the highest id, so the last id can't be used
+            if (site.id == UINT32_MAX)
+                events_fail("bad site id in log", events.path);
+            if (pass == 0 && site.id >= events.site_limit)
+                events.site_limit = site.id + 1;
+            if (pass == 1 && site.id < events.site_limit) {
+                EventsSite *s = &events.sites[site.id];
+                const unsigned char *strings = record + sizeof(site);
+                s->line = site.line;
+                s->file = events_string(strings, site.file_length);
+                s->func = site.func_length > 0 ? events_string(strings + site.file_length, site.func_length) : NULL;
+            }
+            // the padding of the last record may be missing
+            size_t padded = (length + 7) / 8 * 8;
+            at += padded < left ? padded : left;
+        }
+        if (pass == 0)
+            events.sites = (EventsSite *)events_alloc(events.site_limit, sizeof(EventsSite));
+    }
+    free(data);
+}
+
+/**
+ * Reads the chunk headers of the log, indexing the event chunks by thread
+ * and loading the sites. Event payloads are skipped.
+ */
+static void events_index(const char *path) {
+    events.path = path;
+    events.file = fopen(path, "rb");
+    if (events.file == NULL)
+        events_fail("cannot open", path);
+
+    MEMD_DumpHeader header;
+    if (fread(&header, sizeof(header), 1, events.file) != 1 ||
+        memcmp(header.magic, MEMD_EVENT_MAGIC, sizeof(header.magic)) != 0)
+        events_fail("not a MEMD event log", path);
+    if (header.version != MEMD_EVENT_VERSION || header.byte_order != MEMD_DUMP_BYTE_ORDER)
+        events_fail("unsupported log version or byte order", path);
+
+    uint32_t thread_capacity = 0;
+    MEMD_DumpChunk chunk;
+    while (fread(&chunk, sizeof(chunk), 1, events.file) == 1) {
+        if (memcmp(chunk.type, MEMD_DUMP_END, 4) == 0)
+            return;
+        if (memcmp(chunk.type, MEMD_DUMP_SITES, 4) == 0) {
+            events_load_sites(&chunk);
+            continue;
+        }
+        long offset = ftell(events.file);
+        if (memcmp(chunk.type, MEMD_EVENT_EVENTS, 4) == 0) {
+            MEMD_EventBase base;
+            if (chunk.length < sizeof(base))
+                events_fail("malformed chunk", path);
+            events_read(&base, sizeof(base));
+            if (base.thread == 0)
+                events_fail("malformed chunk", path);
+
+            if (base.thread > thread_capacity) {
+                uint32_t capacity = thread_capacity > 0 ? thread_capacity : 16;
+                while (capacity < base.thread)
+                    capacity *= 2;
+                events.threads = (EventsThread *)realloc(events.threads, capacity * sizeof(EventsThread));
+                if (events.threads == NULL)
+                    events_fail("out of memory", NULL);
+                memset(events.threads + thread_capacity, 0, (capacity - thread_capacity) * sizeof(EventsThread));
+                thread_capacity = capacity;
+            }
+            if (base.thread > events.thread_count)
+                events.thread_count = base.thread;
+
+            EventsThread *thread = &events.threads[base.thread - 1];
+            if (thread->chunk_count == thread->chunk_capacity) {
+                thread->chunk_capacity = thread->chunk_capacity > 0 ? thread->chunk_capacity * 2 : 16;
+                thread->chunks = (EventsChunk *)realloc(thread->chunks, thread->chunk_capacity * sizeof(EventsChunk));
+                if (thread->chunks == NULL)
+                    events_fail("out of memory", NULL);
+            }
+            EventsChunk *entry = &thread->chunks[thread->chunk_count++];
+            entry->offset = offset;
+            entry->length = chunk.length;
+            entry->count = chunk.count;
+            events.event_count += chunk.count;
+            events.encoded_size += chunk.length - sizeof(base);
+        }
+        if (fseek(events.file, offset + (long)chunk.length, SEEK_SET) != 0)
+            events_fail("truncated log", path);
+    }
+    events_fail("truncated log, was memd_event_log_close called?", path);
+}
+
+/**
+ * Decodes the next event of a thread into thread->event, loading its next
+ * chunk when the current one is done.
+ * @return 1 if there is an event, 0 if the thread has no events left.
+ */
+static int events_advance(EventsThread *thread) {
+    for (;;) {
+        int result = memd_event_next(&thread->reader, &thread->event);
+        if (result < 0)
+            events_fail("malformed chunk", events.path);
+        if (result > 0)
+            return 1;
+        if (thread->next_chunk == thread->chunk_count)
+            return 0;
+
+        const EventsChunk *chunk = &thread->chunks[thread->next_chunk++];
+        if (chunk->length > thread->buffer_size) {
+            free(thread->buffer);
+            thread->buffer_size = (size_t)chunk->length;
+            thread->buffer = (unsigned char *)events_alloc(thread->buffer_size, 1);
+        }
+        if (fseek(events.file, chunk->offset, SEEK_SET) != 0)
+            events_fail("truncated log", events.path);
+        events_read(thread->buffer, (size_t)chunk->length);
+        memd_event_reader_init(&thread->reader, thread->buffer, chunk->length, chunk->count);
+    }
+}
+
+/**
+ * Checks whether thread a has an earlier next event than thread b.
+ */
+static int events_before(uint32_t a, uint32_t b) {
+    return events.threads[a].event.sequence < events.threads[b].event.sequence;
+}
+
+/**
+ * Restores the heap order below index.
+ */
+static void events_sift_down(uint32_t index) {
+    for (;;) {
+        uint32_t first = index, child = 2 * index + 1;
+        if (child < events.heap_count && events_before(events.heap[child], events.heap[first]))
+            first = child;
+        if (child + 1 < events.heap_count && events_before(events.heap[child + 1], events.heap[first]))
+            first = child + 1;
+        if (first == index)
+            return;
+        uint32_t swap = events.heap[index];
+        events.heap[index] = events.heap[first];
+        events.heap[first] = swap;
+        index = first;
+    }
+}
+
+/**
+ * Starts the streams of all threads.
+ */
+static void events_start() {
+    events.heap = (uint32_t *)events_alloc(events.thread_count, sizeof(uint32_t));
+    for (uint32_t t = 0; t < events.thread_count; t++) {
+        if (events_advance(&events.threads[t]))
+            events.heap[events.heap_count++] = t;
+    }
+    for (uint32_t i = events.heap_count / 2; i-- > 0; )
+        events_sift_down(i);
+}
+
+/**
+ * Takes the next event of all threads in sequence order.
+ * @return 1 if there is an event, 0 at the end of the log.
+ */
+static int events_next(MEMD_Event *event) {
+    if (events.heap_count == 0)
+        return 0;
+    EventsThread *thread = &events.threads[events.heap[0]];
+    *event = thread->event;
+    if (!events_advance(thread))
+        events.heap[0] = events.heap[--events.heap_count];
+    events_sift_down(0);
+    return 1;
+}
+
+/**
+ * Finds the slot of a live block, or the empty slot it would go to.
+ */
+static EventsBlock *events_slot(uint64_t address) {
+    uint64_t hash = address >> 4;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    for (uint64_t i = hash & (events.block_capacity - 1); ; i = (i + 1) & (events.block_capacity - 1)) {
+        if (events.blocks[i].address == 0 || events.blocks[i].address == address)
+            return &events.blocks[i];
+    }
+}
+
+/**
+ * Removes a live block, moving later blocks of its run back into the gap.
+ */
+static void events_remove(EventsBlock *slot) {
+    uint64_t mask = events.block_capacity - 1;
+    uint64_t gap = (uint64_t)(slot - events.blocks);
+    events.blocks[gap].address = 0;
+    for (uint64_t i = (gap + 1) & mask; events.blocks[i].address != 0; i = (i + 1) & mask) {
+        EventsBlock block = events.blocks[i];
+        events.blocks[i].address = 0;
+        *events_slot(block.address) = block;
+    }
+}
+
+/**
+ * Applies an event to the live blocks and the site statistics.
+ */
+static void events_replay(const MEMD_Event *event) {
+    if (event->type == MEMD_EVENT_ALLOC) {
+        if (2 * (events.live_count + 1) > events.block_capacity) {
+            EventsBlock *old = events.blocks;
+            uint64_t old_capacity = events.block_capacity;
+            events.block_capacity = old_capacity > 0 ? old_capacity * 2 : 1024;
+            events.blocks = (EventsBlock *)events_alloc((size_t)events.block_capacity, sizeof(EventsBlock));
+            for (uint64_t i = 0; i < old_capacity; i++) {
+                if (old[i].address != 0)
+                    *events_slot(old[i].address) = old[i];
+            }
+            free(old);
+        }
+        EventsBlock *slot = events_slot(event->address);
+        if (slot->address == 0) {
+            events.live_count++;
+        } else {
+            events.live_size -= slot->size;
+        }
+        slot->address = event->address;
+        slot->size = event->size;
+        events.live_size += event->size;
+        events.alloc_count++;
+        if (event->site < events.site_limit) {
+            events.sites[event->site].alloc_count++;
+            events.sites[event->site].allocated_size += event->size;
+        }
+        if (events.live_size > events.peak_size) {
+            events.peak_size = events.live_size;
+            events.peak_count = events.live_count;
+            events.peak_sequence = event->sequence;
+        }
+    } else {
+        events.free_count++;
+        EventsBlock *slot = events.block_capacity > 0 ? events_slot(event->address) : NULL;
+        if (slot == NULL || slot->address == 0) {
+            events.unknown_frees++;
+            return;
+        }
+        events.live_count--;
+        events.live_size -= slot->size;
+        events_remove(slot);
+    }
+}
+
+/**
+ * Prints a site as file:line (func).
+ */
+static void events_print_site(uint32_t id) {
+    if (id < events.site_limit && events.sites[id].file != NULL) {
+        const EventsSite *site = &events.sites[id];
+        printf("%s:%u", site->file, site->line);
+        if (site->func != NULL)
+            printf(" (%s)", site->func);
+    } else {
+        printf("site %u", id);
+    }
+}
+
+/**
+ * Compares sites by bytes allocated, largest first.
+ */
+static int events_compare_sites(const void *a, const void *b) {
+    uint64_t x = events.sites[*(const uint32_t *)a].allocated_size;
+    uint64_t y = events.sites[*(const uint32_t *)b].allocated_size;
+    return x > y ? -1 : x < y;
+}
+
+/**
+ * Prints the replayed heap and the top allocation sites.
+ */
+static void events_summary(uint32_t top) {
+    char size[32];
+    printf("\n   Events: %llu (%llu allocations, %llu frees) from %u threads\n",
+        (unsigned long long)events.event_count,
+        (unsigned long long)events.alloc_count,
+        (unsigned long long)events.free_count,
+        events.thread_count);
+    printf("   Encoded: %.2f bytes per event\n",
+        events.event_count > 0 ? (double)events.encoded_size / (double)events.event_count : 0.0);
+    events_format_size(size, sizeof(size), events.peak_size);
+    printf("   Peak: %s live in %llu blocks at event %llu\n",
+        size, (unsigned long long)events.peak_count, (unsigned long long)events.peak_sequence);
+    events_format_size(size, sizeof(size), events.live_size);
+    printf("   End: %s live in %llu blocks\n", size, (unsigned long long)events.live_count);
+    if (events.unknown_frees > 0)
+        printf("   %llu frees of blocks allocated before the log was opened\n", (unsigned long long)events.unknown_frees);
+
+    uint32_t *order = (uint32_t *)events_alloc(events.site_limit, sizeof(uint32_t));
+    uint32_t count = 0;
+    for (uint32_t id = 0; id < events.site_limit; id++) {
+        if (events.sites[id].alloc_count > 0)
+            order[count++] = id;
+    }
+    qsort(order, count, sizeof(uint32_t), events_compare_sites);
+    if (count > 0)
+        printf("\n   Allocation Sites:\n");
+    for (uint32_t i = 0; i < count && i < top; i++) {
+        const EventsSite *site = &events.sites[order[i]];
+        events_format_size(size, sizeof(size), site->allocated_size);
+        printf("     ");
+        events_print_site(order[i]);
+        printf(": %llu allocations, %s\n", (unsigned long long)site->alloc_count, size);
+    }
+    printf("\n");
+    free(order);
+}
+
+int main(int argc, char **argv) {
+    uint32_t top = 20;
+    int summary = 0;
+    const char *path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0)
+            summary = 1;
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            top = (uint32_t)strtoul(argv[++i], NULL, 10);
+        else
+            path = argv[i];
+    }
+    if (path == NULL || top == 0) {
+        fprintf(stderr, "usage: memd_events [-s] [-n top] log\n");
+        return 2;
+    }
+
+    events_index(path);
+    events_start();
+    MEMD_Event event;
+    while (events_next(&event)) {
+        if (summary) {
+            events_replay(&event);
+            continue;
+        }
+        printf("%llu\tthread %u\t%s\t0x%llx",
+            (unsigned long long)event.sequence,
+            event.thread,
+            event.type == MEMD_EVENT_ALLOC ? "alloc" : "free",
+            (unsigned long long)event.address);
+        if (event.type == MEMD_EVENT_ALLOC) {
+            printf("\t%llu\t", (unsigned long long)event.size);
+            events_print_site(event.site);
+        }
+        printf("\n");
+    }
+    if (summary)
+        events_summary(top);
+    fclose(events.file);
+    return 0;
+}
@@ -0,0 +1,741 @@
+/**
+ * memd_retain: retained-size analysis of MEMD heap dumps.
+ *
+ * Reads a dump written by memd_heap_dump, builds the conservative pointer graph
+ * of its blocks and computes the dominator tree with the semi-NCA algorithm.
+ * A block retains everything it dominates, which is the memory freed if the
+ * block were freed. The blocks retaining the most memory are listed, each with
+ * a shortest path from the roots. Blocks no root reaches are leaked; they are
+ * attached to the roots through the blocks nothing else points to.
+ *
+ * Build: gcc -std=c99 -O2 tools/memd_retain.c -o memd_retain -lpthread
+ * Usage: memd_retain [-n top] [-j threads] dump
+ */
+#include "../memd.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+/**
+ * Struct to represent a call site read from the dump.
+ */
+typedef struct {
+    uint32_t line;           /**< The source line of the site. */
+    const char *file;        /**< The source file, not terminated. */
+    const char *func;        /**< The function, not terminated. */
+    const char *type;        /**< Type name of MEMD_NEW sites, not terminated. */
+    uint32_t file_length;    /**< Length of file. */
+    uint32_t func_length;    /**< Length of func, 0 if unknown. */
+    uint32_t type_length;    /**< Length of type, 0 if untyped. */
+} RetainSite;
+
+/**
+ * Struct to represent a block read from the dump. Node 0 is the virtual root
+ * holding the roots, the blocks follow sorted by address.
+ */
+typedef struct {
+    uint64_t address;            /**< Address of the block. */
+    uint64_t size;               /**< Size of the block. */
+    uint64_t stored;             /**< Bytes of contents in the dump. */
+    const unsigned char *data;   /**< Contents of the block in the dump. */
+    const RetainSite *site;      /**< Call site of the block, or NULL. */
+} RetainNode;
+
+/**
+ * Struct to represent a root range read from the dump.
+ */
+typedef struct {
+    uint64_t address;            /**< Address of the range. */
+    uint64_t size;               /**< Bytes of contents in the dump. */
+    const unsigned char *data;   /**< Contents of the range in the dump. */
+} RetainRoot;
+
+/**
+ * The dump and the graph built from it.
+ */
+static struct {
+    unsigned char *file;     /**< Contents of the dump file. */
+    RetainSite *sites;       /**< Sites, indexed by id. */
+    uint32_t site_limit;     /**< Highest site id + 1. */
+    RetainNode *nodes;       /**< Node 0 followed by the blocks. */
+    uint32_t count;          /**< Number of nodes, including node 0. */
+    RetainRoot *roots;       /**< Root ranges. */
+    uint32_t root_count;     /**< Number of root ranges. */
+    size_t *offsets;         /**< First edge of each block, count + 1 entries. */
+    uint32_t *edges;         /**< Blocks pointed to, grouped by source. */
+    uint32_t *root_edges;    /**< Blocks pointed to by node 0. */
+    uint32_t root_edge_count; /**< Number of edges of node 0. */
+    uint64_t *root_word;     /**< Address of the root word pointing to a block, 0 if leaked. */
+    uint64_t leaked_count;   /**< Number of blocks no root reaches. */
+    uint64_t leaked_size;    /**< Bytes of those blocks. */
+} retain;
+
+/**
+ * Prints an error and exits.
+ */
+static void retain_fail(const char *message, const char *detail) {
+    fprintf(stderr, "memd_retain: %s%s%s\n", message, detail ? ": " : "", detail ? detail : "");
+    exit(1);
+}
+
+/**
+ * Allocates count elements of size bytes, exiting when out of memory.
+ */
+static void *retain_alloc(size_t count, size_t size) {
+    void *p = calloc(count > 0 ? count : 1, size);
+    if (p == NULL)
+        retain_fail("out of memory", NULL);
+    return p;
+}
+
+/**
+ * Formats a size in bytes, using KB, MB or GB with one decimal above 1 KB.
+ */
+static void retain_format_size(char *out, size_t capacity, uint64_t size) {
+    static const char *units[] = { "KB", "MB", "GB" };
+    double value = (double)size;
+    int unit = -1;
+    while (value >= 1024.0 && unit < 2) {
+        value /= 1024.0;
+        unit++;
+    }
+    if (unit < 0)
+        snprintf(out, capacity, "%llu bytes", (unsigned long long)size);
+    else
+        snprintf(out, capacity, "%.1f %s", value, units[unit]);
+}
+
+static int retain_compare_address(const void *a, const void *b) {
+    uint64_t x = ((const RetainNode *)a)->address;
+    uint64_t y = ((const RetainNode *)b)->address;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Reads the dump at path into the global tables.
+ */
+static void retain_load(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        retain_fail("cannot open", path);
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (length < (long)sizeof(MEMD_DumpHeader))
+        retain_fail("not a MEMD heap dump", path);
+    retain.file = (unsigned char *)retain_alloc((size_t)length, 1);
+    if (fread(retain.file, 1, (size_t)length, file) != (size_t)length)
+        retain_fail("cannot read", path);
+    fclose(file);
+
+    MEMD_DumpHeader header;
+    memcpy(&header, retain.file, sizeof(header));
+    if (memcmp(header.magic, MEMD_DUMP_MAGIC, sizeof(header.magic)) != 0)
+        retain_fail("not a MEMD heap dump", path);
+    if (header.version != MEMD_DUMP_VERSION || header.byte_order != MEMD_DUMP_BYTE_ORDER)
+        retain_fail("unsupported dump version or byte order", path);
+
+    // the first pass counts the records, the second one reads them
+    uint32_t block_count = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        size_t offset = sizeof(header);
+        uint32_t blocks = 0, roots = 0;
+        int ended = 0;
+        while (!ended && offset + sizeof(MEMD_DumpChunk) <= (size_t)length) {
+            MEMD_DumpChunk chunk;
+            memcpy(&chunk, retain.file + offset, sizeof(chunk));
+            offset += sizeof(chunk);
+            if (chunk.length > (size_t)length - offset)
+                retain_fail("truncated dump", path);
+            const unsigned char *payload = retain.file + offset;
+            offset += chunk.length;
+
+            // records are checked against the chunk, they may be cut short
+            size_t at = 0;
+            for (uint32_t i = 0; i < chunk.count; i++) {
+                const unsigned char *record = payload + at;
+                size_t left = (size_t)chunk.length - at;
+                size_t record_length;
+                if (memcmp(chunk.type, MEMD_DUMP_SITES, 4) == 0) {
+                    MEMD_DumpSite site;
+                    if (left < sizeof(site))
+                        retain_fail("truncated dump", path);
+                    memcpy(&site, record, sizeof(site));
+                    uint64_t strings_length = (uint64_t)site.file_length + site.func_length + site.type_length + site.tag_length;
+                    if (strings_length > left - sizeof(site))
+                        retain_fail("truncated dump", path);
+                    record_length = sizeof(site) + (size_t)strings_length;
+                    // the limit is one past the highest id, so the last id can't be used
+                    if (site.id == UINT32_MAX)
+                        retain_fail("bad site id in dump", path);
+                    if (pass == 0 && site.id >= retain.site_limit)
+                        retain.site_limit = site.id + 1;
+                    if (pass == 1 && site.id < retain.site_limit) {
+                        RetainSite *s = &retain.sites[site.id];
+                        const char *strings = (const char *)record + sizeof(site);
+                        s->line = site.line;
+                        s->file = strings;
+                        s->file_length = site.file_length;
+                        s->func = strings + site.file_length;
+                        s->func_length = site.func_length;
+                        s->type = strings + site.file_length + site.func_length;
+                        s->type_length = site.type_length;
+                    }
+                } else {
+                    MEMD_DumpBlock block;
+                    if (left < sizeof(block))
+                        retain_fail("truncated dump", path);
+                    memcpy(&block, record, sizeof(block));
+                    if (block.stored > left - sizeof(block))
+                        retain_fail("truncated dump", path);
+                    record_length = sizeof(block) + (size_t)block.stored;
+                    if (memcmp(chunk.type, MEMD_DUMP_BLOCKS, 4) == 0) {
+                        if (pass == 1) {
+                            RetainNode *node = &retain.nodes[1 + blocks];
+                            node->address = block.address;
+                            node->size = block.size;
+                            node->stored = block.stored;
+                            node->data = record + sizeof(block);
+                            node->site = block.site < retain.site_limit ? &retain.sites[block.site] : NULL;
+                        }
+                        blocks++;
+                    } else if (memcmp(chunk.type, MEMD_DUMP_ROOTS, 4) == 0) {
+                        if (pass == 1) {
+                            retain.roots[roots].address = block.address;
+                            retain.roots[roots].size = block.stored;
+                            retain.roots[roots].data = record + sizeof(block);
+                        }
+                        roots++;
+                    }
+                }
+                // the padding of the last record may be missing
+                size_t padded = (record_length + 7) / 8 * 8;
+                at += padded < left ? padded : left;
+            }
+            ended = memcmp(chunk.type, MEMD_DUMP_END, 4) == 0;
+        }
+
+        if (pass == 0) {
+            block_count = blocks;
+            retain.sites = (RetainSite *)retain_alloc(retain.site_limit, sizeof(RetainSite));
+            retain.nodes = (RetainNode *)retain_alloc((size_t)block_count + 1, sizeof(RetainNode));
+            retain.roots = (RetainRoot *)retain_alloc(roots, sizeof(RetainRoot));
+            retain.count = block_count + 1;
+            retain.root_count = roots;
+        }
+    }
+
+    qsort(retain.nodes + 1, block_count, sizeof(RetainNode), retain_compare_address);
+}
+
+/**
+ * Finds the block containing address.
+ * @return Index of the node, or 0 if address points into no block.
+ */
+static uint32_t retain_node_at(uint64_t address) {
+    uint32_t low = 1, high = retain.count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (retain.nodes[mid].address <= address)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    if (low == 1)
+        return 0;
+    const RetainNode *node = &retain.nodes[low - 1];
+    if (address < node->address + node->size || address == node->address)
+        return low - 1;
+    return 0;
+}
+
+/**
+ * Nodes scanned by one thread, and whether edges are counted or stored.
+ */
+typedef struct {
+    uint32_t begin;  /**< First node of the slice. */
+    uint32_t end;    /**< Node after the slice. */
+    int store;       /**< 0 to count the edges into offsets, 1 to store them. */
+} RetainJob;
+
+/**
+ * Scans the contents of a slice of blocks for pointers to other blocks.
+ * Each thread only touches the offsets and edges of its own blocks.
+ */
+static void retain_scan(RetainJob *job) {
+    for (uint32_t v = job->begin; v < job->end; v++) {
+        const RetainNode *node = &retain.nodes[v];
+        size_t count = 0;
+        for (uint64_t offset = 0; offset + sizeof(void *) <= node->stored; offset += sizeof(void *)) {
+            uintptr_t word;
+            memcpy(&word, node->data + offset, sizeof(word));
+            uint32_t target = retain_node_at(word);
+            if (target == 0 || target == v)
+                continue;
+            if (job->store)
+                retain.edges[retain.offsets[v] + count] = target;
+            count++;
+        }
+        if (!job->store)
+            retain.offsets[v + 1] = count;
+    }
+}
+
+#ifdef _WIN32
+typedef HANDLE RetainThread;
+
+static DWORD WINAPI retain_thread_main(LPVOID arg) {
+    retain_scan((RetainJob *)arg);
+    return 0;
+}
+
+static int retain_thread_start(RetainThread *thread, RetainJob *job) {
+    *thread = CreateThread(NULL, 0, retain_thread_main, job, 0, NULL);
+    return *thread != NULL ? 0 : -1;
+}
+
+static void retain_thread_join(RetainThread thread) {
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+}
+
+static int retain_cpu_count() {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+}
+#else
+typedef pthread_t RetainThread;
+
+static void *retain_thread_main(void *arg) {
+    retain_scan((RetainJob *)arg);
+    return NULL;
+}
+
+static int retain_thread_start(RetainThread *thread, RetainJob *job) {
+    return pthread_create(thread, NULL, retain_thread_main, job) == 0 ? 0 : -1;
+}
+
+static void retain_thread_join(RetainThread thread) {
+    pthread_join(thread, NULL);
+}
+
+static int retain_cpu_count() {
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+}
+#endif
+
+/**
+ * Runs retain_scan over all blocks, split into slices of about the same
+ * number of content bytes, one per thread.
+ */
+static void retain_scan_parallel(int thread_count, int store) {
+    RetainJob jobs[64];
+    RetainThread threads[64];
+    if (thread_count > 64)
+        thread_count = 64;
+
+    uint64_t total = 0;
+    for (uint32_t v = 1; v < retain.count; v++)
+        total += retain.nodes[v].stored + 1;
+    uint64_t share = total / (uint64_t)thread_count + 1;
+
+    int job_count = 0;
+    uint32_t begin = 1;
+    uint64_t bytes = 0;
+    for (uint32_t v = 1; v <= retain.count; v++) {
+        if (v == retain.count || (bytes >= share && job_count < thread_count - 1)) {
+            jobs[job_count].begin = begin;
+            jobs[job_count].end = v;
+            jobs[job_count].store = store;
+            job_count++;
+            begin = v;
+            bytes = 0;
+        }
+        if (v < retain.count)
+            bytes += retain.nodes[v].stored + 1;
+    }
+
+    // the first slice is scanned by the calling thread
+    int started = 1;
+    while (started < job_count && retain_thread_start(&threads[started], &jobs[started]) == 0)
+        started++;
+    retain_scan(&jobs[0]);
+    for (int i = started; i < job_count; i++)
+        retain_scan(&jobs[i]);
+    for (int i = 1; i < started; i++)
+        retain_thread_join(threads[i]);
+}
+
+/**
+ * Adds an edge from node 0 to a block, remembering the root word pointing to it.
+ */
+static void retain_add_root_edge(uint32_t target, uint64_t word) {
+    retain.root_edges[retain.root_edge_count++] = target;
+    retain.root_word[target] = word;
+}
+
+/**
+ * Builds the pointer graph: the block edges in CSR form and the edges of
+ * node 0 to the blocks the root ranges point to.
+ */
+static void retain_build(int thread_count) {
+    retain.offsets = (size_t *)retain_alloc((size_t)retain.count + 1, sizeof(size_t));
+    retain_scan_parallel(thread_count, 0);
+    for (uint32_t v = 1; v < retain.count; v++)
+        retain.offsets[v + 1] += retain.offsets[v];
+    retain.edges = (uint32_t *)retain_alloc(retain.offsets[retain.count], sizeof(uint32_t));
+    retain_scan_parallel(thread_count, 1);
+
+    retain.root_edges = (uint32_t *)retain_alloc(retain.count, sizeof(uint32_t));
+    retain.root_word = (uint64_t *)retain_alloc(retain.count, sizeof(uint64_t));
+    for (uint32_t r = 0; r < retain.root_count; r++) {
+        const RetainRoot *root = &retain.roots[r];
+        for (uint64_t offset = 0; offset + sizeof(void *) <= root->size; offset += sizeof(void *)) {
+            uintptr_t word;
+            memcpy(&word, root->data + offset, sizeof(word));
+            uint32_t target = retain_node_at(word);
+            if (target != 0 && retain.root_word[target] == 0)
+                retain_add_root_edge(target, root->address + offset);
+        }
+    }
+}
+
+/**
+ * Visits the blocks reachable from the queued ones breadth first, recording
+ * the parent of each block on a shortest path from node 0.
+ * @return The new end of the queue.
+ */
+static uint32_t retain_bfs(uint32_t *queue, uint32_t head, uint32_t tail, uint32_t *parent) {
+    while (head < tail) {
+        uint32_t v = queue[head++];
+        for (size_t e = retain.offsets[v]; e < retain.offsets[v + 1]; e++) {
+            uint32_t target = retain.edges[e];
+            if (parent[target] == UINT32_MAX) {
+                parent[target] = v;
+                queue[tail++] = target;
+            }
+        }
+    }
+    return tail;
+}
+
+/**
+ * Finds shortest paths from node 0, attaching the blocks no root reaches.
+ * Leaked blocks nothing points to become edges of node 0, then the remaining
+ * leaked cycles get an edge to their first block.
+ * @return Parent of each node on a shortest path from node 0.
+ */
+static uint32_t *retain_paths() {
+    uint32_t *parent = (uint32_t *)retain_alloc(retain.count, sizeof(uint32_t));
+    uint32_t *queue = (uint32_t *)retain_alloc(retain.count, sizeof(uint32_t));
+    uint32_t *in_degree = (uint32_t *)retain_alloc(retain.count, sizeof(uint32_t));
+    for (uint32_t v = 0; v < retain.count; v++)
+        parent[v] = UINT32_MAX;
+    for (size_t e = 0; e < retain.offsets[retain.count]; e++)
+        in_degree[retain.edges[e]]++;
+
+    parent[0] = 0;
+    uint32_t tail = 0;
+    for (uint32_t i = 0; i < retain.root_edge_count; i++) {
+        parent[retain.root_edges[i]] = 0;
+        queue[tail++] = retain.root_edges[i];
+    }
+    tail = retain_bfs(queue, 0, tail, parent);
+    for (uint32_t v = 1; v < retain.count; v++) {
+        if (parent[v] == UINT32_MAX) {
+            retain.leaked_count++;
+            retain.leaked_size += retain.nodes[v].size;
+        }
+    }
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t v = 1; v < retain.count; v++) {
+            if (parent[v] != UINT32_MAX || (pass == 0 && in_degree[v] != 0))
+                continue;
+            retain_add_root_edge(v, 0);
+            parent[v] = 0;
+            queue[tail] = v;
+            tail = retain_bfs(queue, tail, tail + 1, parent);
+        }
+    }
+
+    free(queue);
+    free(in_degree);
+    return parent;
+}
+
+/**
+ * Dominator tree and retained sizes, indexed by depth-first preorder number.
+ */
+static struct {
+    uint32_t *vertex;    /**< Node of each preorder number. */
+    uint32_t *idom;      /**< Preorder number of the immediate dominator. */
+    uint64_t *size;      /**< Retained bytes. */
+    uint64_t *count;     /**< Retained blocks. */
+} tree;
+
+/**
+ * Computes the dominator tree with the semi-NCA algorithm, then sums the
+ * retained sizes up the tree.
+ */
+static void retain_dominators() {
+    uint32_t n = retain.count;
+    uint32_t *pre = (uint32_t *)retain_alloc(n, sizeof(uint32_t));
+    uint32_t *parent = (uint32_t *)retain_alloc(n, sizeof(uint32_t));
+    uint32_t *semi = (uint32_t *)retain_alloc(n, sizeof(uint32_t));
+    uint32_t *label = (uint32_t *)retain_alloc(n, sizeof(uint32_t));
+    uint32_t *ancestor = (uint32_t *)retain_alloc(n, sizeof(uint32_t));
+    uint32_t *stack = (uint32_t *)retain_alloc(n, sizeof(uint32_t));
+    size_t *cursor = (size_t *)retain_alloc(n, sizeof(size_t));
+    tree.vertex = (uint32_t *)retain_alloc(n, sizeof(uint32_t));
+    tree.idom = (uint32_t *)retain_alloc(n, sizeof(uint32_t));
+
+    // iterative depth-first search numbering the nodes in preorder
+    for (uint32_t v = 0; v < n; v++)
+        pre[v] = UINT32_MAX;
+    uint32_t number = 0, depth = 0;
+    pre[0] = number;
+    tree.vertex[number++] = 0;
+    stack[depth++] = 0;
+    while (depth > 0) {
+        uint32_t v = stack[depth - 1];
+        size_t end = v == 0 ? retain.root_edge_count : retain.offsets[v + 1];
+        if (v != 0 && cursor[v] == 0)
+            cursor[v] = retain.offsets[v];
+        if (cursor[v] == end) {
+            depth--;
+            continue;
+        }
+        uint32_t target = v == 0 ? retain.root_edges[cursor[v]++] : retain.edges[cursor[v]++];
+        if (pre[target] == UINT32_MAX) {
+            parent[number] = pre[v];
+            pre[target] = number;
+            tree.vertex[number++] = target;
+            stack[depth++] = target;
+        }
+    }
+    free(cursor);
+
+    // predecessors in preorder numbers, in CSR form
+    size_t *pred_offsets = (size_t *)retain_alloc((size_t)n + 1, sizeof(size_t));
+    for (uint32_t i = 0; i < retain.root_edge_count; i++)
+        pred_offsets[pre[retain.root_edges[i]] + 1]++;
+    for (size_t e = 0; e < retain.offsets[n]; e++)
+        pred_offsets[pre[retain.edges[e]] + 1]++;
+    for (uint32_t i = 0; i < n; i++)
+        pred_offsets[i + 1] += pred_offsets[i];
+    uint32_t *preds = (uint32_t *)retain_alloc(pred_offsets[n], sizeof(uint32_t));
+    size_t *fill = (size_t *)retain_alloc(n, sizeof(size_t));
+    memcpy(fill, pred_offsets, (size_t)n * sizeof(size_t));
+    for (uint32_t i = 0; i < retain.root_edge_count; i++)
+        preds[fill[pre[retain.root_edges[i]]]++] = 0;
+    for (uint32_t v = 1; v < n; v++) {
+        for (size_t e = retain.offsets[v]; e < retain.offsets[v + 1]; e++)
+            preds[fill[pre[retain.edges[e]]]++] = pre[v];
+    }
+    free(fill);
+
+    // semidominators, evaluated over a path-compressed forest of processed nodes
+    for (uint32_t i = 0; i < n; i++) {
+        semi[i] = i;
+        label[i] = i;
+        ancestor[i] = UINT32_MAX;
+    }
+    for (uint32_t i = n - 1; i > 0; i--) {
+        for (size_t e = pred_offsets[i]; e < pred_offsets[i + 1]; e++) {
+            uint32_t u = preds[e];
+            if (ancestor[u] != UINT32_MAX) {
+                // compress the path from u, topmost node first
+                depth = 0;
+                for (uint32_t x = u; ancestor[ancestor[x]] != UINT32_MAX; x = ancestor[x])
+                    stack[depth++] = x;
+                while (depth > 0) {
+                    uint32_t x = stack[--depth];
+                    uint32_t a = ancestor[x];
+                    if (semi[label[a]] < semi[label[x]])
+                        label[x] = label[a];
+                    ancestor[x] = ancestor[a];
+                }
+                u = label[u];
+            }
+            if (semi[u] < semi[i])
+                semi[i] = semi[u];
+        }
+        ancestor[i] = parent[i];
+    }
+
+    // the immediate dominator is the nearest common ancestor of parent and semidominator
+    tree.idom[0] = 0;
+    for (uint32_t i = 1; i < n; i++) {
+        uint32_t d = parent[i];
+        while (d > semi[i])
+            d = tree.idom[d];
+        tree.idom[i] = d;
+    }
+
+    tree.size = (uint64_t *)retain_alloc(n, sizeof(uint64_t));
+    tree.count = (uint64_t *)retain_alloc(n, sizeof(uint64_t));
+    for (uint32_t i = n - 1; i > 0; i--) {
+        tree.size[i] += retain.nodes[tree.vertex[i]].size;
+        tree.count[i] += 1;
+        tree.size[tree.idom[i]] += tree.size[i];
+        tree.count[tree.idom[i]] += tree.count[i];
+    }
+
+    free(pre);
+    free(parent);
+    free(semi);
+    free(label);
+    free(ancestor);
+    free(stack);
+    free(pred_offsets);
+    free(preds);
+}
+
+/**
+ * Prints a block as file:line (func) <type>.
+ */
+static void retain_print_node(uint32_t v) {
+    const RetainSite *site = retain.nodes[v].site;
+    if (site == NULL || site->file_length == 0) {
+        printf("0x%llx", (unsigned long long)retain.nodes[v].address);
+        return;
+    }
+    printf("%.*s:%u", (int)site->file_length, site->file, site->line);
+    if (site->func_length > 0)
+        printf(" (%.*s)", (int)site->func_length, site->func);
+    if (site->type_length > 0)
+        printf(" <%.*s>", (int)site->type_length, site->type);
+}
+
+/**
+ * Prints the shortest path from the roots to a block, eliding the middle of
+ * long paths.
+ */
+static void retain_print_path(uint32_t v, const uint32_t *parent, uint32_t *path) {
+    uint32_t length = 0;
+    for (uint32_t x = v; x != 0; x = parent[x])
+        path[length++] = x;
+
+    uint32_t first = path[length - 1];
+    if (retain.root_word[first] != 0)
+        printf("        path: root 0x%llx", (unsigned long long)retain.root_word[first]);
+    else
+        printf("        path: unreachable");
+    for (uint32_t i = length; i > 0; i--) {
+        if (length > 6 && i == length - 3) {
+            printf("\n          ... %u more", length - 6);
+            i = 3;
+        }
+        printf("\n          -> ");
+        retain_print_node(path[i - 1]);
+    }
+    printf("\n");
+}
+
+/**
+ * Lists the top blocks by retained size, selected with a min-heap of size top.
+ */
+static void retain_report(uint32_t top, const uint32_t *parent) {
+    uint32_t n = retain.count;
+    uint32_t *heap = (uint32_t *)retain_alloc(top, sizeof(uint32_t));
+    uint32_t heap_size = 0;
+    for (uint32_t i = 1; i < n; i++) {
+        if (heap_size == top && tree.size[i] <= tree.size[heap[0]])
+            continue;
+        uint32_t slot;
+        if (heap_size < top) {
+            slot = heap_size++;
+            while (slot > 0 && tree.size[heap[(slot - 1) / 2]] > tree.size[i]) {
+                heap[slot] = heap[(slot - 1) / 2];
+                slot = (slot - 1) / 2;
+            }
+        } else {
+            slot = 0;
+            for (;;) {
+                uint32_t child = slot * 2 + 1;
+                if (child >= heap_size)
+                    break;
+                if (child + 1 < heap_size && tree.size[heap[child + 1]] < tree.size[heap[child]])
+                    child++;
+                if (tree.size[heap[child]] >= tree.size[i])
+                    break;
+                heap[slot] = heap[child];
+                slot = child;
+            }
+        }
+        heap[slot] = i;
+    }
+
+    // heap order to descending retained size
+    for (uint32_t i = 1; i < heap_size; i++) {
+        uint32_t value = heap[i], j = i;
+        while (j > 0 && tree.size[heap[j - 1]] < tree.size[value]) {
+            heap[j] = heap[j - 1];
+            j--;
+        }
+        heap[j] = value;
+    }
+
+    uint64_t total = 0;
+    for (uint32_t v = 1; v < n; v++)
+        total += retain.nodes[v].size;
+
+    char size[32], retained[32];
+    printf("\n----------------------------------\n");
+    printf("MEMD Retained Sizes:\n");
+    printf("----------------------------------\n\n");
+    retain_format_size(size, sizeof(size), total);
+    printf("   Blocks   %u (%s)\n", n - 1, size);
+    printf("   Pointers %llu\n", (unsigned long long)(retain.offsets[n] + retain.root_edge_count));
+    printf("   Roots    %u ranges\n", retain.root_count);
+    retain_format_size(size, sizeof(size), retain.leaked_size);
+    printf("   Leaked   %llu blocks (%s) no root reaches\n", (unsigned long long)retain.leaked_count, size);
+
+    printf("\n   Top Retainers:\n");
+    uint32_t *path = (uint32_t *)retain_alloc(n, sizeof(uint32_t));
+    for (uint32_t k = 0; k < heap_size; k++) {
+        uint32_t i = heap[k];
+        uint32_t v = tree.vertex[i];
+        retain_format_size(size, sizeof(size), retain.nodes[v].size);
+        retain_format_size(retained, sizeof(retained), tree.size[i]);
+        printf("     %u. 0x%llx ", k + 1, (unsigned long long)retain.nodes[v].address);
+        retain_print_node(v);
+        printf(": %s, retains %llu blocks (%s)\n", size, (unsigned long long)tree.count[i], retained);
+        retain_print_path(v, parent, path);
+    }
+    printf("\n----------------------------------\n");
+    free(path);
+    free(heap);
+}
+
+int main(int argc, char **argv) {
+    uint32_t top = 20;
+    int thread_count = retain_cpu_count();
+    const char *path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            top = (uint32_t)strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+            thread_count = atoi(argv[++i]);
+        else
+            path = argv[i];
+    }
+    if (path == NULL || top == 0 || thread_count < 1) {
+        fprintf(stderr, "usage: memd_retain [-n top] [-j threads] dump\n");
+        return 2;
+    }
+
+    retain_load(path);
+    retain_build(thread_count);
+    uint32_t *parent = retain_paths();
+    retain_dominators();
+    retain_report(top, parent);
+    return 0;
+}